@@ -0,0 +1,38 @@
+#!/bin/sh
+# Compares the latency of one-shot runs with the jobs submitted to a daemon
+# holding the board open. Usage: daemon_latency.sh <iceFUNprog2> [runs]
+
+set -e
+
+PROG=${1:?usage: $0 <iceFUNprog2> [runs]}
+RUNS=${2:-20}
+SOCKET=${TMPDIR:-/tmp}/icefun-bench.$$.sock
+
+now_ms() {
+    date +%s%3N
+}
+
+average() {
+    # $1 command to run, repeated $RUNS times
+    start=$(now_ms)
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        $1 > /dev/null
+        i=$((i + 1))
+    done
+    echo $(( ($(now_ms) - start) / RUNS ))
+}
+
+ONE_SHOT=$(average "$PROG -c")
+
+"$PROG" --daemon "$SOCKET" > /dev/null &
+DAEMON=$!
+trap 'kill $DAEMON 2>/dev/null; wait $DAEMON 2>/dev/null' EXIT
+while [ ! -S "$SOCKET" ]; do
+    sleep 0.1
+done
+
+CLIENT=$(average "$PROG --client $SOCKET -c")
+
+echo "one-shot: ${ONE_SHOT} ms/job"
+echo "daemon:   ${CLIENT} ms/job"
@@ -0,0 +1,629 @@
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+// Measures the throughput of the board operations across image sizes, image
+// contents and queue depths, and prints the results as JSON. The operations
+// run through IceFunProgrammer like the command line's do. Runs against the
+// simulated board unless told to use a real one, which gets its flash
+// overwritten.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <random>
+
+#include "cdcacm.hpp"
+#include "icefun.hpp"
+#include "programmer.hpp"
+#include "simdevice.hpp"
+
+#ifndef BITSTREAMS_DIR
+#define BITSTREAMS_DIR "bistreams"
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+struct Image {
+    std::string name;
+    std::vector<std::uint8_t> data;
+};
+
+struct Result {
+    std::string op {};
+    std::string image {};
+    std::string strategy {};
+    std::uint32_t size {};
+    std::uint32_t commands {};
+    std::uint64_t elapsed_usec {};
+    // Of every exchange with the board
+    std::vector<std::uint32_t> latencies_usec {};
+    // As the programmer reports them
+    std::vector<PhaseTiming> phases {};
+    bool ok {};
+};
+
+std::uint64_t usec_since(Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               Clock::now() - start)
+        .count();
+}
+
+std::uint32_t percentile(std::vector<std::uint32_t> values, unsigned pct) {
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, values.size() * pct / 100)];
+}
+
+// Passes the traffic of the programmer on to the board, counting the
+// commands that really go out and timing every exchange from sending its
+// command to receiving its reply. A batch sent with transact() is timed as
+// one exchange.
+class TimedTransport : public Transport {
+  public:
+    explicit TimedTransport(std::shared_ptr<Transport> inner) :
+        _inner(std::move(inner)) {
+    }
+
+    // Starts counting and timing anew
+    void reset() {
+        _commands = 0;
+        _latencies_usec.clear();
+        _command_start.reset();
+    }
+
+    std::uint32_t commands() const {
+        return _commands;
+    }
+
+    const std::vector<std::uint32_t>& latencies_usec() const {
+        return _latencies_usec;
+    }
+
+    // The single commands are sent in one piece and get their reply before
+    // the next one goes
+    std::size_t send(
+        const std::uint8_t* data,
+        std::size_t size,
+        int timeout_msec = 0) override {
+        if (size && !_command_start) {
+            _command_start = Clock::now();
+            ++_commands;
+        }
+        return _inner->send(data, size, timeout_msec);
+    }
+
+    std::size_t receive(
+        std::uint8_t* data,
+        std::size_t size,
+        int timeout_msec = 0) override {
+        const auto received = _inner->receive(data, size, timeout_msec);
+        if (_command_start) {
+            _latencies_usec.push_back(usec_since(*_command_start));
+            _command_start.reset();
+        }
+        return received;
+    }
+
+    const std::string& serial() const override {
+        return _inner->serial();
+    }
+
+    std::string location() const override {
+        return _inner->location();
+    }
+
+    std::size_t transact(
+        const std::uint8_t* frames,
+        std::size_t frames_size,
+        std::uint8_t* replies,
+        std::size_t replies_size,
+        int timeout_msec = 0) override {
+        for (std::size_t pos = 0; pos < frames_size;
+             pos += command_frame_size(frames[pos])) {
+            ++_commands;
+        }
+
+        const auto start = Clock::now();
+        const auto received = _inner->transact(
+            frames,
+            frames_size,
+            replies,
+            replies_size,
+            timeout_msec);
+        _latencies_usec.push_back(usec_since(start));
+        return received;
+    }
+
+    // The exchanges are timed from composing the command to checking the
+    // reply, which includes the time spent queued behind the others
+    std::size_t pipeline(
+        std::size_t count,
+        std::uint16_t header_size,
+        std::uint16_t payload_size,
+        std::uint16_t reply_size,
+        const FillFrame& fill,
+        const CheckReply& check,
+        std::size_t depth) override {
+        std::vector<Clock::time_point> started(std::max<std::size_t>(depth, 1));
+
+        return _inner->pipeline(
+            count,
+            header_size,
+            payload_size,
+            reply_size,
+            [&](std::size_t idx, std::uint8_t* frame) {
+                started[idx % started.size()] = Clock::now();
+                ++_commands;
+                return fill(idx, frame);
+            },
+            [&](std::size_t idx, const std::uint8_t* reply) {
+                _latencies_usec.push_back(
+                    usec_since(started[idx % started.size()]));
+                return check(idx, reply);
+            },
+            depth);
+    }
+
+    void submit(
+        const std::uint8_t* header,
+        std::uint16_t header_size,
+        const std::uint8_t* payload,
+        std::uint16_t payload_size,
+        std::uint8_t* reply,
+        std::uint16_t reply_size,
+        Completion done,
+        int timeout_msec = 0) override {
+        const auto start = Clock::now();
+        ++_commands;
+        _inner->submit(
+            header,
+            header_size,
+            payload,
+            payload_size,
+            reply,
+            reply_size,
+            [this, start, done = std::move(done)](bool ok) {
+                _latencies_usec.push_back(usec_since(start));
+                done(ok);
+            },
+            timeout_msec);
+    }
+
+    void poll(int timeout_msec) override {
+        _inner->poll(timeout_msec);
+    }
+
+    void cancel() override {
+        _inner->cancel();
+    }
+
+    bool resync() override {
+        _command_start.reset();
+        return _inner->resync();
+    }
+
+  private:
+    std::shared_ptr<Transport> _inner;
+    std::uint32_t _commands {};
+    std::vector<std::uint32_t> _latencies_usec;
+    std::optional<Clock::time_point> _command_start;
+};
+
+// The board as the programmers of the bench talk to it
+TimedTransport& timed(IceFunProgrammer& programmer) {
+    return static_cast<TimedTransport&>(*programmer.device());
+}
+
+// Runs the operation of the programmer once, timing it as a whole and
+// every exchange it makes
+template <typename Operation>
+Result measure(
+    IceFunProgrammer& programmer,
+    const std::string& op,
+    const std::string& image,
+    const std::string& strategy,
+    std::uint32_t size,
+    const Operation& operation) {
+    Result result;
+    result.op = op;
+    result.image = image;
+    result.strategy = strategy;
+    result.size = size;
+
+    auto& dev = timed(programmer);
+    dev.reset();
+    const auto start = Clock::now();
+    const OperationResult outcome = operation();
+    result.elapsed_usec = usec_since(start);
+    result.ok = outcome.ok;
+    result.commands = dev.commands();
+    result.latencies_usec = dev.latencies_usec();
+    result.phases = outcome.phases;
+
+    return result;
+}
+
+Result cycle(IceFunProgrammer& programmer, std::uint32_t count) {
+    auto result = measure(programmer, "cycle", "", "sequential", 0, [&] {
+        OperationResult outcome;
+        outcome.ok = true;
+        for (auto idx = 0u; idx < count && outcome.ok; ++idx) {
+            outcome = programmer.cycle();
+        }
+        return outcome;
+    });
+    result.phases.clear();
+
+    return result;
+}
+
+// Erases the sectors the image covers. With `blank_check`, the sectors are
+// read first and only those holding data get erased.
+Result erase(
+    IceFunProgrammer& programmer,
+    const Image& image,
+    std::uint32_t size,
+    bool blank_check) {
+    auto& options = programmer.options();
+    options.blank_check = blank_check;
+    options.chip_erase = false;
+
+    auto result = measure(
+        programmer,
+        "erase",
+        image.name,
+        blank_check ? "blank-check" : "sectors",
+        size,
+        [&] { return programmer.erase(0, size); });
+
+    options.blank_check = false;
+    return result;
+}
+
+std::string depth_strategy(std::size_t depth) {
+    return "depth-" + std::to_string(depth);
+}
+
+// Erases and programs the image the way the command line does, leaving out
+// the pages that stay blank, without verifying it
+Result write(
+    IceFunProgrammer& programmer,
+    const Image& image,
+    std::uint32_t size,
+    std::size_t depth) {
+    auto& options = programmer.options();
+    options.queue_depth = depth;
+    options.verify = VerifyMode::NONE;
+
+    return measure(
+        programmer,
+        "write",
+        image.name,
+        depth_strategy(depth),
+        size,
+        [&] { return programmer.write(0, {image.data.data(), size}); });
+}
+
+Result verify(
+    IceFunProgrammer& programmer,
+    const Image& image,
+    std::uint32_t size,
+    std::size_t depth,
+    VerifyMode mode) {
+    programmer.options().queue_depth = depth;
+
+    return measure(
+        programmer,
+        "verify",
+        image.name,
+        std::string(verify_mode_name(mode)) + "-" + depth_strategy(depth),
+        size,
+        [&] { return programmer.verify(0, {image.data.data(), size}, mode); });
+}
+
+// Reads the image back, and checks it came back as written
+Result read(
+    IceFunProgrammer& programmer,
+    const Image& image,
+    std::uint32_t size,
+    std::size_t depth) {
+    programmer.options().queue_depth = depth;
+
+    std::vector<std::uint8_t> data(size);
+    auto result = measure(
+        programmer,
+        "read",
+        image.name,
+        depth_strategy(depth),
+        size,
+        [&] { return programmer.read(0, data); });
+    result.ok = result.ok
+        && std::equal(data.begin(), data.end(), image.data.begin());
+
+    return result;
+}
+
+std::vector<Image> make_images(const std::string& bitstreams_dir) {
+    std::vector<Image> images;
+    std::minstd_rand rng(1);
+
+    Image random {"random", std::vector<std::uint8_t>(MAX_FLASH_SIZE_BYTES)};
+    for (auto& byte : random.data) {
+        byte = rng();
+    }
+    images.push_back(std::move(random));
+
+    // One page in sixteen holds data, like a small design
+    Image blank {
+        "mostly-blank",
+        std::vector<std::uint8_t>(MAX_FLASH_SIZE_BYTES, 0xff)};
+    for (auto addr = 0u; addr < MAX_FLASH_SIZE_BYTES;
+         addr += 16 * PAGE_SIZE_BYTES) {
+        for (auto idx = 0u; idx < PAGE_SIZE_BYTES; ++idx) {
+            blank.data[addr + idx] = rng();
+        }
+    }
+    images.push_back(std::move(blank));
+
+    std::error_code error;
+    std::vector<std::filesystem::path> paths;
+    for (const auto& entry :
+         std::filesystem::directory_iterator(bitstreams_dir, error)) {
+        if (entry.path().extension() == ".bin") {
+            paths.push_back(entry.path());
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    for (const auto& path : paths) {
+        std::ifstream f(path, std::ios::binary);
+        Image bitstream {
+            path.filename().string(),
+            std::vector<std::uint8_t>(
+                std::istreambuf_iterator<char>(f),
+                std::istreambuf_iterator<char>())};
+        if (!bitstream.data.empty()
+            && bitstream.data.size() <= MAX_FLASH_SIZE_BYTES) {
+            images.push_back(std::move(bitstream));
+        }
+    }
+
+    return images;
+}
+
+void print_json(
+    FILE* out,
+    const std::string& transport,
+    const std::vector<Result>& results) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"tool\": \"iceFUNprog2_bench\",\n");
+    fprintf(out, "  \"version\": \"%s\",\n", VERSION);
+    fprintf(out, "  \"transport\": \"%s\",\n", transport.c_str());
+    fprintf(out, "  \"results\": [");
+    for (std::size_t idx = 0; idx < results.size(); ++idx) {
+        const auto& result = results[idx];
+        const auto seconds = result.elapsed_usec / 1e6;
+
+        fprintf(
+            out,
+            "%s\n    {\"op\": \"%s\", \"image\": \"%s\", "
+            "\"strategy\": \"%s\", \"size\": %u, \"ok\": %s, "
+            "\"commands\": %u, \"elapsed_usec\": %llu, "
+            "\"bytes_per_sec\": %.0f, \"pages_per_sec\": %.1f, "
+            "\"commands_per_sec\": %.1f, ",
+            idx ? "," : "",
+            result.op.c_str(),
+            result.image.c_str(),
+            result.strategy.c_str(),
+            result.size,
+            result.ok ? "true" : "false",
+            result.commands,
+            (unsigned long long)result.elapsed_usec,
+            seconds > 0 ? result.size / seconds : 0,
+            seconds > 0 ? result.size / PAGE_SIZE_BYTES / seconds : 0,
+            seconds > 0 ? result.commands / seconds : 0);
+        if (result.latencies_usec.empty()) {
+            fprintf(out, "\"p50_usec\": null, \"p99_usec\": null, ");
+        } else {
+            fprintf(
+                out,
+                "\"p50_usec\": %u, \"p99_usec\": %u, ",
+                percentile(result.latencies_usec, 50),
+                percentile(result.latencies_usec, 99));
+        }
+        fprintf(out, "\"phases\": [");
+        for (std::size_t phase_idx = 0; phase_idx < result.phases.size();
+             ++phase_idx) {
+            const auto& phase = result.phases[phase_idx];
+            fprintf(
+                out,
+                "%s{\"phase\": \"%s\", \"bytes\": %llu, "
+                "\"elapsed_msec\": %lld}",
+                phase_idx ? ", " : "",
+                phase.phase.c_str(),
+                (unsigned long long)phase.bytes,
+                (long long)phase.elapsed.count());
+        }
+        fprintf(out, "]}");
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+void usage(const char* prog_name) {
+    fprintf(stderr, "Usage: %s [options]\n", prog_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(
+        stderr,
+        "  --device            Use the connected board, its flash gets overwritten.\n");
+    fprintf(
+        stderr,
+        "  --timings <name>    Timings of the simulated board: 'none' (default) or 'at25sf081'.\n");
+    fprintf(
+        stderr,
+        "  --bitstreams <dir>  Where to take the bitstreams from, '%s' by default.\n",
+        BITSTREAMS_DIR);
+    fprintf(
+        stderr,
+        "  --max-size <bytes>  Largest synthetic image, 1048576 by default.\n");
+    fprintf(
+        stderr,
+        "  -o <file>           Where to write the JSON, stdout by default.\n");
+}
+
+int main(int argc, char** argv) try {
+    auto use_device = false;
+    std::string timings = "none";
+    std::string bitstreams_dir = BITSTREAMS_DIR;
+    std::uint32_t max_size = MAX_FLASH_SIZE_BYTES;
+    std::string out_path;
+
+    for (auto argi = 1; argi < argc; ++argi) {
+        const auto has_value = argi + 1 < argc;
+        if (!strcmp(argv[argi], "--device")) {
+            use_device = true;
+        } else if (!strcmp(argv[argi], "--timings") && has_value) {
+            timings = argv[++argi];
+        } else if (!strcmp(argv[argi], "--bitstreams") && has_value) {
+            bitstreams_dir = argv[++argi];
+        } else if (!strcmp(argv[argi], "--max-size") && has_value) {
+            max_size = std::min(
+                MAX_FLASH_SIZE_BYTES,
+                (std::uint32_t)strtoul(argv[++argi], nullptr, 0));
+        } else if (!strcmp(argv[argi], "-o") && has_value) {
+            out_path = argv[++argi];
+        } else {
+            usage(argv[0]);
+            return strcmp(argv[argi], "-h") ? EXIT_FAILURE : EXIT_SUCCESS;
+        }
+    }
+
+    std::vector<Result> results;
+    std::unique_ptr<Usb> bus;
+    std::shared_ptr<Transport> dev;
+    std::string transport;
+
+    if (use_device) {
+        // Discovery opens and claims the board every time
+        Result discover;
+        discover.op = "discover";
+        discover.strategy = "sequential";
+        const auto start = Clock::now();
+        for (auto run = 0; run < 5; ++run) {
+            dev.reset();
+            bus = std::make_unique<Usb>();
+
+            const auto run_start = Clock::now();
+            bus->open();
+            const auto devices = bus->find(ICEFUN_VENDOR_ID, ICEFUN_PRODUCT_ID);
+            discover.latencies_usec.push_back(usec_since(run_start));
+            if (devices.size() != 1) {
+                throw std::runtime_error("Connect exactly one board");
+            }
+            dev = devices.front();
+        }
+        discover.elapsed_usec = usec_since(start);
+        discover.commands = discover.latencies_usec.size();
+        discover.ok = true;
+        results.push_back(discover);
+
+        transport = "usb:" + dev->location();
+    } else {
+        dev = std::make_shared<SimulatedDevice>(
+            "SIM00000",
+            SimTimings::named(timings));
+        transport = "sim:" + timings;
+    }
+
+    // Quiet but for the errors
+    ProgrammerCallbacks callbacks;
+    callbacks.log = [](LogLevel level, const std::string& message) {
+        if (level == LogLevel::ERROR) {
+            fprintf(stderr, "%s\n", message.c_str());
+        }
+    };
+    IceFunProgrammer programmer(
+        std::make_shared<TimedTransport>(dev),
+        {},
+        callbacks);
+
+    results.push_back(cycle(programmer, 10));
+
+    std::vector<std::uint32_t> sizes;
+    for (std::uint32_t size = 4096; size <= max_size; size *= 4) {
+        sizes.push_back(size);
+    }
+    if (sizes.empty() || sizes.back() != max_size) {
+        sizes.push_back(max_size);
+    }
+
+    for (const auto& image : make_images(bitstreams_dir)) {
+        // The bitstreams are measured at their own size only
+        std::vector<std::uint32_t> image_sizes = sizes;
+        if (image.data.size() != MAX_FLASH_SIZE_BYTES) {
+            image_sizes = {(std::uint32_t)image.data.size()};
+        }
+
+        for (const auto size : image_sizes) {
+            fprintf(stderr, "%s, %u bytes\n", image.name.c_str(), size);
+
+            results.push_back(erase(programmer, image, size, false));
+
+            for (const std::size_t depth : {1, 8, 32}) {
+                results.push_back(write(programmer, image, size, depth));
+                results.push_back(verify(
+                    programmer,
+                    image,
+                    size,
+                    depth,
+                    VerifyMode::DEVICE));
+                results.push_back(read(programmer, image, size, depth));
+            }
+            for (const auto mode : {VerifyMode::READBACK, VerifyMode::HASH}) {
+                results.push_back(verify(
+                    programmer,
+                    image,
+                    size,
+                    DEFAULT_QUEUE_DEPTH,
+                    mode));
+            }
+
+            // The sectors hold the image now
+            results.push_back(erase(programmer, image, size, true));
+        }
+    }
+
+    FILE* out = stdout;
+    if (!out_path.empty()) {
+        out = fopen(out_path.c_str(), "w");
+        if (!out) {
+            throw std::runtime_error("Cannot open '" + out_path + "'");
+        }
+    }
+    print_json(out, transport, results);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return std::all_of(
+               results.begin(),
+               results.end(),
+               [](const Result& result) { return result.ok; })
+        ? EXIT_SUCCESS
+        : EXIT_FAILURE;
+} catch (const std::exception& e) {
+    fprintf(stderr, "Error: %s\n", e.what());
+    return EXIT_FAILURE;
+}
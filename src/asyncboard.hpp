@@ -0,0 +1,229 @@
+#ifndef __ASYNCBOARD_HPP__
+#define __ASYNCBOARD_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+
+#include "eventloop.hpp"
+#include "icefun.hpp"
+#include "transport.hpp"
+
+// The commands of the board as coroutines, each an exchange run by the loop:
+//
+//     co_await board.prog_page(addr, page);
+//
+// The commands of the coroutines sharing the board go out in the order they
+// are awaited and are in flight together. The board must outlive them.
+class AsyncBoard {
+  public:
+    AsyncBoard(EventLoop& loop, std::shared_ptr<Transport> dev) :
+        _loop(loop),
+        _dev(std::move(dev)) {
+    }
+
+    const std::shared_ptr<Transport>& device() const {
+        return _dev;
+    }
+
+    Task<std::uint8_t> get_version() {
+        const std::uint8_t cmd = IceFunCommands::GET_VER;
+        std::uint8_t ver[2] {};
+        if (!co_await exchange(&cmd, 1, ver, sizeof(ver)) || ver[0] != 38) {
+            throw std::runtime_error("Unable to get board version");
+        }
+        co_return ver[1];
+    }
+
+    // Holds the FPGA in reset, returns the ID of the flash
+    Task<std::uint32_t> reset_fpga() {
+        const std::uint8_t cmd = IceFunCommands::RESET_FPGA;
+        std::uint8_t id[3] {};
+        if (!co_await exchange(&cmd, 1, id, sizeof(id))) {
+            throw std::runtime_error("Unable to reset the board");
+        }
+        co_return id[0] | (std::uint32_t)id[1] << 8 | (std::uint32_t)id[2] << 16;
+    }
+
+    // Lets the FPGA run from the flash, returns the status of the board
+    Task<std::uint8_t> release_fpga() {
+        const std::uint8_t cmd = IceFunCommands::RELEASE_FPGA;
+        std::uint8_t run = 0;
+        co_await exchange(&cmd, 1, &run, 1);
+        co_return run;
+    }
+
+    Task<> erase_64k(std::uint32_t sector_idx) {
+        const std::uint8_t frame[2] = {
+            IceFunCommands::ERASE_64k,
+            (std::uint8_t)sector_idx};
+        std::uint8_t status = 0;
+        if (!co_await exchange(frame, sizeof(frame), &status, 1)) {
+            throw std::runtime_error(
+                "Error when getting status for the erased sector "
+                + std::to_string(sector_idx));
+        }
+    }
+
+    Task<> erase_chip() {
+        const std::uint8_t cmd = IceFunCommands::ERASE_CHIP;
+        std::uint8_t status = 0;
+        if (!co_await exchange(&cmd, 1, &status, 1, ERASE_CHIP_TIMEOUT_MSEC)) {
+            throw std::runtime_error(
+                "Error when getting status for the erased chip");
+        }
+    }
+
+    // Programs the page at `addr`, a short one padded with 0xff. Throws when
+    // the board finds the flash holding something else afterwards.
+    Task<> prog_page(std::uint32_t addr, std::span<const std::uint8_t> page) {
+        std::uint8_t status[STATUS_SIZE_BYTES] {};
+        if (!co_await page_exchange(IceFunCommands::PROG_PAGE, addr, page, status)
+            || status[0] != 0) {
+            throw std::runtime_error(page_error("writing", addr, status));
+        }
+    }
+
+    // Whether the flash at `addr` holds the page, a short one padded with
+    // 0xff
+    Task<bool>
+    verify_page(std::uint32_t addr, std::span<const std::uint8_t> page) {
+        std::uint8_t status[STATUS_SIZE_BYTES] {};
+        if (!co_await page_exchange(
+                IceFunCommands::VERIFY_PAGE,
+                addr,
+                page,
+                status)) {
+            throw std::runtime_error(page_error("verifying", addr, status));
+        }
+        co_return status[0] == 0;
+    }
+
+    // Reads the page at `addr`, or as much of it as `page` holds
+    Task<> read_page(std::uint32_t addr, std::span<std::uint8_t> page) {
+        std::uint8_t frame[COMMAND_HEADER_SIZE_BYTES];
+        fill_header(frame, IceFunCommands::READ_PAGE, addr);
+
+        std::uint8_t buf[PAGE_SIZE_BYTES];
+        const auto whole = page.size() >= PAGE_SIZE_BYTES;
+        if (!co_await exchange(
+                frame,
+                sizeof(frame),
+                whole ? page.data() : buf,
+                PAGE_SIZE_BYTES)) {
+            throw std::runtime_error(page_error("reading", addr, nullptr));
+        }
+        if (!whole) {
+            memcpy(page.data(), buf, page.size());
+        }
+    }
+
+  private:
+    static void
+    fill_header(std::uint8_t* frame, IceFunCommands cmd, std::uint32_t addr) {
+        frame[0] = cmd;
+        frame[1] = (addr >> 16);
+        frame[2] = (addr >> 8);
+        frame[3] = addr;
+    }
+
+    static std::string page_error(
+        const char* what,
+        std::uint32_t addr,
+        const std::uint8_t* status) {
+        char message[128];
+        if (status) {
+            snprintf(
+                message,
+                sizeof(message),
+                "Error when %s page at offset %#x, status: #%04x #%04x #%04x #%04x",
+                what,
+                addr,
+                status[0],
+                status[1],
+                status[2],
+                status[3]);
+        } else {
+            snprintf(
+                message,
+                sizeof(message),
+                "Error when %s page at offset %#x",
+                what,
+                addr);
+        }
+        return message;
+    }
+
+    EventLoop::Exchange exchange(
+        const std::uint8_t* frame,
+        std::uint16_t frame_size,
+        std::uint8_t* reply,
+        std::uint16_t reply_size,
+        int timeout_msec = 0) {
+        return _loop.exchange(
+            *_dev,
+            frame,
+            frame_size,
+            nullptr,
+            0,
+            reply,
+            reply_size,
+            timeout_msec);
+    }
+
+    // A full page is sent straight from where it is, a short one is padded
+    // after the header
+    Task<bool> page_exchange(
+        IceFunCommands cmd,
+        std::uint32_t addr,
+        std::span<const std::uint8_t> page,
+        std::uint8_t* status) {
+        std::uint8_t frame[COMMAND_HEADER_SIZE_BYTES + PAGE_SIZE_BYTES];
+        fill_header(frame, cmd, addr);
+
+        if (page.size() >= PAGE_SIZE_BYTES) {
+            co_return co_await _loop.exchange(
+                *_dev,
+                frame,
+                COMMAND_HEADER_SIZE_BYTES,
+                page.data(),
+                PAGE_SIZE_BYTES,
+                status,
+                STATUS_SIZE_BYTES);
+        }
+
+        const auto payload = frame + COMMAND_HEADER_SIZE_BYTES;
+        std::copy(page.begin(), page.end(), payload);
+        std::fill(payload + page.size(), payload + PAGE_SIZE_BYTES, 0xff);
+        co_return co_await exchange(
+            frame,
+            sizeof(frame),
+            status,
+            STATUS_SIZE_BYTES);
+    }
+
+    EventLoop& _loop;
+    std::shared_ptr<Transport> _dev;
+};
+
+#endif
@@ -0,0 +1,234 @@
+#ifndef __BITSTREAM_HPP__
+#define __BITSTREAM_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+// What parsing an iCE40 bitstream found out about it
+struct BitstreamInfo {
+    // Offset of the preamble, past the leading comment
+    std::uint32_t start {};
+    // End of the configuration data: past the wakeup command and the zero
+    // bytes clocked out after it. The rest of the file is padding.
+    std::uint32_t end {};
+    std::uint32_t cram_banks {};
+    std::uint32_t bram_banks {};
+    std::uint32_t crc_checks {};
+    // A multi-image warmboot header rebooting into the images that follow
+    // it in the file rather than configuring the FPGA itself
+    bool reboot {};
+};
+
+// Parses the command stream of iCE40 bitstreams as written by icepack and
+// the vendor tools, see the Project IceStorm documentation. The stream is
+// checked against its CRCs, so a damaged image is caught before anything
+// gets erased.
+class Bitstream {
+  public:
+    static constexpr std::uint32_t PREAMBLE = 0x7eaa997e;
+
+    // Offset of the preamble when the data starts with one, optionally after
+    // a comment, -1 otherwise
+    static std::int64_t
+    find_preamble(const std::uint8_t* data, std::size_t size) {
+        std::size_t pos = 0;
+
+        // The comment is framed with 0xff 0x00 ... 0x00 0xff
+        if (size >= 2 && data[0] == 0xff && data[1] == 0x00) {
+            pos = 2;
+            while (pos + 1 < size && !(data[pos] == 0x00 && data[pos + 1] == 0xff)) {
+                ++pos;
+            }
+            pos += 2;
+        }
+
+        if (pos + 4 > size || read_be(data + pos, 4) != PREAMBLE) {
+            return -1;
+        }
+        return pos;
+    }
+
+    static bool is_bitstream(const std::uint8_t* data, std::size_t size) {
+        return find_preamble(data, size) >= 0;
+    }
+
+    // Walks the command stream, throws when it is malformed
+    static BitstreamInfo parse(const std::uint8_t* data, std::size_t size) {
+        const auto start = find_preamble(data, size);
+        if (start < 0) {
+            throw std::runtime_error("No iCE40 bitstream preamble found");
+        }
+
+        BitstreamInfo info;
+        info.start = start;
+
+        const auto& table = crc_table();
+        std::uint16_t crc = CRC_INIT;
+        const auto update_crc = [&](std::size_t from, std::size_t to) {
+            for (auto pos = from; pos < to; ++pos) {
+                crc = table[(crc >> 8) ^ data[pos]] ^ (crc << 8);
+            }
+        };
+
+        std::uint32_t bank_width = 0;
+        std::uint32_t bank_height = 0;
+
+        std::size_t pos = start + 4;
+        while (pos < size) {
+            const auto cmd_pos = pos;
+            const auto opcode = data[pos] >> 4;
+            const auto payload_size = data[pos] & 0xf;
+            if (pos + 1 + payload_size > size) {
+                break;
+            }
+            if (payload_size > 4) {
+                throw error("Malformed command", cmd_pos);
+            }
+            const auto value = read_be(data + pos + 1, payload_size);
+            pos += 1 + payload_size;
+            update_crc(cmd_pos, pos);
+
+            switch (opcode) {
+                case 0:
+                    if (payload_size != 1) {
+                        throw error("Malformed command", cmd_pos);
+                    }
+                    switch (value) {
+                        case CRAM_DATA:
+                        case BRAM_DATA: {
+                            const auto data_size =
+                                std::size_t(bank_width) * bank_height / 8;
+                            if (!data_size) {
+                                throw error("Bank data of no size", cmd_pos);
+                            }
+                            if (pos + data_size + 2 > size) {
+                                throw error("Truncated bank data", cmd_pos);
+                            }
+                            // The data is followed by two zero bytes
+                            if (data[pos + data_size] || data[pos + data_size + 1]) {
+                                throw error(
+                                    "No zero bytes after the bank data",
+                                    pos + data_size);
+                            }
+                            update_crc(pos, pos + data_size + 2);
+                            pos += data_size + 2;
+                            ++(value == CRAM_DATA ? info.cram_banks : info.bram_banks);
+                            break;
+                        }
+
+                        case RESET_CRC:
+                            crc = CRC_INIT;
+                            break;
+
+                        case WAKEUP:
+                        case REBOOT:
+                            // The FPGA keeps clocking in bytes for a while
+                            while (pos < size && data[pos] == 0) {
+                                ++pos;
+                            }
+                            info.end = pos;
+                            info.reboot = value == REBOOT;
+                            return info;
+
+                        default:
+                            throw error("Unknown command", cmd_pos);
+                    }
+                    break;
+
+                case 2:
+                    // The CRC covers its own value and comes out zero
+                    if (payload_size != 2 || crc != 0) {
+                        throw error("CRC mismatch", cmd_pos);
+                    }
+                    ++info.crc_checks;
+                    break;
+
+                case 6:
+                    bank_width = value + 1;
+                    break;
+
+                case 7:
+                    bank_height = value;
+                    break;
+
+                case 1:  // Bank number
+                case 4:  // Address of the image to reboot into
+                case 5:  // Internal oscillator frequency range
+                case 8:  // Bank offset
+                case 9:  // Feature flags, warmboot enable
+                    break;
+
+                default:
+                    throw error("Unknown command", cmd_pos);
+            }
+        }
+
+        throw std::runtime_error(
+            "The bitstream is truncated, it has no wakeup command");
+    }
+
+  private:
+    static constexpr std::uint16_t CRC_INIT = 0xffff;
+
+    // Values of the commands with the zero opcode
+    static constexpr std::uint32_t CRAM_DATA = 1;
+    static constexpr std::uint32_t BRAM_DATA = 3;
+    static constexpr std::uint32_t RESET_CRC = 5;
+    static constexpr std::uint32_t WAKEUP = 6;
+    static constexpr std::uint32_t REBOOT = 8;
+
+    static std::uint32_t read_be(const std::uint8_t* data, std::size_t size) {
+        std::uint32_t value = 0;
+        for (std::size_t idx = 0; idx < size; ++idx) {
+            value = value << 8 | data[idx];
+        }
+        return value;
+    }
+
+    static std::runtime_error error(const char* what, std::size_t pos) {
+        char message[128];
+        snprintf(
+            message,
+            sizeof(message),
+            "%s at offset %#zx of the bitstream",
+            what,
+            pos);
+        return std::runtime_error(message);
+    }
+
+    // CRC-16-CCITT, polynomial 0x1021
+    static const std::array<std::uint16_t, 256>& crc_table() {
+        static const auto table = [] {
+            std::array<std::uint16_t, 256> table {};
+            for (auto idx = 0u; idx < table.size(); ++idx) {
+                std::uint16_t crc = idx << 8;
+                for (auto bit = 0; bit < 8; ++bit) {
+                    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+                }
+                table[idx] = crc;
+            }
+            return table;
+        }();
+        return table;
+    }
+};
+
+#endif
@@ -18,11 +18,17 @@
 
 #include <libusb.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
+#include <functional>
 #include <memory>
 #include <stdexcept>
+#include <string>
 #include <vector>
 
+#include "transport.hpp"
+
 // Some magic numbers from the ACM specification
 
 #define USB_CDC_REQ_SET_LINE_CODING 0x20
@@ -66,11 +72,55 @@
 #define USB_CDC_CAP_BRK 0x04
 #define USB_CDC_CAP_NOTIFY 0x08
 
-class CdcAcmUsbDevice {
+// Bus and port path of the device, e.g. "1-2.4", stable across reconnections
+// to the same port
+inline std::string device_location(libusb_device* dev) {
+    std::uint8_t ports[8] {};
+    const auto port_count = libusb_get_port_numbers(dev, ports, sizeof(ports));
+
+    auto location = std::to_string(libusb_get_bus_number(dev));
+    for (auto port_idx = 0; port_idx < port_count; ++port_idx) {
+        location += (port_idx ? "." : "-") + std::to_string(ports[port_idx]);
+    }
+    return location;
+}
+
+// Whether the configuration has the control interface of a CDC-ACM device
+inline bool has_acm_interface(const libusb_config_descriptor* cfg) {
+    for (auto if_idx = 0; if_idx < cfg->bNumInterfaces; ++if_idx) {
+        const auto uif = &cfg->interface[if_idx];
+        for (auto intf_idx = 0; intf_idx < uif->num_altsetting; ++intf_idx) {
+            const auto intf = &uif->altsetting[intf_idx];
+            if (intf->bInterfaceClass == LIBUSB_CLASS_COMM
+                && intf->bInterfaceSubClass
+                    == USB_CDC_SUBCLASS_ACM  // ACM (modem)
+                && intf->bInterfaceProtocol
+                    == USB_CDC_ACM_PROTO_AT_V25TER) {  // AT-commands (v.25ter)
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+class CdcAcmUsbDevice : public Transport {
   public:
-    CdcAcmUsbDevice(libusb_device* dev, libusb_device_descriptor desc) :
+    // Takes over the handle and the configuration descriptor obtained during
+    // discovery, the caller releases them if this throws
+    CdcAcmUsbDevice(
+        libusb_context* context,
+        libusb_device* dev,
+        libusb_device_descriptor desc,
+        libusb_device_handle* dev_handle,
+        libusb_config_descriptor* cfg,
+        std::string serial) :
+        _context(context),
         _dev(dev),
-        _desc(desc) {
+        _dev_handle(dev_handle),
+        _cfg(cfg),
+        _desc(desc),
+        _serial(std::move(serial)) {
         int ret;
 
         if (_desc.bNumConfigurations != 1) {
@@ -78,16 +128,6 @@ class CdcAcmUsbDevice {
                 "Number of configurations is not supported");
         }
 
-        ret = libusb_open(_dev, &_dev_handle);
-        if (ret < LIBUSB_SUCCESS) {
-            throw std::runtime_error(libusb_strerror(ret));
-        }
-
-        ret = libusb_get_config_descriptor(_dev, 0, &_cfg);
-        if (ret < LIBUSB_SUCCESS) {
-            throw std::runtime_error(libusb_strerror(ret));
-        }
-
         if (_cfg->bNumInterfaces != 2) {
             throw std::runtime_error("Number of interfaces is not supported");
         }
@@ -243,59 +283,350 @@ class CdcAcmUsbDevice {
         }
     }
 
-    std::uint16_t write(const std::uint8_t* data, std::uint16_t size) {
-        std::uint16_t sent_total = 0;
-
-        while (sent_total < size) {
-            int sent_this_time = 0;
-            const auto to_send = std::min(
-                _data_out->wMaxPacketSize,
-                std::uint16_t(size - sent_total));
-
-            if (libusb_bulk_transfer(
-                    _dev_handle,
-                    _data_out->bEndpointAddress,
-                    const_cast<std::uint8_t*>(&data[sent_total]),
-                    to_send,
-                    &sent_this_time,
-                    _timeout_msec)
-                == LIBUSB_SUCCESS) {
-                sent_total += sent_this_time;
-            } else {
+    // Sends the buffer in as few bulk transfers as possible, libusb splits
+    // them into packets. Returns the number of bytes sent.
+    std::size_t send(
+        const std::uint8_t* data,
+        std::size_t size,
+        int timeout_msec = 0) override {
+        return bulk(
+            _data_out->bEndpointAddress,
+            const_cast<std::uint8_t*>(data),
+            size,
+            timeout_msec);
+    }
+
+    // Receives into the buffer in as few bulk transfers as possible. The
+    // device ends a transfer with every packet shorter than wMaxPacketSize,
+    // so short replies take a transfer each. Returns the number of bytes
+    // received.
+    std::size_t receive(
+        std::uint8_t* data,
+        std::size_t size,
+        int timeout_msec = 0) override {
+        return bulk(_data_in->bEndpointAddress, data, size, timeout_msec);
+    }
+
+    // Keeps the exchanges in flight with asynchronous transfers, the pages
+    // are sent as separate transfers straight from the payload pointers
+    std::size_t pipeline(
+        std::size_t count,
+        std::uint16_t header_size,
+        std::uint16_t payload_size,
+        std::uint16_t reply_size,
+        const FillFrame& fill,
+        const CheckReply& check,
+        std::size_t depth) override {
+        struct Slot {
+            libusb_transfer* out {};
+            libusb_transfer* out_payload {};
+            libusb_transfer* in {};
+            std::vector<std::uint8_t> out_buf;
+            std::vector<std::uint8_t> in_buf;
+            const std::uint8_t* payload {};
+            // Transfers of the device may complete on any thread handling
+            // the events of the context
+            std::atomic<int> pending {};
+            std::atomic<int> out_pending {};
+        };
+
+        const auto on_complete = [](libusb_transfer* transfer) {
+            const auto slot = static_cast<Slot*>(transfer->user_data);
+            if (transfer != slot->in) {
+                --slot->out_pending;
+            }
+            --slot->pending;
+        };
+
+        depth = std::max(depth, std::size_t(1));
+        std::vector<Slot> slots(
+            std::min(depth, std::max(count, std::size_t(1))));
+        for (auto& slot : slots) {
+            slot.out = libusb_alloc_transfer(0);
+            slot.out_payload = libusb_alloc_transfer(0);
+            slot.in = libusb_alloc_transfer(0);
+            slot.out_buf.resize(header_size + payload_size);
+            slot.in_buf.resize(reply_size);
+        }
+
+        const auto wait = [this](const std::atomic<int>& pending) {
+            while (pending) {
+                timeval tv = {.tv_sec = 0, .tv_usec = 100000};
+                libusb_handle_events_timeout_completed(_context, &tv, nullptr);
+            }
+        };
+
+        const auto submit = [](Slot& slot, libusb_transfer* transfer) {
+            if (libusb_submit_transfer(transfer) < LIBUSB_SUCCESS) {
+                return false;
+            }
+            ++slot.pending;
+            if (transfer != slot.in) {
+                ++slot.out_pending;
+            }
+            return true;
+        };
+
+        const auto transferred = [](const libusb_transfer* transfer) {
+            return transfer->status == LIBUSB_TRANSFER_COMPLETED
+                && transfer->actual_length == transfer->length;
+        };
+
+        std::size_t submitted = 0;
+        std::size_t completed = 0;
+
+        // Whatever is in flight completes before the buffers go away, also
+        // when `fill` or `check` throws. The commands that reached the board
+        // get their replies received, so that they are not taken for those
+        // of the next commands; the replies of the rest are cancelled.
+        const auto drain = [&] {
+            for (auto idx = completed; idx < submitted; ++idx) {
+                wait(slots[idx % slots.size()].out_pending);
+            }
+
+            auto sent = true;
+            for (auto idx = completed; idx < submitted; ++idx) {
+                auto& slot = slots[idx % slots.size()];
+                sent = sent && transferred(slot.out)
+                    && (!slot.payload || transferred(slot.out_payload));
+                if (!sent && slot.pending) {
+                    libusb_cancel_transfer(slot.in);
+                }
+            }
+            for (auto& slot : slots) {
+                wait(slot.pending);
+            }
+
+            // The frame the board took only a part of is completed by
+            // resync()
+            for (auto idx = completed; idx < submitted; ++idx) {
+                const auto& slot = slots[idx % slots.size()];
+                const auto header_sent = (std::size_t)slot.out->actual_length;
+                const auto payload_sent = slot.payload
+                    ? (std::size_t)slot.out_payload->actual_length
+                    : 0;
+                if (header_sent + payload_sent == header_size + payload_size) {
+                    continue;
+                }
+
+                std::vector<std::uint8_t> frame(
+                    slot.out_buf.begin(),
+                    slot.out_buf.begin() + slot.out->length);
+                if (slot.payload) {
+                    frame.insert(
+                        frame.end(),
+                        slot.payload,
+                        slot.payload + payload_size);
+                }
+                keep_unsent(
+                    frame.data(),
+                    frame.size(),
+                    header_sent + payload_sent);
                 break;
             }
+
+            for (auto& slot : slots) {
+                libusb_free_transfer(slot.out);
+                libusb_free_transfer(slot.out_payload);
+                libusb_free_transfer(slot.in);
+            }
+        };
+
+        try {
+            auto failed = false;
+            while (completed < count && !failed) {
+                while (submitted < count
+                       && submitted - completed < slots.size()) {
+                    auto& slot = slots[submitted % slots.size()];
+                    if (!slot.out || !slot.out_payload || !slot.in) {
+                        failed = true;
+                        break;
+                    }
+
+                    const auto payload = fill(submitted, slot.out_buf.data());
+                    slot.payload = payload;
+
+                    libusb_fill_bulk_transfer(
+                        slot.out,
+                        _dev_handle,
+                        _data_out->bEndpointAddress,
+                        slot.out_buf.data(),
+                        payload ? header_size : header_size + payload_size,
+                        on_complete,
+                        &slot,
+                        _timeout_msec);
+                    libusb_fill_bulk_transfer(
+                        slot.out_payload,
+                        _dev_handle,
+                        _data_out->bEndpointAddress,
+                        const_cast<std::uint8_t*>(payload),
+                        payload ? payload_size : 0,
+                        on_complete,
+                        &slot,
+                        _timeout_msec);
+                    libusb_fill_bulk_transfer(
+                        slot.in,
+                        _dev_handle,
+                        _data_in->bEndpointAddress,
+                        slot.in_buf.data(),
+                        reply_size,
+                        on_complete,
+                        &slot,
+                        _timeout_msec);
+
+                    if (!submit(slot, slot.in)) {
+                        failed = true;
+                        break;
+                    }
+                    if (!submit(slot, slot.out)
+                        || (payload && !submit(slot, slot.out_payload))) {
+                        failed = true;
+                        ++submitted;
+                        break;
+                    }
+                    ++submitted;
+                }
+                if (failed || completed == submitted) {
+                    break;
+                }
+
+                auto& slot = slots[completed % slots.size()];
+                wait(slot.pending);
+
+                if (!transferred(slot.out)
+                    || (slot.payload && !transferred(slot.out_payload))
+                    || !transferred(slot.in)
+                    || !check(completed, slot.in_buf.data())) {
+                    break;
+                }
+                ++completed;
+            }
+        } catch (...) {
+            drain();
+            throw;
         }
 
-        return sent_total;
+        drain();
+        return completed;
     }
 
-    std::uint16_t read(std::uint8_t* data, std::uint16_t size) {
-        std::uint16_t read_total = 0;
-
-        while (read_total < size) {
-            int read_this_time = 0;
-            const auto to_read = std::min(
-                _data_out->wMaxPacketSize,
-                std::uint16_t(size - read_total));
-
-            if (libusb_bulk_transfer(
-                    _dev_handle,
-                    _data_in->bEndpointAddress,
-                    &data[read_total],
-                    to_read,
-                    &read_this_time,
-                    _timeout_msec)
-                == LIBUSB_SUCCESS) {
-                read_total += read_this_time;
-            } else {
+    // Submits the transfers of the exchange and returns, `done` is called
+    // from poll() once all of them complete. The reply is received first so
+    // that it is never missed.
+    void submit(
+        const std::uint8_t* header,
+        std::uint16_t header_size,
+        const std::uint8_t* payload,
+        std::uint16_t payload_size,
+        std::uint8_t* reply,
+        std::uint16_t reply_size,
+        Completion done,
+        int timeout_msec = 0) override {
+        // The transfers complete on the thread handling the events, the
+        // one calling poll()
+        const auto on_complete = [](libusb_transfer* transfer) {
+            const auto exchange = static_cast<Submitted*>(transfer->user_data);
+            exchange->ok &= transfer->status == LIBUSB_TRANSFER_COMPLETED
+                && transfer->actual_length == transfer->length;
+            if (--exchange->pending == 0) {
+                exchange->dev->complete(exchange);
+            }
+        };
+
+        const auto timeout = timeout_msec ? timeout_msec : _timeout_msec;
+        const auto exchange = new Submitted;
+        exchange->dev = this;
+        exchange->done = std::move(done);
+        _submitted.push_back(exchange);
+
+        struct Buffer {
+            unsigned char endpoint;
+            const std::uint8_t* data;
+            int size;
+        };
+        const Buffer buffers[] = {
+            {_data_in->bEndpointAddress, reply, reply_size},
+            {_data_out->bEndpointAddress, header, header_size},
+            {_data_out->bEndpointAddress, payload, payload_size}};
+
+        auto transfer_idx = 0;
+        for (const auto& buffer : buffers) {
+            if (!buffer.size) {
+                continue;
+            }
+
+            const auto transfer = libusb_alloc_transfer(0);
+            exchange->transfers[transfer_idx++] = transfer;
+            if (!transfer) {
+                exchange->ok = false;
+                break;
+            }
+            libusb_fill_bulk_transfer(
+                transfer,
+                _dev_handle,
+                buffer.endpoint,
+                const_cast<std::uint8_t*>(buffer.data),
+                buffer.size,
+                on_complete,
+                exchange,
+                timeout);
+            if (libusb_submit_transfer(transfer) < LIBUSB_SUCCESS) {
+                exchange->ok = false;
                 break;
             }
+            ++exchange->pending;
+        }
+
+        // What got submitted before a failure is cancelled, the exchange
+        // completes once it is back
+        if (!exchange->ok) {
+            for (auto idx = 0; idx < exchange->pending; ++idx) {
+                libusb_cancel_transfer(exchange->transfers[idx]);
+            }
+        }
+        if (!exchange->pending) {
+            complete(exchange);
+        }
+    }
+
+    // Cancels the transfers of the exchanges in flight, poll() completes
+    // them once they are back
+    void cancel() override {
+        for (const auto exchange : _submitted) {
+            for (const auto transfer : exchange->transfers) {
+                if (transfer) {
+                    libusb_cancel_transfer(transfer);
+                }
+            }
         }
+    }
+
+    // All the boards opened by Usb share its context, so the events handled
+    // here complete the exchanges of all of them
+    void poll(int timeout_msec) override {
+        timeval tv = {
+            .tv_sec = timeout_msec / 1000,
+            .tv_usec = (timeout_msec % 1000) * 1000};
+        libusb_handle_events_timeout_completed(_context, &tv, nullptr);
+    }
+
+    // Clears the halts a timed out transfer may have left on the endpoints
+    // first
+    bool resync() override {
+        libusb_clear_halt(_dev_handle, _data_out->bEndpointAddress);
+        libusb_clear_halt(_dev_handle, _data_in->bEndpointAddress);
+        return Transport::resync();
+    }
+
+    const std::string& serial() const override {
+        return _serial;
+    }
 
-        return read_total;
+    std::string location() const override {
+        return device_location(_dev);
     }
 
-    ~CdcAcmUsbDevice() {
+    ~CdcAcmUsbDevice() override {
         for (auto if_idx = 0; if_idx < _cfg->bNumInterfaces; ++if_idx) {
             libusb_release_interface(_dev_handle, if_idx);
             libusb_attach_kernel_driver(_dev_handle, if_idx);
@@ -308,6 +639,56 @@ class CdcAcmUsbDevice {
     }
 
   private:
+    // An exchange started with submit(), until all of its transfers are back
+    struct Submitted {
+        CdcAcmUsbDevice* dev {};
+        libusb_transfer* transfers[3] {};
+        int pending {};
+        bool ok {true};
+        Completion done;
+
+        ~Submitted() {
+            for (const auto transfer : transfers) {
+                libusb_free_transfer(transfer);
+            }
+        }
+    };
+
+    void complete(Submitted* exchange) {
+        _submitted.erase(
+            std::find(_submitted.begin(), _submitted.end(), exchange));
+        const auto done = std::move(exchange->done);
+        const auto ok = exchange->ok;
+        delete exchange;
+        done(ok);
+    }
+
+    std::size_t bulk(
+        unsigned char endpoint,
+        std::uint8_t* data,
+        std::size_t size,
+        int timeout_msec) {
+        std::size_t total = 0;
+
+        while (total < size) {
+            int this_time = 0;
+            const auto ret = libusb_bulk_transfer(
+                _dev_handle,
+                endpoint,
+                &data[total],
+                (int)(size - total),
+                &this_time,
+                timeout_msec ? timeout_msec : _timeout_msec);
+
+            total += this_time;
+            if (ret != LIBUSB_SUCCESS) {
+                break;
+            }
+        }
+
+        return total;
+    }
+
     struct LineCoding {
         std::uint32_t bps;
         std::uint8_t stop_bits;
@@ -331,6 +712,7 @@ class CdcAcmUsbDevice {
         .data_bits = 8};
     int _timeout_msec = 5000;
 
+    libusb_context* _context {};
     libusb_device* _dev {};
     libusb_device_handle* _dev_handle {};
     libusb_config_descriptor* _cfg {};
@@ -338,6 +720,9 @@ class CdcAcmUsbDevice {
     const libusb_endpoint_descriptor* _data_in {};
     const libusb_endpoint_descriptor* _data_out {};
     libusb_device_descriptor _desc {};
+    std::string _serial;
+    // The exchanges started with submit() in flight, for cancel()
+    std::vector<Submitted*> _submitted;
 };
 
 class Usb {
@@ -357,6 +742,7 @@ class Usb {
     }
 
     ~Usb() {
+        unwatch();
         if (_dev_count) {
             close();
         }
@@ -391,112 +777,243 @@ class Usb {
     Usb(const Usb&) = delete;
     Usb& operator=(const Usb&) = delete;
 
-    std::vector<std::shared_ptr<CdcAcmUsbDevice>>
-    find(std::uint16_t vid = 0, std::uint16_t pid = 0) {
-        int ret;
+    // Finds the CDC-ACM devices with the given VID:PID (any when both are
+    // zero), optionally narrowed down to a bus/port location and a serial
+    // string. Devices are filtered by their cached descriptors first, then
+    // every candidate is opened once and its handle is handed over to
+    // CdcAcmUsbDevice. The candidates that cannot be opened, like the ones
+    // without the permissions or in use by another program, are skipped with
+    // a message. The descriptors are printed when `verbose` is set.
+    std::vector<std::shared_ptr<Transport>> find(
+        std::uint16_t vid = 0,
+        std::uint16_t pid = 0,
+        const std::string& location = {},
+        const std::string& serial = {},
+        bool verbose = false) {
         libusb_device* usb_dev;
-        std::vector<std::shared_ptr<CdcAcmUsbDevice>> devices;
+        std::vector<std::shared_ptr<Transport>> devices;
 
         auto dev_idx = 0;
         while ((usb_dev = _dev_list[dev_idx++]) != nullptr) {
-            libusb_device_descriptor desc {};
-
-            ret = libusb_get_device_descriptor(usb_dev, &desc);
-            if (ret < LIBUSB_SUCCESS) {
-                throw std::runtime_error(libusb_strerror(ret));
+            try {
+                auto dev =
+                    open_device(usb_dev, vid, pid, location, serial, verbose);
+                if (dev) {
+                    devices.emplace_back(std::move(dev));
+                }
+            } catch (const std::exception& e) {
+                fprintf(
+                    stderr,
+                    "Skipping the device at %s: %s\n",
+                    device_location(usb_dev).c_str(),
+                    e.what());
             }
+        }
 
-            auto add_device = false;
-            if ((pid == 0 && vid == 0)
-                || (desc.idProduct == pid && desc.idVendor == vid)) {
-                {
-                    libusb_device_handle* handle {};
-                    if (libusb_open(usb_dev, &handle) == LIBUSB_SUCCESS) {
-                        std::uint8_t vendor[256] {};
-                        std::uint8_t product[256] {};
-                        std::uint8_t serial[256] {};
-
-                        libusb_get_string_descriptor_ascii(
-                            handle,
-                            desc.iManufacturer,
-                            vendor,
-                            sizeof(vendor) - 1);
-                        libusb_get_string_descriptor_ascii(
-                            handle,
-                            desc.iProduct,
-                            product,
-                            sizeof(product) - 1);
-                        libusb_get_string_descriptor_ascii(
-                            handle,
-                            desc.iSerialNumber,
-                            serial,
-                            sizeof(serial) - 1);
-                        fprintf(
-                            stdout,
-                            "Device %#06x:%#06x @ (bus %03d, device %03d, vendor '%s', product '%s', serial '%s')\n",
-                            desc.idVendor,
-                            desc.idProduct,
-                            libusb_get_bus_number(usb_dev),
-                            libusb_get_device_address(usb_dev),
-                            vendor,
-                            product,
-                            serial);
-
-                        libusb_close(handle);
-                    }
-                }
+        return devices;
+    }
 
-                for (auto cfg_idx = 0; cfg_idx < desc.bNumConfigurations;
-                     ++cfg_idx) {
-                    libusb_config_descriptor* cfg;
+    // Opens the device if it passes the filters of find(), returns nullptr
+    // otherwise
+    std::shared_ptr<CdcAcmUsbDevice> open_device(
+        libusb_device* usb_dev,
+        std::uint16_t vid = 0,
+        std::uint16_t pid = 0,
+        const std::string& location = {},
+        const std::string& serial = {},
+        bool verbose = false) {
+        int ret;
+        libusb_device_descriptor desc {};
 
-                    ret = libusb_get_config_descriptor(usb_dev, cfg_idx, &cfg);
-                    if (ret < LIBUSB_SUCCESS) {
-                        throw std::runtime_error(libusb_strerror(ret));
-                    }
+        ret = libusb_get_device_descriptor(usb_dev, &desc);
+        if (ret < LIBUSB_SUCCESS) {
+            throw std::runtime_error(libusb_strerror(ret));
+        }
 
-                    fprintf(stdout, "\tconfiguration %#02x\n", cfg_idx);
-
-                    for (auto if_idx = 0; if_idx < cfg->bNumInterfaces;
-                         ++if_idx) {
-                        const auto uif = &cfg->interface[if_idx];
-                        for (auto intf_idx = 0; intf_idx < uif->num_altsetting;
-                             ++intf_idx) {
-                            const auto intf = &uif->altsetting[intf_idx];
-
-                            fprintf(
-                                stdout,
-                                "\t\tinterface class:subclass:protocol %#04x:%#04x:%#04x\n",
-                                intf->bInterfaceClass,
-                                intf->bInterfaceSubClass,
-                                intf->bInterfaceProtocol);
-
-                            add_device |=
-                                (intf->bInterfaceClass == LIBUSB_CLASS_COMM
-                                 && intf->bInterfaceSubClass
-                                     == USB_CDC_SUBCLASS_ACM  // ACM (modem)
-                                 && intf->bInterfaceProtocol
-                                     == USB_CDC_ACM_PROTO_AT_V25TER);  // AT-commands (v.25ter)
-                        }
-                    }
+        if (!((pid == 0 && vid == 0)
+              || (desc.idProduct == pid && desc.idVendor == vid))) {
+            return nullptr;
+        }
+        if (!location.empty() && device_location(usb_dev) != location) {
+            return nullptr;
+        }
+        if (desc.bNumConfigurations == 0) {
+            return nullptr;
+        }
 
-                    libusb_free_config_descriptor(cfg);
-                }
-            }
+        libusb_config_descriptor* cfg {};
+        ret = libusb_get_config_descriptor(usb_dev, 0, &cfg);
+        if (ret < LIBUSB_SUCCESS) {
+            throw std::runtime_error(libusb_strerror(ret));
+        }
+        if (!has_acm_interface(cfg)) {
+            libusb_free_config_descriptor(cfg);
+            return nullptr;
+        }
 
-            if (add_device) {
-                devices.emplace_back(
-                    std::make_shared<CdcAcmUsbDevice>(usb_dev, desc));
-            }
+        libusb_device_handle* handle {};
+        ret = libusb_open(usb_dev, &handle);
+        if (ret < LIBUSB_SUCCESS) {
+            libusb_free_config_descriptor(cfg);
+            throw std::runtime_error(
+                std::string("Cannot open the device: ") + libusb_strerror(ret));
         }
 
-        return devices;
+        std::uint8_t dev_serial[256] {};
+        libusb_get_string_descriptor_ascii(
+            handle,
+            desc.iSerialNumber,
+            dev_serial,
+            sizeof(dev_serial) - 1);
+        if (!serial.empty()
+            && serial != reinterpret_cast<const char*>(dev_serial)) {
+            libusb_close(handle);
+            libusb_free_config_descriptor(cfg);
+            return nullptr;
+        }
+
+        if (verbose) {
+            print_device(usb_dev, desc, handle, dev_serial);
+        }
+
+        try {
+            return std::make_shared<CdcAcmUsbDevice>(
+                _context,
+                usb_dev,
+                desc,
+                handle,
+                cfg,
+                reinterpret_cast<const char*>(dev_serial));
+        } catch (...) {
+            libusb_close(handle);
+            libusb_free_config_descriptor(cfg);
+            throw;
+        }
+    }
+
+    // Calls `arrived` for every VID:PID device plugged in from now on, and
+    // for the ones already connected. The callback runs on whichever thread
+    // handles the libusb events, and must not do any I/O on the device. It
+    // gets a reference to the device, to be released with
+    // libusb_unref_device().
+    void watch(
+        std::uint16_t vid,
+        std::uint16_t pid,
+        std::function<void(libusb_device*)> arrived) {
+        if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+            throw std::runtime_error("Hotplug is not supported on this platform");
+        }
+        if (_arrived) {
+            throw std::runtime_error("Already watching");
+        }
+
+        _arrived = std::move(arrived);
+        const auto ret = libusb_hotplug_register_callback(
+            _context,
+            LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+            LIBUSB_HOTPLUG_ENUMERATE,
+            vid ? vid : LIBUSB_HOTPLUG_MATCH_ANY,
+            pid ? pid : LIBUSB_HOTPLUG_MATCH_ANY,
+            LIBUSB_HOTPLUG_MATCH_ANY,
+            [](libusb_context*,
+               libusb_device* usb_dev,
+               libusb_hotplug_event,
+               void* user_data) {
+                const auto self = static_cast<Usb*>(user_data);
+                self->_arrived(libusb_ref_device(usb_dev));
+                return 0;
+            },
+            this,
+            &_hotplug);
+        if (ret < LIBUSB_SUCCESS) {
+            _arrived = nullptr;
+            throw std::runtime_error(libusb_strerror(ret));
+        }
+    }
+
+    void unwatch() {
+        if (_arrived) {
+            libusb_hotplug_deregister_callback(_context, _hotplug);
+            _arrived = nullptr;
+        }
+    }
+
+    // Waits for the USB events up to the timeout, the hotplug callbacks run
+    // from here
+    void handle_events(int timeout_msec) {
+        timeval tv {timeout_msec / 1000, (timeout_msec % 1000) * 1000};
+        const auto ret =
+            libusb_handle_events_timeout_completed(_context, &tv, nullptr);
+        if (ret < LIBUSB_SUCCESS && ret != LIBUSB_ERROR_INTERRUPTED) {
+            throw std::runtime_error(libusb_strerror(ret));
+        }
     }
 
   private:
+    static void print_device(
+        libusb_device* usb_dev,
+        const libusb_device_descriptor& desc,
+        libusb_device_handle* handle,
+        const std::uint8_t* serial) {
+        std::uint8_t vendor[256] {};
+        std::uint8_t product[256] {};
+
+        libusb_get_string_descriptor_ascii(
+            handle,
+            desc.iManufacturer,
+            vendor,
+            sizeof(vendor) - 1);
+        libusb_get_string_descriptor_ascii(
+            handle,
+            desc.iProduct,
+            product,
+            sizeof(product) - 1);
+        fprintf(
+            stdout,
+            "Device %#06x:%#06x @ (bus %03d, device %03d, port %s, vendor '%s', product '%s', serial '%s')\n",
+            desc.idVendor,
+            desc.idProduct,
+            libusb_get_bus_number(usb_dev),
+            libusb_get_device_address(usb_dev),
+            device_location(usb_dev).c_str(),
+            vendor,
+            product,
+            serial);
+
+        for (auto cfg_idx = 0; cfg_idx < desc.bNumConfigurations; ++cfg_idx) {
+            libusb_config_descriptor* cfg;
+
+            if (libusb_get_config_descriptor(usb_dev, cfg_idx, &cfg)
+                < LIBUSB_SUCCESS) {
+                continue;
+            }
+
+            fprintf(stdout, "\tconfiguration %#02x\n", cfg_idx);
+
+            for (auto if_idx = 0; if_idx < cfg->bNumInterfaces; ++if_idx) {
+                const auto uif = &cfg->interface[if_idx];
+                for (auto intf_idx = 0; intf_idx < uif->num_altsetting;
+                     ++intf_idx) {
+                    const auto intf = &uif->altsetting[intf_idx];
+
+                    fprintf(
+                        stdout,
+                        "\t\tinterface class:subclass:protocol %#04x:%#04x:%#04x\n",
+                        intf->bInterfaceClass,
+                        intf->bInterfaceSubClass,
+                        intf->bInterfaceProtocol);
+                }
+            }
+
+            libusb_free_config_descriptor(cfg);
+        }
+    }
+
     libusb_context* _context;
     libusb_device** _dev_list;
     size_t _dev_count;
+    std::function<void(libusb_device*)> _arrived;
+    libusb_hotplug_callback_handle _hotplug {};
 };
 
 #endif
@@ -20,15 +20,28 @@
 #include <optional>
 #include <string>
 
+#include "icefun.hpp"
+#include "programmer.hpp"
+
 enum class Action {
     UNKNOWN,
     PRINT_USAGE,
     CYCLE_BOARD,
     READ_BOARD,
-    WRITE_BOARD
+    WRITE_BOARD,
+    DAEMON,
+    REBUILD_SNAPSHOT,
+    DIFF_SNAPSHOTS
+};
+
+// How the progress of the board operations is reported
+enum class ProgressMode {
+    DOTS,  // A dot per page on the log
+    JSON  // Rate-limited NDJSON events on stdout
 };
 
-struct CommandLine {
+// The options of the board operations come first, see ProgrammerOptions
+struct CommandLine : ProgrammerOptions {
     CommandLine(int argc, char** argv) {
         auto argi = 1;
         while (argi < argc) {
@@ -41,9 +54,8 @@ struct CommandLine {
                     break;
                 }
             } else if (!strcmp(argv[argi], "-c")) {
-                if (argc == 2) {
+                if (action == Action::UNKNOWN && path.empty()) {
                     action = Action::CYCLE_BOARD;
-                    break;
                 } else {
                     action = Action::UNKNOWN;
                     break;
@@ -76,6 +88,82 @@ struct CommandLine {
                     action = Action::UNKNOWN;
                     break;
                 }
+            } else if (!strcmp(argv[argi], "-m")) {
+                if (action == Action::UNKNOWN && path.empty()) {
+                    ++argi;
+                    if (argi < argc) {
+                        action = Action::WRITE_BOARD;
+                        path = argv[argi];
+                        manifest = true;
+                    } else {
+                        action = Action::UNKNOWN;
+                        break;
+                    }
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
+            } else if (
+                !strcmp(argv[argi], "--rebuild")
+                || !strcmp(argv[argi], "--diff-snapshots")) {
+                if (action == Action::UNKNOWN && path.empty()) {
+                    action = !strcmp(argv[argi], "--rebuild")
+                        ? Action::REBUILD_SNAPSHOT
+                        : Action::DIFF_SNAPSHOTS;
+                    argi += 2;
+                    if (argi < argc) {
+                        path = argv[argi - 1];
+                        second_path = argv[argi];
+                    } else {
+                        action = Action::UNKNOWN;
+                        break;
+                    }
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
+            } else if (!strcmp(argv[argi], "--store")) {
+                if (store_path.empty()) {
+                    ++argi;
+                    if (argi < argc) {
+                        store_path = argv[argi];
+                    } else {
+                        action = Action::UNKNOWN;
+                        break;
+                    }
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
+            } else if (!strcmp(argv[argi], "--daemon")) {
+                if (action == Action::UNKNOWN && path.empty()
+                    && socket_path.empty()) {
+                    ++argi;
+                    if (argi < argc) {
+                        action = Action::DAEMON;
+                        socket_path = argv[argi];
+                    } else {
+                        action = Action::UNKNOWN;
+                        break;
+                    }
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
+            } else if (!strcmp(argv[argi], "--client")) {
+                if (socket_path.empty()) {
+                    ++argi;
+                    if (argi < argc) {
+                        client = true;
+                        socket_path = argv[argi];
+                    } else {
+                        action = Action::UNKNOWN;
+                        break;
+                    }
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
             } else if (!strcmp(argv[argi], "-o")) {
                 if (!offset.has_value()) {
                     ++argi;
@@ -128,6 +216,184 @@ struct CommandLine {
                     action = Action::UNKNOWN;
                     break;
                 }
+            } else if (!strncmp(argv[argi], "--verify=", 9)) {
+                const auto mode = argv[argi] + 9;
+                if (!strcmp(mode, "device")) {
+                    verify = VerifyMode::DEVICE;
+                } else if (!strcmp(mode, "readback")) {
+                    verify = VerifyMode::READBACK;
+                } else if (!strcmp(mode, "hash")) {
+                    verify = VerifyMode::HASH;
+                } else if (!strcmp(mode, "none")) {
+                    verify = VerifyMode::NONE;
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
+            } else if (!strncmp(argv[argi], "--progress=", 11)) {
+                const auto mode = argv[argi] + 11;
+                if (!strcmp(mode, "dots")) {
+                    progress = ProgressMode::DOTS;
+                } else if (!strcmp(mode, "json")) {
+                    progress = ProgressMode::JSON;
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
+            } else if (!strcmp(argv[argi], "-v")) {
+                if (!verbose) {
+                    verbose = true;
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
+            } else if (!strcmp(argv[argi], "--serial")) {
+                if (serial.empty()) {
+                    ++argi;
+                    if (argi < argc) {
+                        serial = argv[argi];
+                    } else {
+                        action = Action::UNKNOWN;
+                        break;
+                    }
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
+            } else if (!strcmp(argv[argi], "--port")) {
+                if (port.empty()) {
+                    ++argi;
+                    if (argi < argc) {
+                        port = argv[argi];
+                    } else {
+                        action = Action::UNKNOWN;
+                        break;
+                    }
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
+            } else if (!strcmp(argv[argi], "--trace")) {
+                ++argi;
+                if (argi < argc) {
+                    trace_path = argv[argi];
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
+            } else if (!strcmp(argv[argi], "--sim")) {
+                simulate = true;
+            } else if (!strncmp(argv[argi], "--sim=", 6)) {
+                simulate = true;
+                sim_timings = argv[argi] + 6;
+            } else if (!strcmp(argv[argi], "--auto")) {
+                auto_flash = true;
+            } else if (!strcmp(argv[argi], "--all")) {
+                if (!all_devices) {
+                    all_devices = true;
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
+            } else if (!strcmp(argv[argi], "--diff")) {
+                if (!diff) {
+                    diff = true;
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
+            } else if (!strcmp(argv[argi], "--raw")) {
+                if (!raw) {
+                    raw = true;
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
+            } else if (!strcmp(argv[argi], "--journal")) {
+                if (!journal) {
+                    journal = true;
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
+            } else if (!strcmp(argv[argi], "--resume")) {
+                if (!resume) {
+                    resume = true;
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
+            } else if (!strcmp(argv[argi], "--chip-erase")) {
+                if (!chip_erase) {
+                    chip_erase = true;
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
+            } else if (!strcmp(argv[argi], "--blank-check")) {
+                if (!blank_check) {
+                    blank_check = true;
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
+            } else if (!strcmp(argv[argi], "--cache")) {
+                if (cache_path.empty()) {
+                    ++argi;
+                    if (argi < argc) {
+                        cache_path = argv[argi];
+                    } else {
+                        action = Action::UNKNOWN;
+                        break;
+                    }
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
+            } else if (!strcmp(argv[argi], "--cache-sample")) {
+                if (!cache_sample.has_value()) {
+                    ++argi;
+                    if (argi < argc) {
+                        char* end_ptr = argv[argi];
+                        std::uint32_t pages = 0;
+
+                        pages = strtoul(argv[argi], &end_ptr, 0);
+                        if (*end_ptr == '\0') {
+                            cache_sample = std::make_optional(pages);
+                        } else {
+                            action = Action::UNKNOWN;
+                            break;
+                        }
+                    } else {
+                        action = Action::UNKNOWN;
+                        break;
+                    }
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
+            } else if (!strcmp(argv[argi], "-q")) {
+                if (!queue_depth.has_value()) {
+                    ++argi;
+                    if (argi < argc) {
+                        char* end_ptr = argv[argi];
+                        std::uint32_t depth = 0;
+
+                        depth = strtoul(argv[argi], &end_ptr, 0);
+                        if (*end_ptr == '\0' && depth > 0) {
+                            queue_depth = std::make_optional(depth);
+                        } else {
+                            action = Action::UNKNOWN;
+                            break;
+                        }
+                    } else {
+                        action = Action::UNKNOWN;
+                        break;
+                    }
+                } else {
+                    action = Action::UNKNOWN;
+                    break;
+                }
             } else {
                 action = Action::UNKNOWN;
                 break;
@@ -135,16 +401,29 @@ struct CommandLine {
 
             ++argi;
         }
+
+        // Resuming needs the journal, which only follows a single board
+        journal = (journal || resume) && !all_devices && !auto_flash;
     }
 
     // iceFUN uses a Microchip PIC16LF1459 to facilitate communication over USB (CDC-ACM)
     // and to provide programming for the SPI flash memory (Kynix AT25SF081).
-    std::uint16_t product_id {0xffee};  // Devantech USB-ISS
-    std::uint16_t vendor_id {0x04d8};  // Microchip Technology Inc.
+    std::uint16_t product_id {ICEFUN_PRODUCT_ID};
+    std::uint16_t vendor_id {ICEFUN_VENDOR_ID};
     Action action {Action::UNKNOWN};
-    std::string path;
-    std::optional<std::uint32_t> offset;
-    std::optional<std::uint32_t> size;
+    // The output of --rebuild, the other snapshot of --diff-snapshots
+    std::string second_path;
+    std::string socket_path;
+    bool client {false};
+    bool auto_flash {false};
+    bool simulate {false};
+    std::string trace_path;
+    std::string sim_timings;
+    std::string serial;
+    std::string port;
+    bool verbose {false};
+    bool all_devices {false};
+    ProgressMode progress {ProgressMode::DOTS};
 };
 
 #endif
@@ -0,0 +1,445 @@
+#ifndef __DECOMPRESS_HPP__
+#define __DECOMPRESS_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "icefun.hpp"
+#include "pageops.hpp"
+#include "sha256.hpp"
+
+enum class Compression {
+    NONE,
+    GZIP,
+    ZSTD,
+};
+
+inline const char* compression_name(Compression compression) {
+    switch (compression) {
+        case Compression::NONE:
+            return "none";
+        case Compression::GZIP:
+            return "gzip";
+        case Compression::ZSTD:
+            return "zstd";
+    }
+    return "unknown";
+}
+
+// Tells the compressed images by their magic numbers
+inline Compression
+detect_compression(const std::uint8_t* data, std::size_t size) {
+    if (size >= 2 && data[0] == 0x1f && data[1] == 0x8b) {
+        return Compression::GZIP;
+    }
+    if (size >= 4 && data[0] == 0x28 && data[1] == 0xb5 && data[2] == 0x2f
+        && data[3] == 0xfd) {
+        return Compression::ZSTD;
+    }
+    return Compression::NONE;
+}
+
+// Decompresses a gzip or zstd image held in memory, a piece at a time.
+// Concatenated gzip members and zstd frames decompress as one image.
+class Decompressor {
+  public:
+    Decompressor(
+        Compression compression,
+        const std::uint8_t* data,
+        std::size_t size) :
+        _compression(compression),
+        _data(data),
+        _size(size) {
+        switch (compression) {
+            case Compression::GZIP:
+#ifdef HAVE_ZLIB
+                _zlib.next_in = const_cast<std::uint8_t*>(data);
+                _zlib.avail_in = size;
+                // Only the gzip wrapper
+                if (inflateInit2(&_zlib, 16 + MAX_WBITS) != Z_OK) {
+                    throw std::runtime_error("Cannot initialize zlib");
+                }
+                break;
+#else
+                throw std::runtime_error(
+                    "Built without zlib, cannot decompress gzip images");
+#endif
+
+            case Compression::ZSTD:
+#ifdef HAVE_ZSTD
+                _zstd = ZSTD_createDStream();
+                if (!_zstd) {
+                    throw std::runtime_error("Cannot initialize zstd");
+                }
+                break;
+#else
+                throw std::runtime_error(
+                    "Built without libzstd, cannot decompress zstd images");
+#endif
+
+            case Compression::NONE:
+                break;
+        }
+    }
+
+    ~Decompressor() {
+#ifdef HAVE_ZLIB
+        if (_compression == Compression::GZIP) {
+            inflateEnd(&_zlib);
+        }
+#endif
+#ifdef HAVE_ZSTD
+        if (_zstd) {
+            ZSTD_freeDStream(_zstd);
+        }
+#endif
+    }
+
+    Decompressor(const Decompressor&) = delete;
+    Decompressor& operator=(const Decompressor&) = delete;
+
+    // Fills the buffer, returns the number of bytes decompressed, fewer than
+    // asked for only at the end of the image
+    std::size_t read(std::uint8_t* out, std::size_t size) {
+        std::size_t total = 0;
+        while (total < size && !_finished) {
+            switch (_compression) {
+                case Compression::NONE: {
+                    const auto this_time = std::min(size - total, _size - _pos);
+                    memcpy(out + total, _data + _pos, this_time);
+                    _pos += this_time;
+                    total += this_time;
+                    _finished = _pos == _size;
+                    break;
+                }
+                case Compression::GZIP:
+                    total += read_gzip(out + total, size - total);
+                    break;
+                case Compression::ZSTD:
+                    total += read_zstd(out + total, size - total);
+                    break;
+            }
+        }
+        return total;
+    }
+
+  private:
+    std::size_t read_gzip(std::uint8_t* out, std::size_t size) {
+#ifdef HAVE_ZLIB
+        _zlib.next_out = out;
+        _zlib.avail_out = size;
+
+        const auto result = inflate(&_zlib, Z_NO_FLUSH);
+        const auto produced = size - _zlib.avail_out;
+        if (result == Z_STREAM_END) {
+            // Another member may follow
+            if (_zlib.avail_in == 0) {
+                _finished = true;
+            } else if (inflateReset(&_zlib) != Z_OK) {
+                throw std::runtime_error("Cannot reset zlib");
+            }
+        } else if (result == Z_BUF_ERROR && _zlib.avail_in == 0) {
+            throw std::runtime_error("The gzip image is truncated");
+        } else if (result != Z_OK && result != Z_BUF_ERROR) {
+            throw std::runtime_error(
+                std::string("Cannot decompress the gzip image: ")
+                + (_zlib.msg ? _zlib.msg : "corrupted data"));
+        }
+        return produced;
+#else
+        (void)out;
+        (void)size;
+        return 0;
+#endif
+    }
+
+    std::size_t read_zstd(std::uint8_t* out, std::size_t size) {
+#ifdef HAVE_ZSTD
+        ZSTD_inBuffer input = {_data, _size, _pos};
+        ZSTD_outBuffer output = {out, size, 0};
+
+        const auto result = ZSTD_decompressStream(_zstd, &output, &input);
+        if (ZSTD_isError(result)) {
+            throw std::runtime_error(
+                std::string("Cannot decompress the zstd image: ")
+                + ZSTD_getErrorName(result));
+        }
+        _pos = input.pos;
+        if (_pos == _size && output.pos < size) {
+            if (result != 0) {
+                throw std::runtime_error("The zstd image is truncated");
+            }
+            _finished = true;
+        }
+        return output.pos;
+#else
+        (void)out;
+        (void)size;
+        return 0;
+#endif
+    }
+
+    Compression _compression;
+    const std::uint8_t* _data;
+    std::size_t _size;
+    std::size_t _pos {};
+    bool _finished {};
+
+#ifdef HAVE_ZLIB
+    z_stream _zlib {};
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DStream* _zstd {};
+#endif
+};
+
+// Decompresses the whole image, which must fit into `max_size` bytes
+inline std::vector<std::uint8_t> decompress(
+    Compression compression,
+    const std::uint8_t* data,
+    std::size_t size,
+    std::size_t max_size) {
+    constexpr std::size_t CHUNK_SIZE = 64 * 1024;
+
+    Decompressor decompressor(compression, data, size);
+    std::vector<std::uint8_t> image;
+    for (;;) {
+        const auto pos = image.size();
+        image.resize(pos + CHUNK_SIZE);
+        const auto chunk_size =
+            decompressor.read(image.data() + pos, CHUNK_SIZE);
+        image.resize(pos + chunk_size);
+        if (image.size() > max_size) {
+            throw std::runtime_error("Cannot fit the data into the flash");
+        }
+        if (chunk_size < CHUNK_SIZE) {
+            return image;
+        }
+    }
+}
+
+// The pages of the image that fall into one sector of the flash. The pages
+// holding only 0xff are counted and dropped.
+struct ImageSector {
+    std::uint32_t sector_idx {};
+    // Indices of the pages of the image to program
+    std::vector<std::uint32_t> pages;
+    // Their contents, a page after another, the last one padded with 0xff
+    std::vector<std::uint8_t> data;
+    std::uint32_t blank_pages {};
+    // Size of the image up to the end of the sector
+    std::uint32_t image_size {};
+};
+
+// Decompresses the image on a thread of its own and hands it over a sector
+// at a time, so that the decompression overlaps with erasing and programming
+// the sectors handed over earlier. At most `queue_sectors` sectors wait to
+// be taken. The image is to be written at the page-aligned `offset` and
+// must fit into `max_size` bytes; only its first `limit` bytes are taken.
+class SectorStream {
+  public:
+    static constexpr std::size_t DEFAULT_QUEUE_SECTORS = 4;
+
+    SectorStream(
+        Compression compression,
+        const std::uint8_t* data,
+        std::size_t size,
+        std::uint32_t offset,
+        std::uint32_t max_size,
+        std::uint32_t limit,
+        std::size_t queue_sectors = DEFAULT_QUEUE_SECTORS) :
+        _decompressor(compression, data, size),
+        _offset(offset),
+        _max_size(max_size),
+        _limit(limit),
+        _queue_sectors(std::max(queue_sectors, std::size_t(1))) {
+        _producer = std::thread([this] { produce(); });
+    }
+
+    ~SectorStream() {
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _stopped = true;
+        }
+        _space.notify_all();
+        _producer.join();
+    }
+
+    SectorStream(const SectorStream&) = delete;
+    SectorStream& operator=(const SectorStream&) = delete;
+
+    // Takes the next sector, waiting for it to get decompressed. Returns
+    // false at the end of the image, rethrows the decompression errors.
+    bool next(ImageSector& sector) {
+        std::unique_lock<std::mutex> lock(_lock);
+        _ready.wait(lock, [this] {
+            return !_queue.empty() || _finished || _error;
+        });
+        if (_error) {
+            std::rethrow_exception(_error);
+        }
+        if (_queue.empty()) {
+            return false;
+        }
+
+        sector = std::move(_queue.front());
+        _queue.pop_front();
+        lock.unlock();
+        _space.notify_one();
+
+        return true;
+    }
+
+    // The size and the digest of the whole image, known once next() has
+    // returned false
+    std::uint32_t size() const {
+        return _image_size;
+    }
+
+    const Sha256::Digest& digest() const {
+        return _digest;
+    }
+
+  private:
+    void produce() {
+        try {
+            Sha256 sha;
+            ImageSector sector;
+            auto sector_started = false;
+
+            for (std::uint32_t page_idx = 0;; ++page_idx) {
+                // Decompressed right after the pages kept so far, and
+                // dropped from there when blank
+                const auto page_pos = sector.data.size();
+                sector.data.resize(page_pos + PAGE_SIZE_BYTES);
+                auto* page = sector.data.data() + page_pos;
+
+                const auto page_size = _decompressor.read(
+                    page,
+                    std::min(PAGE_SIZE_BYTES, _limit - _image_size));
+                if (page_size && _image_size + page_size > _max_size) {
+                    throw std::runtime_error("Cannot fit the data into the flash");
+                }
+                sha.update(page, page_size);
+                _image_size += page_size;
+
+                const auto sector_idx =
+                    (_offset + page_idx * PAGE_SIZE_BYTES) >> SECTOR_SHIFT;
+                if (!page_size || (sector_started && sector_idx != sector.sector_idx)) {
+                    // The page belongs to the next sector
+                    std::vector<std::uint8_t> next_page;
+                    if (page_size) {
+                        next_page.assign(page, page + PAGE_SIZE_BYTES);
+                    }
+                    sector.data.resize(page_pos);
+                    if (sector_started && !push(std::move(sector))) {
+                        return;
+                    }
+                    if (!page_size) {
+                        break;
+                    }
+
+                    sector = ImageSector {};
+                    sector.data = std::move(next_page);
+                    page = sector.data.data();
+                }
+                sector.sector_idx = sector_idx;
+                sector_started = true;
+
+                memset(page + page_size, 0xff, PAGE_SIZE_BYTES - page_size);
+                if (page_blank(page, PAGE_SIZE_BYTES)) {
+                    ++sector.blank_pages;
+                    sector.data.resize(sector.data.size() - PAGE_SIZE_BYTES);
+                } else {
+                    sector.pages.push_back(page_idx);
+                }
+
+                sector.image_size = _image_size;
+
+                if (page_size < PAGE_SIZE_BYTES) {
+                    if (!push(std::move(sector))) {
+                        return;
+                    }
+                    break;
+                }
+            }
+
+            _digest = sha.finish();
+
+            std::lock_guard<std::mutex> lock(_lock);
+            _finished = true;
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(_lock);
+            _error = std::current_exception();
+        }
+        _ready.notify_all();
+    }
+
+    // Queues the sector, returns false when the consumer is gone
+    bool push(ImageSector&& sector) {
+        std::unique_lock<std::mutex> lock(_lock);
+        _space.wait(lock, [this] {
+            return _queue.size() < _queue_sectors || _stopped;
+        });
+        if (_stopped) {
+            return false;
+        }
+        _queue.push_back(std::move(sector));
+        lock.unlock();
+        _ready.notify_one();
+
+        return true;
+    }
+
+    Decompressor _decompressor;
+    std::uint32_t _offset;
+    std::uint32_t _max_size;
+    std::uint32_t _limit;
+    std::size_t _queue_sectors;
+
+    // Written by the producer, read once it has finished
+    std::uint32_t _image_size {};
+    Sha256::Digest _digest {};
+
+    std::mutex _lock;
+    std::condition_variable _ready;
+    std::condition_variable _space;
+    std::deque<ImageSector> _queue;
+    bool _finished {};
+    bool _stopped {};
+    std::exception_ptr _error;
+
+    std::thread _producer;
+};
+
+#endif
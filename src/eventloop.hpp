@@ -0,0 +1,404 @@
+#ifndef __EVENTLOOP_HPP__
+#define __EVENTLOOP_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <algorithm>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "transport.hpp"
+
+// Coroutines exchanging commands with the boards, and the loop running them
+// on one thread. A coroutine suspends at every exchange and the loop resumes
+// it once the reply is in, so that the exchanges of many coroutines, and of
+// many boards, are in flight at once.
+
+template <typename T = void>
+class Task;
+
+// Resumes the coroutine awaiting the task once the task is done
+template <typename Promise>
+struct TaskFinalAwaiter {
+    bool await_ready() noexcept {
+        return false;
+    }
+
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+        const auto continuation = handle.promise().continuation;
+        return continuation ? continuation : std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {
+    }
+};
+
+// What the promises of all the tasks keep: the coroutine awaiting the task
+// and the exception the task ended with
+struct TaskPromiseBase {
+    std::suspend_always initial_suspend() noexcept {
+        return {};
+    }
+
+    void unhandled_exception() {
+        exception = std::current_exception();
+    }
+
+    void rethrow() const {
+        if (exception) {
+            std::rethrow_exception(exception);
+        }
+    }
+
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+    Task<T> get_return_object();
+
+    TaskFinalAwaiter<TaskPromise> final_suspend() noexcept {
+        return {};
+    }
+
+    void return_value(T result) {
+        value = std::move(result);
+    }
+
+    T result() {
+        rethrow();
+        return std::move(*value);
+    }
+
+    std::optional<T> value;
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object();
+
+    TaskFinalAwaiter<TaskPromise> final_suspend() noexcept {
+        return {};
+    }
+
+    void return_void() {
+    }
+
+    void result() {
+        rethrow();
+    }
+};
+
+// A coroutine producing T. It starts when awaited, or when the loop gets to
+// it once spawned, and the awaiting coroutine goes on once it is done.
+template <typename T>
+class Task {
+  public:
+    using promise_type = TaskPromise<T>;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    explicit Task(Handle handle) : _handle(handle) {
+    }
+
+    Task(Task&& other) noexcept : _handle(std::exchange(other._handle, {})) {
+    }
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (_handle) {
+                _handle.destroy();
+            }
+            _handle = std::exchange(other._handle, {});
+        }
+        return *this;
+    }
+
+    ~Task() {
+        if (_handle) {
+            _handle.destroy();
+        }
+    }
+
+    bool done() const {
+        return !_handle || _handle.done();
+    }
+
+    auto operator co_await() const noexcept {
+        struct Awaiter {
+            Handle handle;
+
+            bool await_ready() noexcept {
+                return false;
+            }
+
+            std::coroutine_handle<>
+            await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+
+            T await_resume() {
+                return handle.promise().result();
+            }
+        };
+        return Awaiter {_handle};
+    }
+
+  private:
+    friend class EventLoop;
+
+    Handle _handle;
+};
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+    return Task<T>(Task<T>::Handle::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>(Task<void>::Handle::from_promise(*this));
+}
+
+// Runs the tasks on the calling thread. The coroutines ready to go on are
+// resumed in turn; once all of them wait for the boards, the loop polls the
+// boards with exchanges in flight for the replies.
+class EventLoop {
+  public:
+    // How long to wait for the replies at a time when exchanges of just one
+    // board are in flight. With several boards, each is polled for 1 ms in
+    // turn so that none of them waits behind another.
+    static constexpr int POLL_MSEC = 100;
+
+    // Awaits the exchange with the board, see Transport::submit(). Resumes
+    // with whether it went through.
+    class Exchange {
+      public:
+        Exchange(
+            EventLoop& loop,
+            Transport& dev,
+            const std::uint8_t* header,
+            std::uint16_t header_size,
+            const std::uint8_t* payload,
+            std::uint16_t payload_size,
+            std::uint8_t* reply,
+            std::uint16_t reply_size,
+            int timeout_msec) :
+            _loop(loop),
+            _dev(dev),
+            _header(header),
+            _header_size(header_size),
+            _payload(payload),
+            _payload_size(payload_size),
+            _reply(reply),
+            _reply_size(reply_size),
+            _timeout_msec(timeout_msec) {
+        }
+
+        bool await_ready() noexcept {
+            return false;
+        }
+
+        // The coroutine goes on with the exception when the exchange does
+        // not get going
+        void await_suspend(std::coroutine_handle<> handle) {
+            _loop.started(_dev);
+            try {
+                _dev.submit(
+                    _header,
+                    _header_size,
+                    _payload,
+                    _payload_size,
+                    _reply,
+                    _reply_size,
+                    [this, handle](bool ok) {
+                        _ok = ok;
+                        _loop.finished(_dev);
+                        _loop._ready.push_back(handle);
+                    },
+                    _timeout_msec);
+            } catch (...) {
+                _loop.finished(_dev);
+                throw;
+            }
+        }
+
+        bool await_resume() noexcept {
+            return _ok;
+        }
+
+      private:
+        EventLoop& _loop;
+        Transport& _dev;
+        const std::uint8_t* _header;
+        std::uint16_t _header_size;
+        const std::uint8_t* _payload;
+        std::uint16_t _payload_size;
+        std::uint8_t* _reply;
+        std::uint16_t _reply_size;
+        int _timeout_msec;
+        bool _ok {};
+    };
+
+    EventLoop() = default;
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // Has run() run the task alongside the others
+    void spawn(Task<> task) {
+        _ready.push_back(task._handle);
+        _tasks.push_back(std::move(task));
+    }
+
+    Exchange exchange(
+        Transport& dev,
+        const std::uint8_t* header,
+        std::uint16_t header_size,
+        const std::uint8_t* payload,
+        std::uint16_t payload_size,
+        std::uint8_t* reply,
+        std::uint16_t reply_size,
+        int timeout_msec = 0) {
+        return Exchange(
+            *this,
+            dev,
+            header,
+            header_size,
+            payload,
+            payload_size,
+            reply,
+            reply_size,
+            timeout_msec);
+    }
+
+    // Runs the tasks spawned until all of them are done, then rethrows the
+    // first exception one of them ended with. When polling the boards
+    // throws, the tasks are dropped once their exchanges are back.
+    void run() {
+        try {
+            for (;;) {
+                while (!_ready.empty()) {
+                    const auto handle = _ready.front();
+                    _ready.pop_front();
+                    handle.resume();
+                }
+
+                if (std::all_of(
+                        _tasks.begin(),
+                        _tasks.end(),
+                        [](const Task<>& task) { return task.done(); })) {
+                    break;
+                }
+                poll();
+            }
+        } catch (...) {
+            abandon();
+            throw;
+        }
+
+        const auto tasks = std::move(_tasks);
+        _tasks.clear();
+        for (const auto& task : tasks) {
+            task._handle.promise().result();
+        }
+    }
+
+  private:
+    void started(Transport& dev) {
+        const auto in_flight = std::find_if(
+            _in_flight.begin(),
+            _in_flight.end(),
+            [&](const auto& entry) { return entry.first == &dev; });
+        if (in_flight != _in_flight.end()) {
+            ++in_flight->second;
+        } else {
+            _in_flight.emplace_back(&dev, 1);
+        }
+    }
+
+    void finished(Transport& dev) {
+        const auto in_flight = std::find_if(
+            _in_flight.begin(),
+            _in_flight.end(),
+            [&](const auto& entry) { return entry.first == &dev; });
+        if (in_flight != _in_flight.end() && --in_flight->second == 0) {
+            _in_flight.erase(in_flight);
+        }
+    }
+
+    // Cancels the exchanges in flight and waits for them to complete, as the
+    // transfers write into the frames of the tasks awaiting them. Then
+    // destroys the tasks without resuming them.
+    void abandon() noexcept {
+        // Cancelling may complete the exchanges and change the list
+        std::vector<Transport*> devices;
+        for (const auto& entry : _in_flight) {
+            devices.push_back(entry.first);
+        }
+        for (const auto dev : devices) {
+            dev->cancel();
+        }
+        while (!_in_flight.empty()) {
+            const auto dev = _in_flight.front().first;
+            try {
+                dev->poll(POLL_MSEC);
+            } catch (...) {
+            }
+        }
+
+        _ready.clear();
+        _tasks.clear();
+    }
+
+    // Waits for a reply from the boards with exchanges in flight
+    void poll() {
+        if (_in_flight.empty()) {
+            throw std::logic_error("The tasks wait for no exchange");
+        }
+
+        const auto timeout_msec = _in_flight.size() == 1 ? POLL_MSEC : 1;
+
+        // Completing the exchanges changes the list. The board polled first
+        // goes round so that a busy one does not hold up the others.
+        std::vector<Transport*> devices;
+        for (const auto& entry : _in_flight) {
+            devices.push_back(entry.first);
+        }
+        ++_poll_round;
+        for (std::size_t dev_idx = 0; dev_idx < devices.size(); ++dev_idx) {
+            devices[(_poll_round + dev_idx) % devices.size()]->poll(
+                timeout_msec);
+            if (!_ready.empty()) {
+                break;
+            }
+        }
+    }
+
+    std::vector<Task<>> _tasks;
+    std::deque<std::coroutine_handle<>> _ready;
+    // Exchanges in flight, by board
+    std::vector<std::pair<Transport*, std::size_t>> _in_flight;
+    std::size_t _poll_round {};
+};
+
+#endif
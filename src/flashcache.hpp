@@ -0,0 +1,165 @@
+#ifndef __FLASH_CACHE_HPP__
+#define __FLASH_CACHE_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <sys/file.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#include "mappedfile.hpp"
+#include "sha256.hpp"
+
+// Remembers what the flash of each board holds, as a digest per 64k sector.
+// The file is a header followed by fixed-size board records, and is used
+// through a shared mapping. Boards are keyed by the USB serial string and
+// the flash ID.
+
+class FlashCache {
+  public:
+    static constexpr std::uint32_t SECTOR_COUNT = 16;
+
+    FlashCache(
+        const std::string& path,
+        const std::string& serial,
+        std::uint32_t flash_id) :
+        _file(path, true) {
+        // Boards flashed at once, from this process or any other sharing the
+        // file, look up and add their records one at a time. The file may
+        // have grown since it was mapped.
+        static std::mutex lock;
+        std::lock_guard<std::mutex> guard(lock);
+        const FileLock file_lock(_file.fd());
+        _file.remap();
+
+        if (_file.size() == 0) {
+            _file.resize(sizeof(Header));
+
+            auto header = reinterpret_cast<Header*>(_file.data());
+            memcpy(header->magic, MAGIC, sizeof(header->magic));
+            header->version = FORMAT_VERSION;
+            header->record_size = sizeof(BoardRecord);
+        }
+
+        const auto header = reinterpret_cast<const Header*>(_file.data());
+        if (_file.size() < sizeof(Header)
+            || memcmp(header->magic, MAGIC, sizeof(header->magic))
+            || header->version != FORMAT_VERSION
+            || header->record_size != sizeof(BoardRecord)
+            || (_file.size() - sizeof(Header)) % sizeof(BoardRecord)) {
+            throw std::runtime_error(
+                "'" + path + "' is not a flash cache file");
+        }
+
+        const auto board_count =
+            (_file.size() - sizeof(Header)) / sizeof(BoardRecord);
+        for (_board_idx = 0; _board_idx < board_count; ++_board_idx) {
+            const auto rec = board();
+            if (rec->flash_id == flash_id
+                && !strncmp(rec->serial, serial.c_str(), sizeof(rec->serial))) {
+                return;
+            }
+        }
+
+        _file.resize(sizeof(Header) + (board_count + 1) * sizeof(BoardRecord));
+
+        auto rec = board();
+        memset(rec, 0, sizeof(BoardRecord));
+        strncpy(rec->serial, serial.c_str(), sizeof(rec->serial) - 1);
+        rec->flash_id = flash_id;
+        rec->sector_count = SECTOR_COUNT;
+    }
+
+    ~FlashCache() {
+        _file.flush();
+    }
+
+    FlashCache(const FlashCache&) = delete;
+    FlashCache& operator=(const FlashCache&) = delete;
+
+    // Whether the sector is known to hold the contents with this digest
+    bool contains(std::uint32_t sector_idx, const Sha256::Digest& digest) {
+        const auto& sector = board()->sectors[sector_idx % SECTOR_COUNT];
+        return sector.valid
+            && !memcmp(sector.digest, digest.data(), sizeof(sector.digest));
+    }
+
+    void update(std::uint32_t sector_idx, const Sha256::Digest& digest) {
+        auto& sector = board()->sectors[sector_idx % SECTOR_COUNT];
+        memcpy(sector.digest, digest.data(), sizeof(sector.digest));
+        sector.valid = 1;
+    }
+
+    void invalidate(std::uint32_t sector_idx) {
+        board()->sectors[sector_idx % SECTOR_COUNT].valid = 0;
+    }
+
+    void flush() {
+        _file.flush();
+    }
+
+  private:
+    static constexpr char MAGIC[8] = {'i', 'c', 'e', 'F', 'U', 'N', 'f', 'c'};
+    static constexpr std::uint32_t FORMAT_VERSION = 1;
+
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t record_size;
+    };
+
+    struct SectorRecord {
+        std::uint32_t valid;
+        std::uint32_t reserved;
+        std::uint8_t digest[32];
+    };
+
+    struct BoardRecord {
+        char serial[64];
+        std::uint32_t flash_id;
+        std::uint32_t sector_count;
+        SectorRecord sectors[SECTOR_COUNT];
+    };
+
+    // Holds the exclusive lock on the file while in scope
+    struct FileLock {
+        explicit FileLock(int fd) : fd(fd) {
+            while (flock(fd, LOCK_EX) < 0 && errno == EINTR) {
+            }
+        }
+
+        ~FileLock() {
+            flock(fd, LOCK_UN);
+        }
+
+        int fd;
+    };
+
+    BoardRecord* board() {
+        return reinterpret_cast<BoardRecord*>(
+            _file.data() + sizeof(Header) + _board_idx * sizeof(BoardRecord));
+    }
+
+    MappedFile _file;
+    std::size_t _board_idx {};
+};
+
+#endif
@@ -13,303 +13,695 @@
     CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 */
 
+#include <sys/time.h>
+
+#include <climits>
+#include <csignal>
+
+#include <chrono>
+#include <cstdarg>
 #include <fstream>
+#include <list>
+#include <mutex>
+#include <thread>
 
+#include "asyncboard.hpp"
 #include "cdcacm.hpp"
 #include "cmdline.hpp"
+#include "eventloop.hpp"
+#include "jobsocket.hpp"
+#include "mappedfile.hpp"
+#include "programmer.hpp"
+#include "progressprinter.hpp"
+#include "simdevice.hpp"
+#include "snapshot.hpp"
+#include "trace.hpp"
+
+// Where the board operations report progress and errors. In the multi-device
+// mode every worker thread collects them in its own log.
+thread_local FILE* log_file = stdout;
+thread_local FILE* err_file = stderr;
+
+// With --progress=json, the events of all the boards go to `event_file`
+FILE* event_file = stdout;
+
+// Set by SIGINT and SIGTERM, see install_stop_handlers()
+volatile std::sig_atomic_t stop_requested = 0;
+
+// Points the log and the progress of the programmer to the files of the
+// thread, as the command line prints them
+ProgrammerCallbacks console_callbacks(
+    const std::shared_ptr<Transport>& dev,
+    const CommandLine& params) {
+    const auto printer = std::make_shared<ProgressPrinter>(
+        params.progress,
+        event_file,
+        log_file,
+        dev->serial());
+    const auto log = log_file;
+    const auto err = err_file;
+
+    ProgrammerCallbacks callbacks;
+    callbacks.log = [=](LogLevel level, const std::string& message) {
+        printer->break_line();
+        fprintf(level == LogLevel::ERROR ? err : log, "%s\n", message.c_str());
+    };
+    callbacks.progress = [=](const ProgressEvent& event) { (*printer)(event); };
+    callbacks.stop_requested = [] { return stop_requested != 0; };
+    return callbacks;
+}
 
-constexpr std::uint32_t MAX_FLASH_SIZE_BYTES = 1048576;
-
-enum IceFunCommands : std::uint8_t {
-    DONE = 0xb0,
-    GET_VER,
-    RESET_FPGA,
-    ERASE_CHIP,
-    ERASE_64k,
-    PROG_PAGE,
-    READ_PAGE,
-    VERIFY_PAGE,
-    GET_CDONE,
-    RELEASE_FPGA
-};
+// Rebuilds the raw image of the snapshot from the store, as -r would have
+// saved it
+void rebuild_snapshot(const CommandLine& params) {
+    if (params.store_path.empty()) {
+        throw std::runtime_error("--rebuild needs --store");
+    }
 
-std::uint8_t get_board_version(const std::shared_ptr<CdcAcmUsbDevice>& dev) {
-    const std::uint8_t get_ver = IceFunCommands::GET_VER;
-    std::uint8_t ver[2] {};
+    const SnapshotStore store(params.store_path);
+    const auto snapshot = Snapshot::load(params.path);
 
-    if (dev->write(&get_ver, sizeof(get_ver)) == sizeof(get_ver)) {
-        if (dev->read(ver, sizeof(ver)) == sizeof(ver)) {
-            if (ver[0] == 38) {
-                return ver[1];
-            }
+    std::ofstream f(params.second_path, std::ios::out | std::ios::binary);
+    if (!f) {
+        throw std::runtime_error("Cannot open '" + params.second_path + "'");
+    }
+
+    const std::vector<std::uint8_t> blank(snapshot.chunk_size, 0xff);
+    for (std::size_t chunk_idx = 0; chunk_idx < snapshot.chunks.size();
+         ++chunk_idx) {
+        const auto& chunk = snapshot.chunks[chunk_idx];
+        const auto data = chunk ? store.get(*chunk) : blank;
+        if (data.size() < snapshot.chunk_bytes(chunk_idx)) {
+            throw std::runtime_error("A chunk of the snapshot is short");
         }
+        f.write(
+            reinterpret_cast<const char*>(data.data()),
+            snapshot.chunk_bytes(chunk_idx));
+    }
+    if (!f) {
+        throw std::runtime_error("Cannot write '" + params.second_path + "'");
     }
 
-    throw std::runtime_error("Unable to get board version");
+    fprintf(
+        log_file,
+        "Rebuilt %u bytes read from '%s' at offset %#x to '%s'\n",
+        snapshot.size,
+        snapshot.serial.c_str(),
+        snapshot.offset,
+        params.second_path.c_str());
 }
 
-std::uint32_t reset_board(const std::shared_ptr<CdcAcmUsbDevice>& dev) {
-    const std::uint8_t reset = IceFunCommands::RESET_FPGA;
-    std::uint32_t flash_id = 0;
+// Lists the ranges where the two snapshots differ, by the digests of their
+// chunks. Returns whether they hold the same.
+bool diff_snapshots(const CommandLine& params) {
+    const auto a = Snapshot::load(params.path);
+    const auto b = Snapshot::load(params.second_path);
+    if (a.chunk_size != b.chunk_size || a.offset != b.offset) {
+        throw std::runtime_error(
+            "The snapshots differ in their chunk size or offset");
+    }
+
+    const auto chunk_count = std::max(a.chunks.size(), b.chunks.size());
+    std::uint32_t differing = 0;
+    std::size_t range_start = 0;
+
+    for (std::size_t chunk_idx = 0; chunk_idx <= chunk_count; ++chunk_idx) {
+        const auto same = chunk_idx == chunk_count
+            || (chunk_idx < a.chunks.size() && chunk_idx < b.chunks.size()
+                && a.chunks[chunk_idx] == b.chunks[chunk_idx]
+                && a.chunk_bytes(chunk_idx) == b.chunk_bytes(chunk_idx));
+        if (!same) {
+            ++differing;
+            continue;
+        }
 
-    if (dev->write(&reset, sizeof(reset)) == sizeof(reset)) {
-        if (dev->read(reinterpret_cast<std::uint8_t*>(&flash_id), 3) == 3) {
-            return flash_id;
+        // The differing chunks end here
+        if (range_start < chunk_idx) {
+            fprintf(
+                log_file,
+                "0x%06x-0x%06x differs\n",
+                (std::uint32_t)(a.offset + range_start * a.chunk_size),
+                (std::uint32_t)std::min<std::uint64_t>(
+                    a.offset + chunk_idx * a.chunk_size,
+                    a.offset + std::max(a.size, b.size)));
         }
+        range_start = chunk_idx + 1;
     }
 
-    throw std::runtime_error("Unable to reset the board");
+    fprintf(
+        log_file,
+        "%u of %u chunks of %u bytes differ between '%s' (%s) and '%s' (%s)\n",
+        differing,
+        (std::uint32_t)chunk_count,
+        a.chunk_size,
+        params.path.c_str(),
+        a.serial.c_str(),
+        params.second_path.c_str(),
+        b.serial.c_str());
+
+    return differing == 0;
 }
 
-std::uint8_t run_board(const std::shared_ptr<CdcAcmUsbDevice>& dev) {
-    std::uint8_t run = IceFunCommands::RELEASE_FPGA;
+// Outcome of an operation on one of the boards in the multi-device mode
+struct BoardResult {
+    std::string serial;
+    std::string location;
+    bool ok {};
+    std::string error;
+    std::chrono::milliseconds elapsed {};
+    std::string log;
+};
+
+// Runs the action on one board, collecting its output in the result rather
+// than printing it, so that the boards run side by side do not interleave.
+BoardResult run_on_board(
+    const std::shared_ptr<Transport>& dev,
+    const CommandLine& params,
+    const MappedFile* file,
+    FILE* out) {
+    BoardResult result;
+    result.serial = dev->serial();
+    result.location = dev->location();
+
+    char* log_buf = nullptr;
+    std::size_t log_size = 0;
+    log_file = open_memstream(&log_buf, &log_size);
+    if (!log_file) {
+        log_file = out;
+    }
+    err_file = log_file;
+
+    const auto start = std::chrono::steady_clock::now();
+    try {
+        IceFunProgrammer programmer(dev, params, console_callbacks(dev, params));
+        if (params.action == Action::WRITE_BOARD) {
+            result.ok = programmer.write_file(file).ok;
+        } else if (params.action == Action::CYCLE_BOARD) {
+            result.ok = programmer.cycle().ok;
+        } else {
+            throw std::logic_error("Unsupported option");
+        }
+    } catch (const std::exception& e) {
+        result.error = e.what();
+    }
+    result.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
 
-    if (dev->write(&run, sizeof(run)) == sizeof(run)) {
-        run = 0;
-        dev->read(&run, sizeof(run));
+    if (log_file != out) {
+        fclose(log_file);
+        result.log.assign(log_buf, log_size);
+        free(log_buf);
     }
+    log_file = out;
+    err_file = out;
 
-    return run;
+    return result;
 }
 
-void cycle_board(const std::shared_ptr<CdcAcmUsbDevice>& dev) {
-    fprintf(stdout, "Cycling the board...\n");
+// Appends the formatted line to the log
+void append_line(std::string& log, const char* format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
 
-    const auto board_version = get_board_version(dev);
-    fprintf(stdout, "Board version: %d\n", board_version);
+    log += line;
+    log += '\n';
+}
 
-    const auto flash_id = reset_board(dev);
-    fprintf(stdout, "Reset, flash ID: %#06x\n", flash_id);
+// Cycles the board like cycle_board() does, logging into the result
+Task<> cycle_async(
+    EventLoop& loop,
+    std::shared_ptr<Transport> dev,
+    BoardResult& result) {
+    result.serial = dev->serial();
+    result.location = dev->location();
 
-    const auto run = run_board(dev);
-    fprintf(stdout, "Run: %#02x\n", run);
-}
+    const auto start = std::chrono::steady_clock::now();
+    try {
+        AsyncBoard board(loop, dev);
+        append_line(result.log, "Cycling the board...");
 
-void write_board(
-    const std::shared_ptr<CdcAcmUsbDevice>& dev,
-    std::optional<std::uint32_t> offset_opt,
-    std::optional<std::uint32_t> size_opt,
-    const std::string& path) {
-    const std::uint32_t offset = offset_opt.value_or(0);
-    if (offset > MAX_FLASH_SIZE_BYTES) {
-        throw std::runtime_error("The offset is too large");
-    }
+        const auto board_version = co_await board.get_version();
+        append_line(result.log, "Board version: %d", board_version);
 
-    ssize_t file_size = 0;
+        const auto flash_id = co_await board.reset_fpga();
+        append_line(result.log, "Reset, flash ID: %#06x", flash_id);
 
-    std::ifstream f(path, std::ios::in | std::ios::binary);
-    if (!f) {
-        throw std::runtime_error("Cannot open the file");
-    }
+        const auto run = co_await board.release_fpga();
+        append_line(result.log, "Run: %#02x", run);
 
-    f.seekg(0, f.end);
-    file_size = f.tellg();
-    f.seekg(0, f.beg);
+        result.ok = true;
+    } catch (const std::exception& e) {
+        result.error = e.what();
+    }
+    result.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+}
 
-    const std::uint32_t size = size_opt.value_or(file_size);
-    if (offset + size > MAX_FLASH_SIZE_BYTES) {
-        throw std::runtime_error("Cannot fit the data into the flash");
+void print_board_log(FILE* out, const BoardResult& result) {
+    fprintf(
+        out,
+        "=== Board '%s' @ %s\n%s",
+        result.serial.c_str(),
+        result.location.c_str(),
+        result.log.c_str());
+    if (!result.error.empty()) {
+        fprintf(out, "Error: %s\n", result.error.c_str());
     }
+}
 
-    auto data = std::make_unique<char[]>(size);
-    f.read(data.get(), size);
+// Runs the action on all the boards at once. Cycling takes a few exchanges
+// per board, the boards are cycled from this thread with their exchanges
+// interleaved. Writing gets a worker thread per board, the image is mapped
+// once and shared by the workers. A failing board does not stop the
+// others; the log of every board is printed once it is done.
+bool run_on_all_boards(
+    const std::vector<std::shared_ptr<Transport>>& devices,
+    const CommandLine& params) {
+    std::unique_ptr<const MappedFile> file;
+    if (params.action == Action::WRITE_BOARD) {
+        file = std::make_unique<const MappedFile>(params.path, false);
+    }
 
-    const auto board_version = get_board_version(dev);
-    fprintf(stdout, "Board version: %d\n", board_version);
+    std::vector<BoardResult> results(devices.size());
+    std::vector<std::thread> workers;
+    std::mutex print_lock;
 
-    const auto flash_id = reset_board(dev);
-    fprintf(stdout, "Reset, flash ID: %#06x\n", flash_id);
+    // The workers report to where the caller does
+    const auto out = log_file;
 
-    const auto start_sector = (offset >> 16);
-    const auto end_sector = ((offset + size) >> 16) + 1;
+    fprintf(out, "Running on %u boards\n", (std::uint32_t)devices.size());
+    if (params.action == Action::CYCLE_BOARD) {
+        EventLoop loop;
+        for (std::size_t dev_idx = 0; dev_idx < devices.size(); ++dev_idx) {
+            loop.spawn(cycle_async(loop, devices[dev_idx], results[dev_idx]));
+        }
+        loop.run();
 
-    fprintf(
-        stdout,
-        "Erasing %d 64k sectors starting at sector %d\n",
-        end_sector - start_sector - 1,
-        start_sector);
-    for (auto sector_idx = start_sector; sector_idx < end_sector;
-         ++sector_idx) {
-        std::uint8_t erase[2] = {
-            IceFunCommands::ERASE_64k,
-            (std::uint8_t)sector_idx};
-
-        if (dev->write(erase, sizeof(erase)) != sizeof(erase)) {
-            throw std::runtime_error("Error when erasing sectors");
+        for (const auto& result : results) {
+            print_board_log(out, result);
         }
-        if (dev->read(erase, 1) != 1) {
-            throw std::runtime_error(
-                "Error when getting status for the erased sectors");
+    } else {
+        for (std::size_t dev_idx = 0; dev_idx < devices.size(); ++dev_idx) {
+            workers.emplace_back([&, dev_idx] {
+                auto& result = results[dev_idx];
+                result =
+                    run_on_board(devices[dev_idx], params, file.get(), out);
+
+                std::lock_guard<std::mutex> lock(print_lock);
+                print_board_log(out, result);
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
         }
-
-        fprintf(stdout, ".");
     }
-    fprintf(stdout, "\n");
 
-    {
+    auto all_ok = true;
+    fprintf(out, "Summary:\n");
+    for (const auto& result : results) {
         fprintf(
-            stdout,
-            "Writing %d bytes starting at offset %d from '%s' to the flash\n",
-            size,
-            offset,
-            path.c_str());
-        std::uint32_t addr = offset;
-        std::uint32_t written = 0;
-        std::uint32_t end_addr = addr + size;
-        while (addr < end_addr) {
-            std::uint8_t write_data[260] {};
-            std::uint8_t status[4] {};
-
-            write_data[0] = IceFunCommands::PROG_PAGE;
-            write_data[1] = (addr >> 16);
-            write_data[2] = (addr >> 8);
-            write_data[3] = addr;
-
-            auto write_this_time =
-                std::min((std::uint32_t)256, (std::uint32_t)(size - written));
-            memcpy(write_data + 4, data.get() + written, write_this_time);
-            memset(
-                write_data + 4 + write_this_time,
-                0xff,
-                256 - write_this_time);
-
-            dev->write(write_data, sizeof(write_data));
-            dev->read(status, sizeof(status));
-            if (status[0] != 0) {
-                fprintf(
-                    stderr,
-                    "\nError when writing, status: #%04x #%04x #%04x #%04x\n",
-                    status[0],
-                    status[1],
-                    status[2],
-                    status[3]);
-                break;
-            }
-            fprintf(stdout, ".");
+            out,
+            "  %-16s %-12s %-6s %6u ms%s%s\n",
+            result.serial.c_str(),
+            result.location.c_str(),
+            result.ok ? "ok" : "FAILED",
+            (std::uint32_t)result.elapsed.count(),
+            result.error.empty() ? "" : "  ",
+            result.error.c_str());
+        all_ok &= result.ok;
+    }
 
-            written += write_this_time;
-            addr += write_this_time;
+    return all_ok;
+}
+
+// Runs the job described by the command line on the boards found
+int run_job(
+    const std::vector<std::shared_ptr<Transport>>& devices,
+    const CommandLine& params,
+    std::chrono::steady_clock::time_point start) {
+    if (devices.empty()) {
+        throw std::runtime_error("No supported devices found");
+    }
+    if (params.all_devices) {
+        if (params.action == Action::READ_BOARD) {
+            throw std::runtime_error("Reading from all the boards is not supported");
         }
-        fprintf(stdout, "\n");
-        fprintf(stdout, "Wrote %u bytes\n", written);
+        return run_on_all_boards(devices, params) ? EXIT_SUCCESS
+                                                  : EXIT_FAILURE;
+    }
+    if (devices.size() > 1) {
+        throw std::runtime_error(
+            "More than one supported device found. Please connect just one device or use --all");
     }
 
-    {
+    const auto& dev = devices.front();
+    IceFunProgrammer programmer(dev, params, console_callbacks(dev, params));
+    if (params.action == Action::CYCLE_BOARD) {
+        programmer.cycle();
         fprintf(
-            stdout,
-            "Verifying %d bytes starting at offset %d from '%s' to the flash\n",
-            size,
-            offset,
-            path.c_str());
-        std::uint32_t addr = offset;
-        std::uint32_t verified = 0;
-        std::uint32_t end_addr = addr + size;
-        while (addr < end_addr) {
-            std::uint8_t verify_data[260] {};
-            std::uint8_t status[4] {};
-
-            verify_data[0] = IceFunCommands::VERIFY_PAGE;
-            verify_data[1] = (addr >> 16);
-            verify_data[2] = (addr >> 8);
-            verify_data[3] = addr;
-
-            auto verified_this_time =
-                std::min((std::uint32_t)256, (std::uint32_t)(size - verified));
-            memcpy(verify_data + 4, data.get() + verified, verified_this_time);
-            memset(
-                verify_data + 4 + verified_this_time,
-                0xff,
-                256 - verified_this_time);
-
-            dev->write(verify_data, sizeof(verify_data));
-            dev->read(status, sizeof(status));
-            if (status[0] != 0) {
-                fprintf(
-                    stderr,
-                    "\nError when verifying, status: #%04x #%04x #%04x #%04x\n",
-                    status[0],
-                    status[1],
-                    status[2],
-                    status[3]);
-                break;
-            }
-            fprintf(stdout, ".");
-
-            verified += verified_this_time;
-            addr += verified_this_time;
-        }
-        fprintf(stdout, "\n");
-        fprintf(stdout, "Verified %u bytes\n", verified);
+            log_file,
+            "Done in %u ms\n",
+            (std::uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count());
+        return EXIT_SUCCESS;
+    } else if (params.action == Action::READ_BOARD) {
+        return programmer.read_file().ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    } else if (params.action == Action::WRITE_BOARD) {
+        return programmer.write_file().ok ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
-    const auto run = run_board(dev);
-    fprintf(stdout, "Run: %#02x\n", run);
+    throw std::logic_error("Unsupported option");
 }
 
-void read_board(
-    const std::shared_ptr<CdcAcmUsbDevice>& dev,
-    std::optional<std::uint32_t> offset_opt,
-    std::optional<std::uint32_t> size_opt,
-    const std::string& path) {
-    std::uint32_t offset = offset_opt.value_or(0);
+// SIGINT and SIGTERM set `stop_requested`. Without SA_RESTART, they also
+// interrupt the blocking calls.
+void install_stop_handlers() {
+    struct sigaction action {};
+    action.sa_handler = [](int) { stop_requested = 1; };
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+}
 
-    if (offset > MAX_FLASH_SIZE_BYTES) {
-        throw std::runtime_error("The offset is too large");
+std::string working_dir() {
+    char cwd[PATH_MAX] {};
+    if (!getcwd(cwd, sizeof(cwd))) {
+        throw std::runtime_error("Cannot get the working directory");
     }
+    return cwd;
+}
 
-    const std::uint32_t size = size_opt.value_or(MAX_FLASH_SIZE_BYTES - offset);
-    if (size > MAX_FLASH_SIZE_BYTES) {
-        throw std::runtime_error("The size is too large");
+// Takes the relative path as relative to `dir`
+std::string resolve_path(const std::string& dir, const std::string& path) {
+    if (path.empty() || path[0] == '/') {
+        return path;
     }
+    return dir + "/" + path;
+}
 
-    std::ofstream f(path, std::ios::out | std::ios::binary);
-    if (!f) {
-        throw std::runtime_error("Cannot open the file");
+// Keeps the boards open and claimed, and runs the jobs submitted by the
+// clients one after another. The output of a job is streamed back to its
+// client. Runs until interrupted.
+int run_daemon(
+    const std::vector<std::shared_ptr<Transport>>& devices,
+    const CommandLine& params) {
+    if (devices.empty()) {
+        throw std::runtime_error("No supported devices found");
     }
 
-    const auto board_version = get_board_version(dev);
-    fprintf(stdout, "Board version: %d\n", board_version);
+    install_stop_handlers();
+    signal(SIGPIPE, SIG_IGN);
+
+    // The working directory stays put, the jobs have their paths resolved
+    // against the directories of their clients instead
+    const auto socket_path = resolve_path(working_dir(), params.socket_path);
+    const auto listen_fd = listen_unix(socket_path);
+    fprintf(
+        stdout,
+        "Serving %u boards on '%s'\n",
+        (std::uint32_t)devices.size(),
+        socket_path.c_str());
+    for (const auto& dev : devices) {
+        fprintf(
+            stdout,
+            "  '%s' @ %s\n",
+            dev->serial().c_str(),
+            dev->location().c_str());
+    }
 
-    const auto flash_id = reset_board(dev);
-    fprintf(stdout, "Reset, flash ID: %#06x\n", flash_id);
+    while (!stop_requested) {
+        const auto client_fd = accept(listen_fd, nullptr, nullptr);
+        if (client_fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Cannot accept a client: %s\n", strerror(errno));
+            break;
+        }
+
+        // A client stalling in the middle of its job does not hold up the
+        // others for long
+        const timeval timeout {JOB_RECEIVE_TIMEOUT_SEC, 0};
+        setsockopt(
+            client_fd,
+            SOL_SOCKET,
+            SO_RCVTIMEO,
+            &timeout,
+            sizeof(timeout));
+
+        std::vector<std::string> args;
+        const auto out = receive_job(client_fd, args) && !args.empty()
+            ? fdopen(dup(client_fd), "w")
+            : nullptr;
+        if (!out) {
+            close(client_fd);
+            continue;
+        }
+        setvbuf(out, nullptr, _IOLBF, 0);
+
+        const auto start = std::chrono::steady_clock::now();
+        std::string job;
+        int status = EXIT_FAILURE;
+
+        log_file = out;
+        err_file = out;
+        event_file = out;
+        try {
+            // The client's working directory comes first, then its
+            // command line
+            std::vector<char*> argv {const_cast<char*>("iceFUNprog2")};
+            for (auto arg_idx = 1u; arg_idx < args.size(); ++arg_idx) {
+                argv.push_back(args[arg_idx].data());
+                job += (arg_idx > 1 ? " " : "") + args[arg_idx];
+            }
+
+            auto job_params = CommandLine(argv.size(), argv.data());
+            for (auto* path :
+                 {&job_params.path,
+                  &job_params.second_path,
+                  &job_params.store_path,
+                  &job_params.cache_path}) {
+                *path = resolve_path(args[0], *path);
+            }
+            if (job_params.progress == ProgressMode::JSON) {
+                // Only the events go to the client
+                log_file = stdout;
+            }
+            if ((job_params.action != Action::CYCLE_BOARD
+                 && job_params.action != Action::READ_BOARD
+                 && job_params.action != Action::WRITE_BOARD)
+                || job_params.auto_flash || job_params.client) {
+                throw std::runtime_error("Unsupported job");
+            }
+            // One trace covers the daemon, the jobs cannot have their own
+            if (!job_params.trace_path.empty()) {
+                throw std::runtime_error(
+                    "--trace goes to the daemon, not to its jobs");
+            }
+
+            // Jobs may pick the boards by serial or location
+            std::vector<std::shared_ptr<Transport>> job_devices;
+            for (const auto& dev : devices) {
+                if ((job_params.serial.empty()
+                     || job_params.serial == dev->serial())
+                    && (job_params.port.empty()
+                        || job_params.port == dev->location())) {
+                    job_devices.push_back(dev);
+                }
+            }
+
+            status = run_job(job_devices, job_params, start);
+        } catch (const std::exception& e) {
+            fprintf(out, "Error: %s\n", e.what());
+        }
+        log_file = stdout;
+        err_file = stderr;
+        event_file = stdout;
+
+        fputc('\0', out);
+        fputc(status, out);
+        fclose(out);
+        close(client_fd);
+
+        fprintf(
+            stdout,
+            "Job '%s': %s in %u ms\n",
+            job.c_str(),
+            status == EXIT_SUCCESS ? "ok" : "failed",
+            (std::uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count());
+    }
+
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    fprintf(stdout, "Stopped\n");
+
+    return EXIT_SUCCESS;
+}
+
+// Production line mode: flashes every board as it gets plugged in, the
+// boards already connected included. Each board is handled by its own
+// worker so that the new arrivals do not wait; the finished workers are
+// reaped as the loop goes, and only the totals are kept. Runs until
+// interrupted.
+int run_auto_flash(Usb& bus, const CommandLine& params) {
+    const MappedFile file(params.path, false);
+
+    struct Worker {
+        std::thread thread;
+        bool done {};
+    };
+
+    std::mutex lock;
+    std::vector<libusb_device*> arrived;
+    std::list<Worker> workers;
+    std::uint32_t flashed = 0;
+    std::uint32_t failed = 0;
+
+    install_stop_handlers();
+    bus.watch(params.vendor_id, params.product_id, [&](libusb_device* usb_dev) {
+        std::lock_guard<std::mutex> guard(lock);
+        arrived.push_back(usb_dev);
+    });
 
     fprintf(
         stdout,
-        "Reading %d bytes starting at offset %d to '%s'\n",
-        size,
-        offset,
-        path.c_str());
-
-    std::uint32_t read = 0;
-    while (read < size) {
-        char cmd_buf[260] {};
-
-        cmd_buf[0] = IceFunCommands::READ_PAGE;
-        cmd_buf[1] = (char)(offset >> 16);
-        cmd_buf[2] = (char)(offset >> 8);
-        cmd_buf[3] = (char)(offset);
-
-        if (dev->write((std::uint8_t*)cmd_buf, 4) == 4) {
-            if (dev->read((std::uint8_t*)cmd_buf + 4, 256) == 256) {
-                f.write(cmd_buf + 4, 256);
+        "Waiting for the %#06x:%#06x boards to flash '%s' to, verify: %s\n",
+        params.vendor_id,
+        params.product_id,
+        params.path.c_str(),
+        verify_mode_name(params.verify));
+
+    while (!stop_requested) {
+        bus.handle_events(100);
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        for (auto worker = workers.begin(); worker != workers.end();) {
+            if (worker->done) {
+                worker->thread.join();
+                worker = workers.erase(worker);
             } else {
-                break;
+                ++worker;
             }
-        } else {
-            break;
         }
 
-        fprintf(stdout, ".");
+        for (const auto usb_dev : arrived) {
+            auto& worker = workers.emplace_back();
+            worker.thread = std::thread([&, usb_dev, worker = &worker] {
+                BoardResult result;
+                try {
+                    const auto dev = bus.open_device(
+                        usb_dev,
+                        params.vendor_id,
+                        params.product_id,
+                        params.port,
+                        params.serial);
+                    if (dev) {
+                        result =
+                            run_on_board(traced(dev), params, &file, stdout);
+                    } else {
+                        result.error = "Not a supported device";
+                    }
+                } catch (const std::exception& e) {
+                    result.error = e.what();
+                }
+                if (result.location.empty()) {
+                    result.location = device_location(usb_dev);
+                }
+                libusb_unref_device(usb_dev);
+
+                std::lock_guard<std::mutex> guard(lock);
+                result.ok ? ++flashed : ++failed;
+                fprintf(
+                    stdout,
+                    "=== Board '%s' @ %s\n%s",
+                    result.serial.c_str(),
+                    result.location.c_str(),
+                    result.log.c_str());
+                fprintf(
+                    stdout,
+                    "Board '%s' @ %s: %s in %u ms%s%s (%u ok, %u failed)\n",
+                    result.serial.c_str(),
+                    result.location.c_str(),
+                    result.ok ? "ok" : "FAILED",
+                    (std::uint32_t)result.elapsed.count(),
+                    result.error.empty() ? "" : ", ",
+                    result.error.c_str(),
+                    flashed,
+                    failed);
+                worker->done = true;
+            });
+        }
+        arrived.clear();
+    }
+
+    bus.unwatch();
+    fprintf(stdout, "Stopping, waiting for %u boards\n", (std::uint32_t)workers.size());
+    for (auto& worker : workers) {
+        worker.thread.join();
+    }
+    for (const auto usb_dev : arrived) {
+        libusb_unref_device(usb_dev);
+    }
+    fprintf(stdout, "Flashed %u boards, %u failed\n", flashed, failed);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Submits the command line as a job to the daemon and prints its output,
+// returns the exit code of the job
+int run_client(int argc, char** argv, const CommandLine& params) {
+    std::vector<std::string> args {working_dir()};
+    for (auto arg_idx = 1; arg_idx < argc; ++arg_idx) {
+        if (!strcmp(argv[arg_idx], "--client")) {
+            ++arg_idx;
+            continue;
+        }
+        args.push_back(argv[arg_idx]);
+    }
 
-        read += 256;
-        offset += 256;
+    const auto fd = connect_unix(params.socket_path);
+    if (!send_job(fd, args)) {
+        close(fd);
+        throw std::runtime_error("Cannot submit the job");
     }
 
-    fprintf(stdout, "\n");
-    fprintf(stdout, "Saved %d bytes to '%s'\n", read, path.c_str());
+    // The output runs up to a NUL byte followed by the exit code
+    char buf[4096];
+    for (;;) {
+        const auto received = recv(fd, buf, sizeof(buf), 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            break;
+        }
+
+        const auto end = static_cast<const char*>(memchr(buf, 0, received));
+        if (!end) {
+            fwrite(buf, 1, received, stdout);
+            continue;
+        }
+
+        fwrite(buf, 1, end - buf, stdout);
+
+        std::uint8_t status = EXIT_FAILURE;
+        if (end + 1 < buf + received) {
+            status = end[1];
+        } else {
+            receive_all(fd, &status, sizeof(status));
+        }
+        close(fd);
+        return status;
+    }
 
-    const auto run = run_board(dev);
-    fprintf(stdout, "Run: %#02x\n", run);
+    close(fd);
+    throw std::runtime_error("The daemon closed the connection");
 }
 
 void disable_stdio_buffering() {
@@ -327,12 +719,39 @@ void usage(const char* prog_name) {
         stderr,
         "  -h                display usage information and exit.\n");
     fprintf(stderr, "  -c                Cycle the board.\n");
+    fprintf(
+        stderr,
+        "  --daemon <socket> Keep the boards open and run the jobs submitted to the socket.\n");
     fprintf(
         stderr,
         "  -r <output file>  Save the contents of the on-board flash to the file.\n");
     fprintf(
         stderr,
         "  -w <input file>   Write the contents of the file to the on-board flash.\n");
+    fprintf(
+        stderr,
+        "                    gzip and zstd files are decompressed while writing,\n");
+    fprintf(
+        stderr,
+        "                    the iCE40 bitstreams in them up front to be checked.\n");
+    fprintf(
+        stderr,
+        "  --rebuild <snapshot> <output file>  Rebuild the raw image of the snapshot\n");
+    fprintf(
+        stderr,
+        "                    from the store given with --store.\n");
+    fprintf(
+        stderr,
+        "  --diff-snapshots <snapshot> <snapshot>  List where the snapshots differ.\n");
+    fprintf(
+        stderr,
+        "  -m <manifest>     Write the images listed in the manifest, a line per image\n");
+    fprintf(
+        stderr,
+        "                    with its offset and file, and 'warmboot [coldboot]' to\n");
+    fprintf(
+        stderr,
+        "                    add the header booting them.\n");
     fprintf(stderr, "Options:\n");
     fprintf(
         stderr,
@@ -346,13 +765,131 @@ void usage(const char* prog_name) {
     fprintf(
         stderr,
         "  -s <size>         Optional size to write or read, same syntax as for -o.\n");
+    fprintf(
+        stderr,
+        "  -q <depth>        Number of page commands kept in flight when writing\n");
+    fprintf(
+        stderr,
+        "                    or reading (default: %u, 1 waits for every reply).\n",
+        DEFAULT_QUEUE_DEPTH);
+    fprintf(
+        stderr,
+        "  --progress=<how>  Report progress with 'dots' (default) or with 'json' events on\n");
+    fprintf(
+        stderr,
+        "                    stdout, one per line, the log going to stderr.\n");
+    fprintf(
+        stderr,
+        "  --trace <file>    Write a Chrome/Perfetto trace to the file and print the command\n");
+    fprintf(
+        stderr,
+        "                    latency histograms at exit.\n");
+    fprintf(
+        stderr,
+        "  --sim[=<timings>] Talk to a board simulated in the process, with the 'at25sf081'\n");
+    fprintf(
+        stderr,
+        "                    (default), 'none' or 'flaky' timings, the latter stalling\n");
+    fprintf(
+        stderr,
+        "                    now and then to exercise the retries.\n");
+    fprintf(
+        stderr,
+        "  --auto            Keep flashing the boards as they are plugged in, with -w.\n");
+    fprintf(
+        stderr,
+        "  --client <socket> Submit -c, -r or -w as a job to the daemon listening there.\n");
+    fprintf(
+        stderr,
+        "                    The daemon started with --trace traces all the jobs.\n");
+    fprintf(
+        stderr,
+        "  --serial <serial> Use the board with this USB serial string.\n");
+    fprintf(
+        stderr,
+        "  --port <path>     Use the board at this USB bus-port path, e.g. 1-2.4.\n");
+    fprintf(
+        stderr,
+        "  -v                Print the USB descriptors of the boards found.\n");
+    fprintf(
+        stderr,
+        "  --all             Write or cycle all the connected boards at once.\n");
+    fprintf(
+        stderr,
+        "  --verify=<mode>   How to verify the written pages (default: device):\n");
+    fprintf(
+        stderr,
+        "                    device sends the pages back for the board to compare,\n");
+    fprintf(
+        stderr,
+        "                    readback reads the pages back and compares them here,\n");
+    fprintf(
+        stderr,
+        "                    hash reads the whole range back and compares its SHA-256,\n");
+    fprintf(stderr, "                    none skips verification.\n");
+    fprintf(
+        stderr,
+        "  --diff            Read the flash back first and only erase and program\n");
+    fprintf(
+        stderr,
+        "                    the sectors that differ from the file.\n");
+    fprintf(
+        stderr,
+        "  --cache <file>    Remember what the flash of each board holds in the file\n");
+    fprintf(
+        stderr,
+        "                    and skip writing sectors that already hold the data.\n");
+    fprintf(
+        stderr,
+        "  --cache-sample <pages>  Read back this many random pages of every sector\n");
+    fprintf(
+        stderr,
+        "                    skipped due to the cache to check it (default: 0).\n");
+    fprintf(
+        stderr,
+        "  --raw             Write the file as it is, without checking the iCE40 bitstream\n");
+    fprintf(
+        stderr,
+        "                    and skipping the padding after its configuration data, or\n");
+    fprintf(
+        stderr,
+        "                    taking it for an Intel HEX, ELF or Android sparse image.\n");
+    fprintf(
+        stderr,
+        "  --store <dir>     With -r, keep the contents in the store of chunks there, each\n");
+    fprintf(
+        stderr,
+        "                    chunk once, and save the list of the chunks to the file.\n");
+    fprintf(
+        stderr,
+        "  --journal         Keep a journal of the write or read next to the file.\n");
+    fprintf(
+        stderr,
+        "  --resume          Go on with the write or read that stopped, from its\n");
+    fprintf(
+        stderr,
+        "                    journal, instead of starting over.\n");
+    fprintf(
+        stderr,
+        "  --chip-erase      Allow erasing the whole chip when that is faster than\n");
+    fprintf(
+        stderr,
+        "                    erasing sector by sector, the flash outside the file is lost.\n");
+    fprintf(
+        stderr,
+        "  --blank-check     Read the sectors first and do not erase those already erased.\n");
     fprintf(stderr, "Examples:\n");
     fprintf(stderr, "  %s -w turing.bin\n", prog_name);
     fprintf(stderr, "  %s -r butterfly.bin -o 0x40k\n", prog_name);
+    fprintf(stderr, "  %s --auto -w turing.bin --verify=hash\n", prog_name);
+    fprintf(stderr, "  %s --daemon /tmp/icefun.sock &\n", prog_name);
+    fprintf(stderr, "  %s --client /tmp/icefun.sock -w turing.bin\n", prog_name);
     fprintf(stderr, "\n");
 }
 
 int main(int argc, char** argv) try {
+    const auto start = std::chrono::steady_clock::now();
+
     disable_stdio_buffering();
 
     const auto params = CommandLine(argc, argv);
@@ -366,31 +903,68 @@ int main(int argc, char** argv) try {
         return EXIT_SUCCESS;
     }
 
-    auto bus = Usb();
-    bus.open();
+    if (params.client) {
+        return run_client(argc, argv, params);
+    }
 
-    const auto devices = bus.find(params.vendor_id, params.product_id);
-    if (devices.empty()) {
-        throw std::runtime_error("No supported devices found");
+    // The snapshots are taken care of without the boards
+    if (params.action == Action::REBUILD_SNAPSHOT) {
+        rebuild_snapshot(params);
+        return EXIT_SUCCESS;
     }
-    if (devices.size() > 1) {
-        throw std::runtime_error(
-            "More than one supported device found. Please connect just one device");
+    if (params.action == Action::DIFF_SNAPSHOTS) {
+        return diff_snapshots(params) ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
-    const auto& dev = devices.front();
-    if (params.action == Action::CYCLE_BOARD) {
-        cycle_board(dev);
-        return EXIT_SUCCESS;
-    } else if (params.action == Action::READ_BOARD) {
-        read_board(dev, params.offset, params.size, params.path);
-        return EXIT_SUCCESS;
-    } else if (params.action == Action::WRITE_BOARD) {
-        write_board(dev, params.offset, params.size, params.path);
-        return EXIT_SUCCESS;
+    if (params.auto_flash
+        && (params.action != Action::WRITE_BOARD || params.all_devices)) {
+        throw std::runtime_error("--auto goes with -w and without --all");
     }
 
-    throw std::logic_error("Unsupported option");
+    // The events own stdout, fully buffered and flushed a line at a time
+    if (params.progress == ProgressMode::JSON) {
+        setvbuf(stdout, nullptr, _IOFBF, BUFSIZ);
+        log_file = stderr;
+    }
+
+    if (!params.trace_path.empty()) {
+        Trace::enable();
+    }
+    const TraceDump trace_dump(params.trace_path, stderr);
+
+    std::unique_ptr<Usb> bus;
+    std::vector<std::shared_ptr<Transport>> devices;
+    if (params.simulate) {
+        if (params.auto_flash) {
+            throw std::runtime_error("--auto needs the real boards");
+        }
+        devices.push_back(std::make_shared<SimulatedDevice>(
+            "SIM00000",
+            SimTimings::named(params.sim_timings)));
+    } else {
+        bus = std::make_unique<Usb>();
+        if (params.auto_flash) {
+            return run_auto_flash(*bus, params);
+        }
+
+        TraceSpan span("discover", "usb");
+        bus->open();
+        devices = bus->find(
+            params.vendor_id,
+            params.product_id,
+            params.port,
+            params.serial,
+            params.verbose);
+    }
+    for (auto& dev : devices) {
+        dev = traced(dev);
+    }
+
+    if (params.action == Action::DAEMON) {
+        return run_daemon(devices, params);
+    }
+
+    return run_job(devices, params, start);
 } catch (const std::exception& e) {
     fprintf(stderr, "Error: %s\n", e.what());
     return EXIT_FAILURE;
@@ -0,0 +1,67 @@
+#ifndef __ICEFUN_HPP__
+#define __ICEFUN_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <cstddef>
+#include <cstdint>
+
+// The protocol spoken by the PIC of the iceFUN board, and the geometry of its
+// flash
+
+constexpr std::uint16_t ICEFUN_VENDOR_ID = 0x04d8;  // Microchip Technology Inc.
+constexpr std::uint16_t ICEFUN_PRODUCT_ID = 0xffee;  // Devantech USB-ISS
+
+constexpr std::uint32_t MAX_FLASH_SIZE_BYTES = 1048576;
+constexpr std::uint32_t PAGE_SIZE_BYTES = 256;
+constexpr std::uint32_t SECTOR_SHIFT = 16;
+constexpr std::uint32_t SECTOR_SIZE_BYTES = 1 << SECTOR_SHIFT;
+constexpr std::uint16_t COMMAND_HEADER_SIZE_BYTES = 4;
+constexpr std::uint16_t STATUS_SIZE_BYTES = 4;
+
+// Erasing the whole chip takes far longer than the other commands
+constexpr int ERASE_CHIP_TIMEOUT_MSEC = 30000;
+
+enum IceFunCommands : std::uint8_t {
+    DONE = 0xb0,
+    GET_VER,
+    RESET_FPGA,
+    ERASE_CHIP,
+    ERASE_64k,
+    PROG_PAGE,
+    READ_PAGE,
+    VERIFY_PAGE,
+    GET_CDONE,
+    RELEASE_FPGA
+};
+
+// Bytes in the frame of the command, the board takes the unknown ones for
+// one-byte commands and ignores them
+inline std::size_t command_frame_size(std::uint8_t cmd) {
+    switch (cmd) {
+        case IceFunCommands::ERASE_64k:
+            return 2;
+        case IceFunCommands::READ_PAGE:
+            return COMMAND_HEADER_SIZE_BYTES;
+        case IceFunCommands::PROG_PAGE:
+        case IceFunCommands::VERIFY_PAGE:
+            return COMMAND_HEADER_SIZE_BYTES + PAGE_SIZE_BYTES;
+        default:
+            return 1;
+    }
+}
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef __JOB_SOCKET_HPP__
+#define __JOB_SOCKET_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Jobs go from the client to the daemon over a Unix domain socket as a list
+// of strings: the working directory of the client followed by its command
+// line. Each string is sent as a 32-bit length and the bytes, the list is
+// preceded by the number of strings.
+//
+// The daemon streams the output of the job back as text, then sends a NUL
+// byte and a byte with the exit code of the job.
+
+#ifndef MSG_NOSIGNAL
+    #define MSG_NOSIGNAL 0
+#endif
+
+constexpr std::uint32_t MAX_JOB_ARGS = 256;
+constexpr std::uint32_t MAX_JOB_ARG_SIZE = 4096;
+// How long the daemon waits for the rest of a job once the client connects
+constexpr int JOB_RECEIVE_TIMEOUT_SEC = 5;
+
+inline bool send_all(int fd, const void* data, std::size_t size) {
+    auto bytes = static_cast<const std::uint8_t*>(data);
+    while (size) {
+        const auto sent = ::send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+inline bool receive_all(int fd, void* data, std::size_t size) {
+    auto bytes = static_cast<std::uint8_t*>(data);
+    while (size) {
+        const auto received = ::recv(fd, bytes, size, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        bytes += received;
+        size -= received;
+    }
+    return true;
+}
+
+inline bool send_job(int fd, const std::vector<std::string>& args) {
+    const std::uint32_t count = args.size();
+    if (!send_all(fd, &count, sizeof(count))) {
+        return false;
+    }
+    for (const auto& arg : args) {
+        const std::uint32_t size = arg.size();
+        if (!send_all(fd, &size, sizeof(size))
+            || !send_all(fd, arg.data(), size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool receive_job(int fd, std::vector<std::string>& args) {
+    std::uint32_t count = 0;
+    if (!receive_all(fd, &count, sizeof(count)) || count > MAX_JOB_ARGS) {
+        return false;
+    }
+
+    args.resize(count);
+    for (auto& arg : args) {
+        std::uint32_t size = 0;
+        if (!receive_all(fd, &size, sizeof(size)) || size > MAX_JOB_ARG_SIZE) {
+            return false;
+        }
+        arg.resize(size);
+        if (!receive_all(fd, arg.data(), size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline sockaddr_un unix_address(const std::string& path) {
+    sockaddr_un addr {};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("The socket path is too long");
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    return addr;
+}
+
+// Listens on the socket, replacing a stale socket file left behind
+inline int listen_unix(const std::string& path) {
+    const auto addr = unix_address(path);
+
+    const auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw std::runtime_error(
+            std::string("Cannot create a socket: ") + strerror(errno));
+    }
+
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0
+        || listen(fd, 16) < 0) {
+        const auto err = errno;
+        ::close(fd);
+        throw std::runtime_error(
+            "Cannot listen on '" + path + "': " + strerror(err));
+    }
+
+    return fd;
+}
+
+inline int connect_unix(const std::string& path) {
+    const auto addr = unix_address(path);
+
+    const auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw std::runtime_error(
+            std::string("Cannot create a socket: ") + strerror(errno));
+    }
+
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr))
+        < 0) {
+        const auto err = errno;
+        ::close(fd);
+        throw std::runtime_error(
+            "Cannot connect to '" + path + "': " + strerror(err));
+    }
+
+    return fd;
+}
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef __JOURNAL_HPP__
+#define __JOURNAL_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "icefun.hpp"
+#include "mappedfile.hpp"
+#include "sha256.hpp"
+
+// Records how far a write or a read of the flash got: the sectors erased and
+// the pages the board confirmed, so that an interrupted operation can go on
+// with --resume instead of starting over. The file is a single record used
+// through a shared mapping, updated as the operation goes and removed once it
+// completes. The record is keyed by the board, the range and, for writes, the
+// digest of the image.
+
+class Journal {
+  public:
+    enum class Operation : std::uint32_t {
+        WRITE = 1,
+        READ = 2
+    };
+
+    static constexpr std::uint32_t SECTOR_COUNT =
+        MAX_FLASH_SIZE_BYTES / SECTOR_SIZE_BYTES;
+    static constexpr std::uint32_t PAGE_COUNT =
+        MAX_FLASH_SIZE_BYTES / PAGE_SIZE_BYTES;
+
+    // Opens the journal at `path`. With `resume`, picks up the record left
+    // there by the same operation, and throws when it is of another one.
+    // Starts a new record otherwise, and when there is none to resume.
+    Journal(
+        const std::string& path,
+        Operation operation,
+        const std::string& serial,
+        std::uint32_t flash_id,
+        std::uint32_t offset,
+        std::uint32_t size,
+        const Sha256::Digest& digest,
+        bool resume) :
+        _path(path),
+        _file(path, true) {
+        if (resume && _file.size() != 0) {
+            const auto rec = record();
+            if (_file.size() != sizeof(Record)
+                || memcmp(rec->magic, MAGIC, sizeof(rec->magic))
+                || rec->version != FORMAT_VERSION) {
+                throw std::runtime_error("'" + path + "' is not a journal file");
+            }
+            if (rec->operation != (std::uint32_t)operation
+                || rec->flash_id != flash_id
+                || strncmp(rec->serial, serial.c_str(), sizeof(rec->serial))
+                || rec->offset != offset || rec->size != size
+                || memcmp(rec->digest, digest.data(), sizeof(rec->digest))) {
+                throw std::runtime_error(
+                    "'" + path
+                    + "' records another operation, run without --resume to start over");
+            }
+            _resumed = true;
+            return;
+        }
+
+        _file.resize(0);
+        _file.resize(sizeof(Record));
+
+        auto rec = record();
+        memcpy(rec->magic, MAGIC, sizeof(rec->magic));
+        rec->version = FORMAT_VERSION;
+        rec->operation = (std::uint32_t)operation;
+        strncpy(rec->serial, serial.c_str(), sizeof(rec->serial) - 1);
+        rec->flash_id = flash_id;
+        rec->offset = offset;
+        rec->size = size;
+        memcpy(rec->digest, digest.data(), sizeof(rec->digest));
+        _file.flush();
+    }
+
+    ~Journal() {
+        _file.flush();
+    }
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    const std::string& path() const {
+        return _path;
+    }
+
+    // Whether the record was left by an earlier run
+    bool resumed() const {
+        return _resumed;
+    }
+
+    bool sector_erased(std::uint32_t sector_idx) const {
+        return record()->erased_sectors >> (sector_idx % SECTOR_COUNT) & 1;
+    }
+
+    void mark_erased(std::uint32_t sector_idx) {
+        record()->erased_sectors |= 1u << (sector_idx % SECTOR_COUNT);
+    }
+
+    bool page_confirmed(std::uint32_t page_idx) const {
+        page_idx %= PAGE_COUNT;
+        return record()->confirmed_pages[page_idx / 8] >> (page_idx % 8) & 1;
+    }
+
+    void confirm_page(std::uint32_t page_idx) {
+        page_idx %= PAGE_COUNT;
+        record()->confirmed_pages[page_idx / 8] |= 1 << (page_idx % 8);
+    }
+
+    std::uint32_t erased_sectors() const {
+        return __builtin_popcount(record()->erased_sectors);
+    }
+
+    std::uint32_t confirmed_pages() const {
+        std::uint32_t count = 0;
+        for (const auto bits : record()->confirmed_pages) {
+            count += __builtin_popcount(bits);
+        }
+        return count;
+    }
+
+    void flush() {
+        _file.flush();
+    }
+
+    // Drops the record of the completed operation
+    void remove() {
+        unlink(_path.c_str());
+    }
+
+  private:
+    static constexpr char MAGIC[8] = {'i', 'c', 'e', 'F', 'U', 'N', 'j', 'r'};
+    static constexpr std::uint32_t FORMAT_VERSION = 1;
+
+    struct Record {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t operation;
+        char serial[64];
+        std::uint32_t flash_id;
+        std::uint32_t offset;
+        std::uint32_t size;
+        std::uint32_t erased_sectors;
+        std::uint8_t digest[32];
+        std::uint8_t confirmed_pages[PAGE_COUNT / 8];
+    };
+    static_assert(SECTOR_COUNT <= 32, "A bit per sector must fit");
+
+    Record* record() {
+        return reinterpret_cast<Record*>(_file.data());
+    }
+
+    const Record* record() const {
+        return reinterpret_cast<const Record*>(_file.data());
+    }
+
+    std::string _path;
+    MappedFile _file;
+    bool _resumed {};
+};
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef __MANIFEST_HPP__
+#define __MANIFEST_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "icefun.hpp"
+
+// An image to write at the given offset
+struct ManifestImage {
+    std::uint32_t offset {};
+    std::string path;
+};
+
+// A layout of images written together, e.g. for the iCE40 warmboot, read
+// from a text file with a line per image:
+//
+//     # The header rebooting into the images below
+//     warmboot [coldboot]
+//     0x20000 blinky.bin
+//     0x40000 music.bin.gz
+//
+// The offsets take the 'k' and 'M' suffixes like -o does, and the relative
+// paths are taken relative to the manifest. '#' starts a comment.
+struct Manifest {
+    // The icemulti layout: the power-on entry and then one per image
+    static constexpr std::uint32_t WARMBOOT_ENTRIES = 5;
+    static constexpr std::uint32_t WARMBOOT_ENTRY_SIZE = 32;
+    static constexpr std::uint32_t WARMBOOT_HEADER_SIZE =
+        WARMBOOT_ENTRIES * WARMBOOT_ENTRY_SIZE;
+    static constexpr std::uint32_t WARMBOOT_IMAGES = WARMBOOT_ENTRIES - 1;
+
+    std::vector<ManifestImage> images;
+    bool warmboot {};
+    // Whether the power-on image is picked with the cold boot pins
+    bool coldboot {};
+
+    static Manifest
+    parse(const char* text, std::size_t size, const std::string& path) {
+        Manifest manifest;
+
+        const auto dir_end = path.find_last_of('/');
+        const auto dir =
+            dir_end == std::string::npos ? std::string() : path.substr(0, dir_end + 1);
+
+        std::size_t line_no = 0;
+        std::size_t pos = 0;
+        while (pos < size) {
+            auto line_end = pos;
+            while (line_end < size && text[line_end] != '\n') {
+                ++line_end;
+            }
+            auto line = std::string(text + pos, line_end - pos);
+            pos = line_end + 1;
+            ++line_no;
+
+            const auto error = [&](const char* what) {
+                return std::runtime_error(
+                    path + ":" + std::to_string(line_no) + ": " + what);
+            };
+
+            line = trim(line.substr(0, line.find('#')));
+            if (line.empty()) {
+                continue;
+            }
+
+            const auto split = line.find_first_of(" \t");
+            const auto head = line.substr(0, split);
+            const auto rest =
+                split == std::string::npos ? std::string() : trim(line.substr(split));
+
+            if (head == "warmboot") {
+                if (manifest.warmboot || (!rest.empty() && rest != "coldboot")) {
+                    throw error("Expected 'warmboot [coldboot]' once");
+                }
+                manifest.warmboot = true;
+                manifest.coldboot = !rest.empty();
+                continue;
+            }
+
+            char* end_ptr = nullptr;
+            std::uint64_t offset = strtoul(head.c_str(), &end_ptr, 0);
+            if (!strcmp(end_ptr, "k")) {
+                offset *= 1024;
+            } else if (!strcmp(end_ptr, "M")) {
+                offset *= 1024 * 1024;
+            } else if (*end_ptr != '\0' || end_ptr == head.c_str()) {
+                throw error("Expected '<offset> <file>'");
+            }
+            if (rest.empty()) {
+                throw error("Expected '<offset> <file>'");
+            }
+            if (offset >= MAX_FLASH_SIZE_BYTES) {
+                throw error("The offset is too large");
+            }
+
+            manifest.images.push_back(
+                {(std::uint32_t)offset, rest[0] == '/' ? rest : dir + rest});
+        }
+
+        if (manifest.images.empty()) {
+            throw std::runtime_error("No images in '" + path + "'");
+        }
+        if (manifest.warmboot && manifest.images.size() > WARMBOOT_IMAGES) {
+            throw std::runtime_error(
+                "The warmboot header takes up to 4 images, '" + path + "' has "
+                + std::to_string(manifest.images.size()));
+        }
+
+        return manifest;
+    }
+
+    // The header in the layout icemulti writes: the entries set the address
+    // of the image to boot and reboot into it. The power-on entry and the
+    // entries of the missing images boot the first image.
+    std::vector<std::uint8_t> warmboot_header() const {
+        std::vector<std::uint8_t> header(WARMBOOT_HEADER_SIZE, 0x00);
+
+        for (auto entry = 0u; entry < WARMBOOT_ENTRIES; ++entry) {
+            const auto image = entry == 0 || entry > images.size() ? 0 : entry - 1;
+            const auto addr = images[image].offset;
+            const std::uint8_t fields[] = {
+                // Preamble
+                0x7e, 0xaa, 0x99, 0x7e,
+                // Boot mode
+                0x92, 0x00, (std::uint8_t)(entry == 0 && coldboot ? 0x10 : 0x00),
+                // Boot address
+                0x44, 0x03, (std::uint8_t)(addr >> 16), (std::uint8_t)(addr >> 8),
+                (std::uint8_t)addr,
+                // Bank offset
+                0x82, 0x00, 0x00,
+                // Reboot
+                0x01, 0x08};
+            std::copy(
+                std::begin(fields),
+                std::end(fields),
+                header.begin() + entry * WARMBOOT_ENTRY_SIZE);
+        }
+
+        return header;
+    }
+
+  private:
+    static std::string trim(const std::string& text) {
+        const auto first = text.find_first_not_of(" \t\r");
+        if (first == std::string::npos) {
+            return {};
+        }
+        const auto last = text.find_last_not_of(" \t\r");
+        return text.substr(first, last - first + 1);
+    }
+};
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef __MAPPED_FILE_HPP__
+#define __MAPPED_FILE_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+// A file mapped into memory, read-only or shared read-write. Writable files
+// are created when missing and can be grown.
+
+class MappedFile {
+  public:
+    MappedFile(const std::string& path, bool writable) : _writable(writable) {
+        _fd = ::open(
+            path.c_str(),
+            writable ? (O_RDWR | O_CREAT) : O_RDONLY,
+            0644);
+        if (_fd < 0) {
+            throw std::runtime_error(
+                "Cannot open '" + path + "': " + strerror(errno));
+        }
+
+        struct stat st {};
+        if (fstat(_fd, &st) < 0) {
+            const auto err = errno;
+            ::close(_fd);
+            throw std::runtime_error(
+                "Cannot stat '" + path + "': " + strerror(err));
+        }
+
+        try {
+            map(st.st_size);
+        } catch (...) {
+            ::close(_fd);
+            throw;
+        }
+    }
+
+    ~MappedFile() {
+        unmap();
+        ::close(_fd);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::uint8_t* data() {
+        return _data;
+    }
+
+    const std::uint8_t* data() const {
+        return _data;
+    }
+
+    std::size_t size() const {
+        return _size;
+    }
+
+    // Grows or shrinks the file, the mapping may move
+    void resize(std::size_t size) {
+        if (!_writable) {
+            throw std::logic_error("The file is mapped read-only");
+        }
+
+        unmap();
+        if (ftruncate(_fd, size) < 0) {
+            throw std::runtime_error(
+                std::string("Cannot resize the file: ") + strerror(errno));
+        }
+        map(size);
+    }
+
+    // Maps the file again at its current size, after it may have been
+    // resized elsewhere
+    void remap() {
+        struct stat st {};
+        if (fstat(_fd, &st) < 0) {
+            throw std::runtime_error(
+                std::string("Cannot stat the file: ") + strerror(errno));
+        }
+
+        unmap();
+        map(st.st_size);
+    }
+
+    int fd() const {
+        return _fd;
+    }
+
+    void flush() {
+        if (_data && _writable) {
+            msync(_data, _size, MS_SYNC);
+        }
+    }
+
+  private:
+    void map(std::size_t size) {
+        _size = size;
+        if (size == 0) {
+            return;
+        }
+
+        auto addr = mmap(
+            nullptr,
+            size,
+            _writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+            _writable ? MAP_SHARED : MAP_PRIVATE,
+            _fd,
+            0);
+        if (addr == MAP_FAILED) {
+            _size = 0;
+            throw std::runtime_error(
+                std::string("Cannot map the file: ") + strerror(errno));
+        }
+        _data = static_cast<std::uint8_t*>(addr);
+    }
+
+    void unmap() {
+        if (_data) {
+            munmap(_data, _size);
+        }
+        _data = nullptr;
+        _size = 0;
+    }
+
+    int _fd {-1};
+    bool _writable {};
+    std::uint8_t* _data {};
+    std::size_t _size {};
+};
+
+#endif
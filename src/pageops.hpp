@@ -0,0 +1,110 @@
+#ifndef __PAGE_OPS_HPP__
+#define __PAGE_OPS_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+// Comparisons over flash pages. The loops process 64-bit words and carry no
+// early exits, which lets the compiler turn them into SIMD code.
+
+inline std::uint64_t load_word(const std::uint8_t* p) {
+    std::uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+// Whether the two buffers hold the same bytes
+inline bool pages_equal(
+    const std::uint8_t* a,
+    const std::uint8_t* b,
+    std::size_t size) {
+    std::uint64_t diff = 0;
+    std::size_t idx = 0;
+
+    for (; idx + sizeof(diff) <= size; idx += sizeof(diff)) {
+        diff |= load_word(a + idx) ^ load_word(b + idx);
+    }
+    for (; idx < size; ++idx) {
+        diff |= a[idx] ^ b[idx];
+    }
+
+    return diff == 0;
+}
+
+// Whether `next` can be programmed over `prev` without erasing, that is
+// programming would only need to flip bits from 1 to 0
+inline bool pages_programmable(
+    const std::uint8_t* prev,
+    const std::uint8_t* next,
+    std::size_t size) {
+    std::uint64_t set = 0;
+    std::size_t idx = 0;
+
+    for (; idx + sizeof(set) <= size; idx += sizeof(set)) {
+        set |= ~load_word(prev + idx) & load_word(next + idx);
+    }
+    for (; idx < size; ++idx) {
+        set |= ~prev[idx] & next[idx] & 0xff;
+    }
+
+    return set == 0;
+}
+
+// Offset of the first byte that differs, `size` when the buffers are equal.
+// Compares in blocks without early exits and only looks at the bytes of the
+// first differing block.
+inline std::size_t first_mismatch(
+    const std::uint8_t* a,
+    const std::uint8_t* b,
+    std::size_t size) {
+    constexpr std::size_t BLOCK_SIZE = 64;
+
+    std::size_t idx = 0;
+    while (idx < size) {
+        const auto block_size = std::min(BLOCK_SIZE, size - idx);
+        if (!pages_equal(a + idx, b + idx, block_size)) {
+            break;
+        }
+        idx += block_size;
+    }
+    for (; idx < size; ++idx) {
+        if (a[idx] != b[idx]) {
+            break;
+        }
+    }
+
+    return idx;
+}
+
+// Whether the buffer holds only 0xff bytes, i.e. matches erased flash
+inline bool page_blank(const std::uint8_t* page, std::size_t size) {
+    std::uint64_t bits = ~std::uint64_t(0);
+    std::size_t idx = 0;
+
+    for (; idx + sizeof(bits) <= size; idx += sizeof(bits)) {
+        bits &= load_word(page + idx);
+    }
+    for (; idx < size; ++idx) {
+        bits &= page[idx] | ~std::uint64_t(0xff);
+    }
+
+    return bits == ~std::uint64_t(0);
+}
+
+#endif
@@ -0,0 +1,2495 @@
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <cstdarg>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <random>
+
+#include "bitstream.hpp"
+#include "decompress.hpp"
+#include "flashcache.hpp"
+#include "icefun.hpp"
+#include "journal.hpp"
+#include "manifest.hpp"
+#include "pageops.hpp"
+#include "programmer.hpp"
+#include "snapshot.hpp"
+#include "sparse.hpp"
+#include "trace.hpp"
+
+namespace {
+
+// Rough erase times of the AT25SF081 as seen through the iceFUN, tune these
+// with the measured times printed after erasing
+constexpr std::uint32_t ERASE_64K_ESTIMATE_MSEC = 500;
+constexpr std::uint32_t ERASE_CHIP_ESTIMATE_MSEC = 6000;
+
+// How many times in a row a failed exchange is tried again after resyncing
+// with the board
+constexpr std::uint32_t MAX_RETRIES = 3;
+
+struct ErasePlan;
+struct WrittenPages;
+struct Segment;
+struct SegmentedImage;
+
+// The operation run on a board: where its messages and progress go, and the
+// result it fills in. The boards run side by side each have their own.
+class Session {
+  public:
+    Session(const ProgrammerCallbacks& callbacks, OperationResult& result) :
+        progress(callbacks.progress),
+        _callbacks(callbacks),
+        _result(result),
+        _rng(std::random_device {}()) {
+    }
+
+    __attribute__((format(printf, 2, 3))) void
+    log_info(const char* format, ...) const {
+        va_list args;
+        va_start(args, format);
+        log_message(LogLevel::INFO, format, args);
+        va_end(args);
+    }
+
+    __attribute__((format(printf, 2, 3))) void
+    log_error(const char* format, ...) const {
+        va_list args;
+        va_start(args, format);
+        log_message(LogLevel::ERROR, format, args);
+        va_end(args);
+    }
+
+    // Whether the operation is to give up
+    bool stopping() const {
+        return _callbacks.stop_requested && _callbacks.stop_requested();
+    }
+
+    // The steps of the operations, defined below
+    std::uint8_t get_board_version(const std::shared_ptr<Transport>& dev);
+
+    std::uint32_t reset_board(const std::shared_ptr<Transport>& dev);
+
+    std::size_t pipeline_with_retries(
+        const std::shared_ptr<Transport>& dev,
+        std::size_t count,
+        std::uint16_t header_size,
+        std::uint16_t payload_size,
+        std::uint16_t reply_size,
+        const Transport::FillFrame& fill,
+        const Transport::CheckReply& check,
+        std::size_t depth);
+
+    bool transact_with_retries(
+        const std::shared_ptr<Transport>& dev,
+        const std::uint8_t* frames,
+        std::size_t frames_size,
+        std::uint8_t* replies,
+        std::size_t replies_size);
+
+    std::size_t read_pages(
+        const std::shared_ptr<Transport>& dev,
+        std::uint32_t addr,
+        std::size_t page_count,
+        std::uint8_t* data,
+        std::size_t queue_depth,
+        bool probe = false);
+
+    bool sample_sector(
+        const std::shared_ptr<Transport>& dev,
+        std::uint32_t sector_idx,
+        const std::uint8_t* image,
+        std::uint32_t image_addr,
+        std::uint32_t image_size,
+        std::uint32_t sample_count);
+
+    bool sector_blank(
+        const std::shared_ptr<Transport>& dev,
+        std::uint32_t sector_idx,
+        std::size_t queue_depth);
+
+    ErasePlan plan_erase(
+        const std::shared_ptr<Transport>& dev,
+        const std::vector<std::uint32_t>& sectors,
+        bool chip_allowed,
+        bool blank_check,
+        std::size_t queue_depth);
+
+    void erase_board(
+        const std::shared_ptr<Transport>& dev,
+        const ErasePlan& plan);
+
+    void cycle_board(const std::shared_ptr<Transport>& dev);
+
+    Transport::CheckReply
+    page_status(const WrittenPages& written, const char* what);
+
+    std::size_t program_written(
+        const std::shared_ptr<Transport>& dev,
+        const WrittenPages& written,
+        std::size_t queue_depth,
+        Journal* journal = nullptr);
+
+    bool verify_written(
+        const std::shared_ptr<Transport>& dev,
+        const ProgrammerOptions& params,
+        const std::string& path,
+        const WrittenPages& written,
+        std::uint32_t offset,
+        std::uint32_t size,
+        const Sha256::Digest& image_digest);
+
+    std::uint32_t trim_bitstream(
+        const ProgrammerOptions& params,
+        const std::string& path,
+        std::uint32_t offset,
+        const std::uint8_t* image,
+        std::uint32_t size);
+
+    std::unique_ptr<Journal> open_journal(
+        const std::shared_ptr<Transport>& dev,
+        const ProgrammerOptions& params,
+        Journal::Operation operation,
+        std::uint32_t flash_id,
+        std::uint32_t offset,
+        std::uint32_t size,
+        const Sha256::Digest& digest);
+
+    void log_blank_pages(
+        const ProgrammerOptions& params,
+        std::uint32_t blank_pages);
+
+    bool write_board(
+        const std::shared_ptr<Transport>& dev,
+        const ProgrammerOptions& params,
+        std::span<const std::uint8_t> contents);
+
+    bool write_board_stream(
+        const std::shared_ptr<Transport>& dev,
+        const ProgrammerOptions& params,
+        std::span<const std::uint8_t> contents,
+        Compression compression);
+
+    void add_image_file(
+        SegmentedImage& image,
+        const ProgrammerOptions& params,
+        const std::string& path,
+        std::uint32_t offset,
+        std::span<const std::uint8_t> contents = {});
+
+    bool write_segments(
+        const std::shared_ptr<Transport>& dev,
+        const ProgrammerOptions& params,
+        std::vector<Segment> segments);
+
+    bool write_manifest(
+        const std::shared_ptr<Transport>& dev,
+        const ProgrammerOptions& params,
+        std::span<const std::uint8_t> contents);
+
+    bool write_sparse(
+        const std::shared_ptr<Transport>& dev,
+        const ProgrammerOptions& params,
+        std::span<const std::uint8_t> contents);
+
+    bool write_image(
+        const std::shared_ptr<Transport>& dev,
+        const ProgrammerOptions& params,
+        std::span<const std::uint8_t> contents);
+
+    bool read_board(
+        const std::shared_ptr<Transport>& dev,
+        const ProgrammerOptions& params);
+
+    void hold_board(const std::shared_ptr<Transport>& dev);
+
+    Progress progress;
+
+  private:
+    void log_message(LogLevel level, const char* format, va_list args) const {
+        if (!_callbacks.log) {
+            return;
+        }
+
+        va_list size_args;
+        va_copy(size_args, args);
+        const auto size = vsnprintf(nullptr, 0, format, size_args);
+        va_end(size_args);
+        if (size < 0) {
+            return;
+        }
+
+        std::string message(size, '\0');
+        vsnprintf(message.data(), size + 1, format, args);
+        _callbacks.log(level, message);
+    }
+
+    const ProgrammerCallbacks& _callbacks;
+    OperationResult& _result;
+    // Picks the pages sample_sector() reads, one per session as the boards
+    // run side by side
+    std::minstd_rand _rng;
+};
+
+std::uint8_t Session::get_board_version(const std::shared_ptr<Transport>& dev) {
+    const std::uint8_t get_ver = IceFunCommands::GET_VER;
+    std::uint8_t ver[2] {};
+
+    if (dev->write(&get_ver, sizeof(get_ver)) == sizeof(get_ver)) {
+        if (dev->read(ver, sizeof(ver)) == sizeof(ver)) {
+            if (ver[0] == 38) {
+                _result.board_version = ver[1];
+                return ver[1];
+            }
+        }
+    }
+
+    throw std::runtime_error("Unable to get board version");
+}
+
+std::uint32_t Session::reset_board(const std::shared_ptr<Transport>& dev) {
+    const std::uint8_t reset = IceFunCommands::RESET_FPGA;
+    std::uint32_t flash_id = 0;
+
+    if (dev->write(&reset, sizeof(reset)) == sizeof(reset)) {
+        if (dev->read(reinterpret_cast<std::uint8_t*>(&flash_id), 3) == 3) {
+            _result.flash_id = flash_id;
+            return flash_id;
+        }
+    }
+
+    throw std::runtime_error("Unable to reset the board");
+}
+
+std::uint8_t run_board(const std::shared_ptr<Transport>& dev) {
+    std::uint8_t run = IceFunCommands::RELEASE_FPGA;
+
+    if (dev->write(&run, sizeof(run)) == sizeof(run)) {
+        run = 0;
+        dev->read(&run, sizeof(run));
+    }
+
+    return run;
+}
+
+// Composes the header of a command frame addressing the flash
+void fill_frame_header(
+    std::uint8_t* frame,
+    IceFunCommands cmd,
+    std::uint32_t addr) {
+    frame[0] = cmd;
+    frame[1] = (addr >> 16);
+    frame[2] = (addr >> 8);
+    frame[3] = addr;
+}
+
+// Composes the header of a PROG_PAGE or VERIFY_PAGE frame for the given page
+// of the image and returns the page to send as the payload. The last page is
+// copied after the header and padded with 0xff when it is not a full one.
+const std::uint8_t* fill_page_frame(
+    std::uint8_t* frame,
+    IceFunCommands cmd,
+    std::uint32_t addr,
+    const std::uint8_t* data,
+    std::uint32_t size,
+    std::size_t page_idx) {
+    const auto page_offset = page_idx * PAGE_SIZE_BYTES;
+    const auto page_size =
+        std::min(PAGE_SIZE_BYTES, (std::uint32_t)(size - page_offset));
+
+    fill_frame_header(frame, cmd, addr);
+    if (page_size == PAGE_SIZE_BYTES) {
+        return data + page_offset;
+    }
+
+    memcpy(frame + 4, data + page_offset, page_size);
+    memset(frame + 4 + page_size, 0xff, PAGE_SIZE_BYTES - page_size);
+    return nullptr;
+}
+
+// Composes a READ_PAGE frame
+void fill_read_frame(std::uint8_t* frame, std::uint32_t addr) {
+    fill_frame_header(frame, IceFunCommands::READ_PAGE, addr);
+}
+
+// Runs the exchanges like Transport::pipeline() does. When one of them fails
+// on the bus rather than being rejected by `check`, resyncs with the board
+// and goes on from it, up to MAX_RETRIES times in a row. Stopping early for
+// any reason resyncs as well, so that the replies still on their way are not
+// taken for those of the next commands. Returns the number of exchanges
+// completed.
+std::size_t Session::pipeline_with_retries(
+    const std::shared_ptr<Transport>& dev,
+    std::size_t count,
+    std::uint16_t header_size,
+    std::uint16_t payload_size,
+    std::uint16_t reply_size,
+    const Transport::FillFrame& fill,
+    const Transport::CheckReply& check,
+    std::size_t depth) {
+    std::size_t completed = 0;
+    std::uint32_t retries = 0;
+    while (completed < count) {
+        const auto first = completed;
+        auto rejected = false;
+        completed += dev->pipeline(
+            count - first,
+            header_size,
+            payload_size,
+            reply_size,
+            [&](std::size_t idx, std::uint8_t* frame) {
+                return fill(first + idx, frame);
+            },
+            [&](std::size_t idx, const std::uint8_t* reply) {
+                rejected = !check(first + idx, reply);
+                return !rejected;
+            },
+            depth);
+        if (completed == count) {
+            break;
+        }
+
+        retries = completed > first ? 1 : retries + 1;
+        if (rejected || stopping() || retries > MAX_RETRIES) {
+            if (!dev->resync()) {
+                log_error("The board does not answer");
+            }
+            break;
+        }
+
+        log_error(
+            "No reply to command %zu of %zu, resyncing with the board (retry %u of %u)",
+            completed + 1,
+            count,
+            retries,
+            MAX_RETRIES);
+        progress.retry();
+        if (!dev->resync()) {
+            log_error("The board does not answer");
+        }
+    }
+
+    return completed;
+}
+
+// Sends the batch of commands like Transport::transact() does, and sends it
+// again after resyncing with the board when the replies do not all come,
+// up to MAX_RETRIES times. The batch must be safe to repeat.
+bool Session::transact_with_retries(
+    const std::shared_ptr<Transport>& dev,
+    const std::uint8_t* frames,
+    std::size_t frames_size,
+    std::uint8_t* replies,
+    std::size_t replies_size) {
+    for (auto retries = 0u;; ++retries) {
+        if (dev->transact(frames, frames_size, replies, replies_size)
+            == replies_size) {
+            return true;
+        }
+        if (retries == MAX_RETRIES || stopping()) {
+            // Drop the replies that are late rather than missing
+            dev->resync();
+            return false;
+        }
+
+        log_error(
+            "Missing replies, resyncing with the board (retry %u of %u)",
+            retries + 1,
+            MAX_RETRIES);
+        progress.retry();
+        if (!dev->resync()) {
+            log_error("The board does not answer");
+        }
+    }
+}
+
+// Reads `page_count` pages starting at `addr` into `data` keeping up to
+// `queue_depth` READ_PAGE commands in flight, returns the number of pages read.
+// The probes only peek at the flash, and leave the progress alone.
+std::size_t Session::read_pages(
+    const std::shared_ptr<Transport>& dev,
+    std::uint32_t addr,
+    std::size_t page_count,
+    std::uint8_t* data,
+    std::size_t queue_depth,
+    bool probe) {
+    return pipeline_with_retries(
+        dev,
+        page_count,
+        COMMAND_HEADER_SIZE_BYTES,
+        0,
+        PAGE_SIZE_BYTES,
+        [&](std::size_t page_idx, std::uint8_t* frame) -> const std::uint8_t* {
+            fill_read_frame(frame, addr + page_idx * PAGE_SIZE_BYTES);
+            return nullptr;
+        },
+        [&](std::size_t page_idx, const std::uint8_t* page) {
+            memcpy(data + page_idx * PAGE_SIZE_BYTES, page, PAGE_SIZE_BYTES);
+            if (!probe) {
+                progress.advance(PAGE_SIZE_BYTES);
+            }
+            return true;
+        },
+        queue_depth);
+}
+
+// Reads `sample_count` random pages of the sector and checks that they hold
+// what the cache claims: the image where it covers the sector and the erased
+// state elsewhere. Catches boards reflashed by other tools.
+bool Session::sample_sector(
+    const std::shared_ptr<Transport>& dev,
+    std::uint32_t sector_idx,
+    const std::uint8_t* image,
+    std::uint32_t image_addr,
+    std::uint32_t image_size,
+    std::uint32_t sample_count) {
+    const auto sector_addr = sector_idx << SECTOR_SHIFT;
+    for (auto sample = 0u; sample < sample_count; ++sample) {
+        const std::uint32_t page_addr = sector_addr
+            + (_rng() % (SECTOR_SIZE_BYTES / PAGE_SIZE_BYTES)) * PAGE_SIZE_BYTES;
+
+        std::uint8_t expected[PAGE_SIZE_BYTES];
+        memset(expected, 0xff, sizeof(expected));
+        for (auto idx = 0u; idx < PAGE_SIZE_BYTES; ++idx) {
+            const auto addr = page_addr + idx;
+            if (addr >= image_addr && addr < image_addr + image_size) {
+                expected[idx] = image[addr - image_addr];
+            }
+        }
+
+        std::uint8_t page[PAGE_SIZE_BYTES];
+        if (read_pages(dev, page_addr, 1, page, 1, true) != 1
+            || !pages_equal(page, expected, PAGE_SIZE_BYTES)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// How the flash gets erased before programming: either with ERASE_CHIP or
+// with ERASE_64k for every listed sector
+struct ErasePlan {
+    bool chip {};
+    std::vector<std::uint32_t> sectors;
+    std::uint32_t estimate_msec {};
+};
+
+// Whether every page of the sector reads as erased. Reads the sector in small
+// batches so that sectors holding data are rejected after the first one.
+bool Session::sector_blank(
+    const std::shared_ptr<Transport>& dev,
+    std::uint32_t sector_idx,
+    std::size_t queue_depth) {
+    constexpr std::uint32_t BATCH_PAGES = 16;
+    std::uint8_t pages[BATCH_PAGES * PAGE_SIZE_BYTES];
+
+    for (auto page_idx = 0u; page_idx < SECTOR_SIZE_BYTES / PAGE_SIZE_BYTES;
+         page_idx += BATCH_PAGES) {
+        const auto addr = (sector_idx << SECTOR_SHIFT) + page_idx * PAGE_SIZE_BYTES;
+        if (read_pages(dev, addr, BATCH_PAGES, pages, queue_depth, true)
+                != BATCH_PAGES
+            || !page_blank(pages, sizeof(pages))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Picks the cheapest way to erase the sectors. Sectors that already read as
+// erased are dropped when `blank_check` is set, and ERASE_CHIP is used when
+// `chip_allowed` and erasing the sectors one by one is expected to be slower.
+ErasePlan Session::plan_erase(
+    const std::shared_ptr<Transport>& dev,
+    const std::vector<std::uint32_t>& sectors,
+    bool chip_allowed,
+    bool blank_check,
+    std::size_t queue_depth) {
+    TraceSpan span("plan_erase", "phase");
+
+    ErasePlan plan;
+
+    if (blank_check && !sectors.empty()) {
+        log_info(
+            "Checking %u sectors for being erased",
+            (std::uint32_t)sectors.size());
+        progress.begin(
+            "blank_check",
+            sectors.size() * SECTOR_SIZE_BYTES);
+        for (const auto sector_idx : sectors) {
+            if (!sector_blank(dev, sector_idx, queue_depth)) {
+                plan.sectors.push_back(sector_idx);
+            }
+            progress.advance(SECTOR_SIZE_BYTES);
+        }
+        progress.end();
+        log_info(
+            "%u sectors are already erased",
+            (std::uint32_t)(sectors.size() - plan.sectors.size()));
+    } else {
+        plan.sectors = sectors;
+    }
+
+    plan.estimate_msec = plan.sectors.size() * ERASE_64K_ESTIMATE_MSEC;
+    if (chip_allowed && plan.estimate_msec > ERASE_CHIP_ESTIMATE_MSEC) {
+        plan.chip = true;
+        plan.estimate_msec = ERASE_CHIP_ESTIMATE_MSEC;
+    }
+
+    return plan;
+}
+
+void Session::erase_board(
+    const std::shared_ptr<Transport>& dev,
+    const ErasePlan& plan) {
+    if (!plan.chip && plan.sectors.empty()) {
+        return;
+    }
+
+    TraceSpan span("erase", "phase", plan.chip ? 0 : plan.sectors.size());
+
+    const auto start = std::chrono::steady_clock::now();
+    progress.begin(
+        "erase",
+        plan.chip ? MAX_FLASH_SIZE_BYTES
+                  : plan.sectors.size() * SECTOR_SIZE_BYTES);
+
+    if (plan.chip) {
+        log_info("Erasing the chip");
+
+        std::uint8_t erase = IceFunCommands::ERASE_CHIP;
+        if (dev->write(&erase, sizeof(erase)) != sizeof(erase)) {
+            throw std::runtime_error("Error when erasing the chip");
+        }
+        if (dev->read(&erase, 1, ERASE_CHIP_TIMEOUT_MSEC) != 1) {
+            throw std::runtime_error(
+                "Error when getting status for the erased chip");
+        }
+    } else {
+        log_info(
+            "Erasing %d 64k sectors starting at sector %d",
+            (std::uint32_t)plan.sectors.size(),
+            plan.sectors.front());
+
+        // All the erase commands go in one batch, the device replies with
+        // a status byte per sector
+
+        std::vector<std::uint8_t> frames;
+        for (const auto sector_idx : plan.sectors) {
+            frames.push_back(IceFunCommands::ERASE_64k);
+            frames.push_back(sector_idx);
+        }
+
+        std::vector<std::uint8_t> status(plan.sectors.size());
+        if (!transact_with_retries(
+                dev,
+                frames.data(),
+                frames.size(),
+                status.data(),
+                status.size())) {
+            throw std::runtime_error(
+                "Error when getting status for the erased sectors");
+        }
+    }
+    progress.complete();
+    progress.end();
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+    log_info(
+        "Erase time estimated: %u ms, measured: %u ms",
+        plan.estimate_msec,
+        (std::uint32_t)elapsed.count());
+}
+
+void Session::cycle_board(const std::shared_ptr<Transport>& dev) {
+    TraceSpan span("cycle_board", "board");
+
+    log_info("Cycling the board...");
+
+    const auto board_version = get_board_version(dev);
+    log_info("Board version: %d", board_version);
+
+    const auto flash_id = reset_board(dev);
+    log_info("Reset, flash ID: %#06x", flash_id);
+
+    const auto run = run_board(dev);
+    log_info("Run: %#02x", run);
+}
+
+// The pages written to the flash, in the order they were written
+struct WrittenPages {
+    std::size_t count {};
+    // Composes the PROG_PAGE or VERIFY_PAGE frame of the page like a
+    // Transport::FillFrame does
+    std::function<
+        const std::uint8_t*(IceFunCommands cmd, std::size_t idx, std::uint8_t* frame)>
+        frame;
+    // Flash address of the page
+    std::function<std::uint32_t(std::size_t idx)> addr;
+    // Bytes of the image the page holds, less than a page for the last one
+    std::function<std::uint32_t(std::size_t idx)> image_bytes;
+
+    // Bytes of the image held by the first `pages` pages
+    std::uint32_t bytes(std::size_t pages) const {
+        std::uint32_t total = 0;
+        for (auto idx = 0u; idx < pages; ++idx) {
+            total += image_bytes(idx);
+        }
+        return total;
+    }
+
+    Transport::FillFrame fill(IceFunCommands cmd) const {
+        return [this, cmd](std::size_t idx, std::uint8_t* frame) {
+            return this->frame(cmd, idx, frame);
+        };
+    }
+
+    // The pages at the given indices, both this and the indices must
+    // outlive the result
+    WrittenPages select(const std::vector<std::size_t>& indices) const {
+        WrittenPages selected;
+        selected.count = indices.size();
+        selected.frame = [this, &indices](
+                             IceFunCommands cmd,
+                             std::size_t idx,
+                             std::uint8_t* frame) {
+            return this->frame(cmd, indices[idx], frame);
+        };
+        selected.addr = [this, &indices](std::size_t idx) {
+            return addr(indices[idx]);
+        };
+        selected.image_bytes = [this, &indices](std::size_t idx) {
+            return image_bytes(indices[idx]);
+        };
+        return selected;
+    }
+};
+
+// Checks the status of a PROG_PAGE or VERIFY_PAGE exchange
+Transport::CheckReply
+Session::page_status(const WrittenPages& written, const char* what) {
+    return [this, &written, what](std::size_t idx, const std::uint8_t* status) {
+        if (status[0] != 0) {
+            log_error(
+                "Error when %s page at offset %#x, status: #%04x #%04x #%04x #%04x",
+                what,
+                written.addr(idx),
+                status[0],
+                status[1],
+                status[2],
+                status[3]);
+            return false;
+        }
+        progress.advance(written.image_bytes(idx));
+        return true;
+    };
+}
+
+// Programs the pages, returns the number of pages programmed. The pages the
+// board confirms are recorded in the journal when there is one.
+std::size_t Session::program_written(
+    const std::shared_ptr<Transport>& dev,
+    const WrittenPages& written,
+    std::size_t queue_depth,
+    Journal* journal) {
+    const auto status = page_status(written, "writing");
+    return pipeline_with_retries(
+        dev,
+        written.count,
+        COMMAND_HEADER_SIZE_BYTES,
+        PAGE_SIZE_BYTES,
+        STATUS_SIZE_BYTES,
+        written.fill(IceFunCommands::PROG_PAGE),
+        [&](std::size_t idx, const std::uint8_t* reply) {
+            if (!status(idx, reply)) {
+                return false;
+            }
+            if (journal) {
+                journal->confirm_page(written.addr(idx) / PAGE_SIZE_BYTES);
+            }
+            return true;
+        },
+        queue_depth);
+}
+
+// Verifies the pages of the image at `path` the way --verify asks, returns
+// whether the flash holds them. Hashing reads back the `size` bytes at
+// `offset` instead and compares them with `image_digest`.
+bool Session::verify_written(
+    const std::shared_ptr<Transport>& dev,
+    const ProgrammerOptions& params,
+    const std::string& path,
+    const WrittenPages& written,
+    std::uint32_t offset,
+    std::uint32_t size,
+    const Sha256::Digest& image_digest) {
+    const auto queue_depth = params.queue_depth.value_or(DEFAULT_QUEUE_DEPTH);
+    const auto page_count = (size + PAGE_SIZE_BYTES - 1) / PAGE_SIZE_BYTES;
+
+    auto complete = true;
+
+    const auto verify_start = std::chrono::steady_clock::now();
+    TraceSpan verify_span("verify", "phase");
+
+    switch (params.verify) {
+        case VerifyMode::DEVICE: {
+            log_info(
+                "Verifying %d bytes starting at offset %d from '%s' to the flash",
+                written.bytes(written.count),
+                offset,
+                path.c_str());
+
+            progress.begin("verify", written.bytes(written.count));
+            const auto pages = pipeline_with_retries(
+                dev,
+                written.count,
+                COMMAND_HEADER_SIZE_BYTES,
+                PAGE_SIZE_BYTES,
+                STATUS_SIZE_BYTES,
+                written.fill(IceFunCommands::VERIFY_PAGE),
+                page_status(written, "verifying"),
+                queue_depth);
+            if (pages != written.count) {
+                complete = false;
+                log_error(
+                    "Verification stopped at page offset %#x",
+                    written.addr(pages));
+            }
+
+            progress.end();
+            log_info("Verified %u bytes", written.bytes(pages));
+            break;
+        }
+
+        case VerifyMode::READBACK: {
+            log_info(
+                "Reading back %d bytes starting at offset %d to compare with '%s'",
+                written.bytes(written.count),
+                offset,
+                path.c_str());
+
+            progress.begin("verify", written.bytes(written.count));
+            const auto pages = pipeline_with_retries(
+                dev,
+                written.count,
+                COMMAND_HEADER_SIZE_BYTES,
+                0,
+                PAGE_SIZE_BYTES,
+                [&](std::size_t idx, std::uint8_t* frame) -> const std::uint8_t* {
+                    fill_read_frame(frame, written.addr(idx));
+                    return nullptr;
+                },
+                [&](std::size_t idx, const std::uint8_t* page) {
+                    std::uint8_t frame[COMMAND_HEADER_SIZE_BYTES + PAGE_SIZE_BYTES];
+                    auto expected =
+                        written.frame(IceFunCommands::VERIFY_PAGE, idx, frame);
+                    if (!expected) {
+                        expected = frame + COMMAND_HEADER_SIZE_BYTES;
+                    }
+
+                    const auto mismatch =
+                        first_mismatch(page, expected, PAGE_SIZE_BYTES);
+                    if (mismatch != PAGE_SIZE_BYTES) {
+                        log_error(
+                            "Mismatch at offset %#x: read %#04x, expected %#04x",
+                            (std::uint32_t)(written.addr(idx) + mismatch),
+                            page[mismatch],
+                            expected[mismatch]);
+                        return false;
+                    }
+                    progress.advance(written.image_bytes(idx));
+                    return true;
+                },
+                queue_depth);
+            if (pages != written.count) {
+                complete = false;
+            }
+
+            progress.end();
+            log_info("Verified %u bytes", written.bytes(pages));
+            break;
+        }
+
+        case VerifyMode::HASH: {
+            log_info(
+                "Reading back %d bytes starting at offset %d to hash",
+                size,
+                offset);
+
+            Sha256 flash_sha;
+            std::uint32_t hashed = 0;
+            progress.begin("verify", size);
+            const auto pages = pipeline_with_retries(
+                dev,
+                page_count,
+                COMMAND_HEADER_SIZE_BYTES,
+                0,
+                PAGE_SIZE_BYTES,
+                [&](std::size_t page_idx,
+                    std::uint8_t* frame) -> const std::uint8_t* {
+                    fill_read_frame(frame, offset + page_idx * PAGE_SIZE_BYTES);
+                    return nullptr;
+                },
+                [&](std::size_t, const std::uint8_t* page) {
+                    const auto to_hash = std::min(PAGE_SIZE_BYTES, size - hashed);
+                    flash_sha.update(page, to_hash);
+                    hashed += to_hash;
+                    progress.advance(to_hash);
+                    return true;
+                },
+                queue_depth);
+            progress.end();
+
+            if (pages != page_count) {
+                complete = false;
+                log_error(
+                    "Reading back stopped at page offset %#x",
+                    offset + (std::uint32_t)pages * PAGE_SIZE_BYTES);
+                break;
+            }
+
+            const auto flash_digest = flash_sha.finish();
+            log_info(
+                "SHA-256 of the flash: %s",
+                Sha256::to_string(flash_digest).c_str());
+            if (flash_digest != image_digest) {
+                complete = false;
+                log_error(
+                    "SHA-256 of '%s' differs: %s",
+                    path.c_str(),
+                    Sha256::to_string(image_digest).c_str());
+            }
+            break;
+        }
+
+        case VerifyMode::NONE:
+            break;
+    }
+    verify_span.end();
+
+    if (params.verify != VerifyMode::NONE) {
+        const auto elapsed =
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - verify_start);
+        log_info(
+            "Verification (%s) took %u ms",
+            verify_mode_name(params.verify),
+            (std::uint32_t)elapsed.count());
+    }
+
+    return complete;
+}
+
+// Parses the image when it is an iCE40 bitstream, and returns the size to
+// write: up to the end of its configuration data, rounded up to a page, when
+// only the 0x00 and 0xff padding follows it. Refuses the damaged bitstreams.
+// With --raw, the image is taken as it is.
+std::uint32_t Session::trim_bitstream(
+    const ProgrammerOptions& params,
+    const std::string& path,
+    std::uint32_t offset,
+    const std::uint8_t* image,
+    std::uint32_t size) {
+    if (params.raw || !size) {
+        return size;
+    }
+    if (!Bitstream::is_bitstream(image, size)) {
+        if (!offset) {
+            log_info(
+                "'%s' does not look like an iCE40 bitstream, writing it as it is",
+                path.c_str());
+        }
+        return size;
+    }
+
+    TraceSpan span("parse_bitstream", "io");
+
+    BitstreamInfo info;
+    try {
+        info = Bitstream::parse(image, size);
+    } catch (const std::runtime_error& e) {
+        throw std::runtime_error(
+            std::string(e.what()) + ", use --raw to write the file anyway");
+    }
+
+    if (info.reboot) {
+        log_info(
+            "'%s' is an iCE40 multi-image header, it ends at %u",
+            path.c_str(),
+            info.end);
+        return size;
+    }
+
+    log_info(
+        "'%s' is an iCE40 bitstream: %u CRAM and %u BRAM banks, %u CRC checks passed, configuration data ends at %u",
+        path.c_str(),
+        info.cram_banks,
+        info.bram_banks,
+        info.crc_checks,
+        info.end);
+
+    // Whatever else the file holds after the bitstream gets written
+    const auto padding = std::all_of(
+        image + std::min(info.end, size),
+        image + size,
+        [](std::uint8_t byte) { return byte == 0x00 || byte == 0xff; });
+    if (!padding) {
+        log_info(
+            "'%s' holds more than padding after the configuration data, writing it as it is",
+            path.c_str());
+        return size;
+    }
+
+    const auto trimmed = std::min(
+        size,
+        (info.end + PAGE_SIZE_BYTES - 1) / PAGE_SIZE_BYTES * PAGE_SIZE_BYTES);
+    if (trimmed < size) {
+        log_info(
+            "Skipping %u bytes of padding after the configuration data",
+            size - trimmed);
+    }
+    return trimmed;
+}
+
+// Opens the journal of the write or read at `params.path`, unless the options
+// turn it off. Without --resume, failing to create it only costs the chance
+// to resume.
+std::unique_ptr<Journal> Session::open_journal(
+    const std::shared_ptr<Transport>& dev,
+    const ProgrammerOptions& params,
+    Journal::Operation operation,
+    std::uint32_t flash_id,
+    std::uint32_t offset,
+    std::uint32_t size,
+    const Sha256::Digest& digest) {
+    if (!params.journal) {
+        if (params.resume) {
+            throw std::runtime_error("--resume works with one board at a time");
+        }
+        return {};
+    }
+
+    const auto path = params.path + ".journal";
+    if (!params.resume) {
+        try {
+            return std::make_unique<Journal>(
+                path,
+                operation,
+                dev->serial(),
+                flash_id,
+                offset,
+                size,
+                digest,
+                false);
+        } catch (const std::runtime_error& e) {
+            log_error("%s, going on without a journal", e.what());
+            return {};
+        }
+    }
+
+    auto journal = std::make_unique<Journal>(
+        path,
+        operation,
+        dev->serial(),
+        flash_id,
+        offset,
+        size,
+        digest,
+        true);
+    if (journal->resumed()) {
+        log_info(
+            "Resuming from '%s': %u sectors erased, %u pages confirmed",
+            path.c_str(),
+            journal->erased_sectors(),
+            journal->confirmed_pages());
+    } else {
+        log_info(
+            "Nothing to resume in '%s', starting over",
+            path.c_str());
+    }
+    return journal;
+}
+
+// Tells the round trips saved by skipping the blank pages: their PROG_PAGE,
+// and their VERIFY_PAGE when the board verifies the pages one by one
+void Session::log_blank_pages(
+    const ProgrammerOptions& params,
+    std::uint32_t blank_pages) {
+    if (!blank_pages) {
+        return;
+    }
+
+    const auto per_page = params.verify == VerifyMode::DEVICE ? 2u : 1u;
+    log_info(
+        "Skipping %u blank pages, saving %u USB round trips",
+        blank_pages,
+        per_page * blank_pages);
+}
+
+// Writes the image to the board, returns whether all the pages were
+// written and verified. The erased sectors and the programmed pages go to the
+// journal, and with --resume the ones it holds are not erased nor programmed
+// again.
+bool Session::write_board(
+    const std::shared_ptr<Transport>& dev,
+    const ProgrammerOptions& params,
+    std::span<const std::uint8_t> contents) {
+    TraceSpan span("write_board", "board");
+
+    const std::uint32_t offset = params.offset.value_or(0);
+    const auto& path = params.path;
+    const auto queue_depth = params.queue_depth.value_or(DEFAULT_QUEUE_DEPTH);
+    const auto diff = params.diff;
+    const auto cache_sample = params.cache_sample.value_or(0);
+    if (offset > MAX_FLASH_SIZE_BYTES) {
+        throw std::runtime_error("The offset is too large");
+    }
+
+    std::uint32_t size = params.size.value_or(contents.size());
+    if (offset + size > MAX_FLASH_SIZE_BYTES) {
+        throw std::runtime_error("Cannot fit the data into the flash");
+    }
+    if (size > contents.size()) {
+        size = contents.size();
+        log_info(
+            "The file is shorter than the requested size, writing %u bytes",
+            size);
+    }
+    size = trim_bitstream(params, path, offset, contents.data(), size);
+
+    const auto board_version = get_board_version(dev);
+    log_info("Board version: %d", board_version);
+
+    const auto flash_id = reset_board(dev);
+    log_info("Reset, flash ID: %#06x", flash_id);
+
+    std::unique_ptr<FlashCache> cache;
+    if (!params.cache_path.empty()) {
+        cache = std::make_unique<FlashCache>(
+            params.cache_path,
+            dev->serial(),
+            flash_id);
+    }
+
+    const auto page_count = (size + PAGE_SIZE_BYTES - 1) / PAGE_SIZE_BYTES;
+    const auto image = contents.data();
+    const auto image_digest = Sha256::hash(image, size);
+
+    auto journal = open_journal(
+        dev,
+        params,
+        Journal::Operation::WRITE,
+        flash_id,
+        offset,
+        size,
+        image_digest);
+
+    // Sectors to erase and pages of the image to program. Without --diff,
+    // every covered sector is erased and every page is programmed.
+
+    std::vector<std::uint32_t> erase_sectors;
+    std::vector<std::uint32_t> program_pages;
+
+    // Contents of the tail of the last page, used to pad it when it is
+    // programmed over the previous contents of the flash
+    std::unique_ptr<std::uint8_t[]> tail;
+
+    // Erased flash reads as 0xff, so the pages of erased sectors that are
+    // blank in the image need neither programming nor verifying
+    std::uint32_t blank_pages = 0;
+    const auto add_erased_page = [&](std::uint32_t page_idx) {
+        const auto page_offset = page_idx * PAGE_SIZE_BYTES;
+        if (page_blank(
+                image + page_offset,
+                std::min(PAGE_SIZE_BYTES, size - page_offset))) {
+            ++blank_pages;
+        } else {
+            program_pages.push_back(page_idx);
+        }
+    };
+
+    const auto covered_sectors = size
+        ? ((offset + size - 1) >> SECTOR_SHIFT) - (offset >> SECTOR_SHIFT) + 1
+        : 0;
+
+    // Digests of the sectors whose contents will be fully known once the
+    // pages are programmed and verified
+    std::vector<std::pair<std::uint32_t, Sha256::Digest>> known_sectors;
+
+    if (diff || cache) {
+        TraceSpan plan_span("plan", "phase");
+        progress.begin("plan", diff ? page_count * PAGE_SIZE_BYTES : 0);
+
+        if (offset % PAGE_SIZE_BYTES) {
+            throw std::runtime_error(
+                "The offset must be page-aligned when writing differences or using the cache");
+        }
+
+        std::unique_ptr<std::uint8_t[]> flash;
+        if (diff) {
+            flash = std::make_unique<std::uint8_t[]>(
+                page_count * PAGE_SIZE_BYTES);
+            log_info(
+                "Reading back up to %d bytes starting at offset %d",
+                page_count * PAGE_SIZE_BYTES,
+                offset);
+        }
+
+        std::uint32_t cached_sectors = 0;
+        std::uint32_t skipped_sectors = 0;
+        std::uint32_t programmed_sectors = 0;
+        std::uint32_t skipped_pages = 0;
+
+        auto page_idx = 0u;
+        while (page_idx < page_count) {
+            const auto sector_idx =
+                (offset + page_idx * PAGE_SIZE_BYTES) >> SECTOR_SHIFT;
+            const auto first_page = page_idx;
+            while (page_idx < page_count
+                   && (offset + page_idx * PAGE_SIZE_BYTES) >> SECTOR_SHIFT
+                       == sector_idx) {
+                ++page_idx;
+            }
+
+            const auto sector_offset = first_page * PAGE_SIZE_BYTES;
+            const auto sector_size =
+                std::min(size, page_idx * PAGE_SIZE_BYTES) - sector_offset;
+            const auto covers_sector = sector_size == SECTOR_SIZE_BYTES;
+
+            // What the sector holds after erasing and programming
+            Sha256::Digest erased_digest {};
+            if (cache) {
+                const auto sector_addr = sector_idx << SECTOR_SHIFT;
+                const auto image_addr = offset + sector_offset;
+                Sha256 sha;
+                sha.update_fill(0xff, image_addr - sector_addr);
+                sha.update(image + sector_offset, sector_size);
+                sha.update_fill(
+                    0xff,
+                    sector_addr + SECTOR_SIZE_BYTES - image_addr
+                        - sector_size);
+                erased_digest = sha.finish();
+
+                if (cache->contains(sector_idx, erased_digest)
+                    && sample_sector(
+                        dev,
+                        sector_idx,
+                        image + sector_offset,
+                        image_addr,
+                        sector_size,
+                        cache_sample)) {
+                    ++cached_sectors;
+                    skipped_pages += page_idx - first_page;
+                    continue;
+                }
+                cache->invalidate(sector_idx);
+            }
+
+            if (!diff) {
+                erase_sectors.push_back(sector_idx);
+                for (auto idx = first_page; idx < page_idx; ++idx) {
+                    add_erased_page(idx);
+                }
+                if (cache) {
+                    known_sectors.emplace_back(sector_idx, erased_digest);
+                }
+                continue;
+            }
+
+            if (read_pages(
+                    dev,
+                    offset + sector_offset,
+                    page_idx - first_page,
+                    flash.get() + sector_offset,
+                    queue_depth)
+                != page_idx - first_page) {
+                throw std::runtime_error("Error when reading back the flash");
+            }
+
+            const auto* prev = flash.get() + sector_offset;
+            const auto* next = image + sector_offset;
+
+            if (pages_equal(prev, next, sector_size)) {
+                ++skipped_sectors;
+                skipped_pages += page_idx - first_page;
+                if (cache && covers_sector) {
+                    known_sectors.emplace_back(sector_idx, erased_digest);
+                }
+                continue;
+            }
+
+            if (pages_programmable(prev, next, sector_size)) {
+                ++programmed_sectors;
+                for (auto idx = first_page; idx < page_idx; ++idx) {
+                    const auto page_offset = idx * PAGE_SIZE_BYTES;
+                    const auto page_size =
+                        std::min(PAGE_SIZE_BYTES, size - page_offset);
+                    if (!pages_equal(
+                            flash.get() + page_offset,
+                            image + page_offset,
+                            page_size)) {
+                        program_pages.push_back(idx);
+                    } else {
+                        ++skipped_pages;
+                    }
+                }
+                if (page_idx == page_count && size % PAGE_SIZE_BYTES) {
+                    tail = std::make_unique<std::uint8_t[]>(PAGE_SIZE_BYTES);
+                    memcpy(
+                        tail.get(),
+                        flash.get() + (page_count - 1) * PAGE_SIZE_BYTES,
+                        PAGE_SIZE_BYTES);
+                }
+                if (cache && covers_sector) {
+                    known_sectors.emplace_back(sector_idx, erased_digest);
+                }
+                continue;
+            }
+
+            erase_sectors.push_back(sector_idx);
+            for (auto idx = first_page; idx < page_idx; ++idx) {
+                add_erased_page(idx);
+            }
+            if (cache) {
+                known_sectors.emplace_back(sector_idx, erased_digest);
+            }
+        }
+        progress.end();
+
+        if (cache) {
+            cache->flush();
+            log_info(
+                "Skipping %u sectors with cached contents",
+                cached_sectors);
+        }
+        log_info(
+            "Skipping %u unchanged bytes in %u pages: %u sectors unchanged, %u sectors programmed without erasing, %u sectors to erase",
+            std::min(size, skipped_pages * PAGE_SIZE_BYTES),
+            skipped_pages,
+            cached_sectors + skipped_sectors,
+            programmed_sectors,
+            (std::uint32_t)erase_sectors.size());
+    } else if (size) {
+        const auto start_sector = (offset >> SECTOR_SHIFT);
+        const auto end_sector = ((offset + size - 1) >> SECTOR_SHIFT) + 1;
+
+        for (auto sector_idx = start_sector; sector_idx < end_sector;
+             ++sector_idx) {
+            erase_sectors.push_back(sector_idx);
+        }
+        for (auto page_idx = 0u; page_idx < page_count; ++page_idx) {
+            add_erased_page(page_idx);
+        }
+    }
+
+    log_blank_pages(params, blank_pages);
+
+    if (journal && journal->resumed()) {
+        const auto erased = std::remove_if(
+            erase_sectors.begin(),
+            erase_sectors.end(),
+            [&](std::uint32_t sector_idx) {
+                return journal->sector_erased(sector_idx);
+            });
+        log_info(
+            "Skipping %u sectors erased before",
+            (std::uint32_t)(erase_sectors.end() - erased));
+        erase_sectors.erase(erased, erase_sectors.end());
+    }
+
+    const auto plan = plan_erase(
+        dev,
+        erase_sectors,
+        params.chip_erase && !diff && erase_sectors.size() == covered_sectors,
+        params.blank_check,
+        queue_depth);
+    erase_board(dev, plan);
+    if (journal) {
+        for (const auto sector_idx : erase_sectors) {
+            journal->mark_erased(sector_idx);
+        }
+        journal->flush();
+    }
+
+    // Erasing the chip leaves the sectors outside the image blank
+    if (cache && plan.chip) {
+        Sha256 sha;
+        sha.update_fill(0xff, SECTOR_SIZE_BYTES);
+        const auto blank_digest = sha.finish();
+        for (auto sector_idx = 0u; sector_idx < FlashCache::SECTOR_COUNT;
+             ++sector_idx) {
+            if (std::find(
+                    erase_sectors.begin(),
+                    erase_sectors.end(),
+                    sector_idx)
+                == erase_sectors.end()) {
+                known_sectors.emplace_back(sector_idx, blank_digest);
+            }
+        }
+    }
+
+    WrittenPages written;
+    written.count = program_pages.size();
+    written.frame = [&](IceFunCommands cmd, std::size_t idx, std::uint8_t* frame) {
+        const auto page_idx = program_pages[idx];
+        const auto payload = fill_page_frame(
+            frame,
+            cmd,
+            offset + page_idx * PAGE_SIZE_BYTES,
+            image,
+            size,
+            page_idx);
+        if (tail && page_idx == page_count - 1) {
+            const auto page_size = size - page_idx * PAGE_SIZE_BYTES;
+            memcpy(
+                frame + 4 + page_size,
+                tail.get() + page_size,
+                PAGE_SIZE_BYTES - page_size);
+        }
+        return payload;
+    };
+    written.addr = [&](std::size_t idx) {
+        return offset + program_pages[idx] * PAGE_SIZE_BYTES;
+    };
+    written.image_bytes = [&](std::size_t idx) {
+        return std::min(
+            PAGE_SIZE_BYTES,
+            size - program_pages[idx] * PAGE_SIZE_BYTES);
+    };
+
+    // The pages confirmed before are verified along with the others, but
+    // not programmed again
+    std::vector<std::size_t> unconfirmed;
+    for (auto idx = 0u; idx < written.count; ++idx) {
+        if (!journal
+            || !journal->page_confirmed(written.addr(idx) / PAGE_SIZE_BYTES)) {
+            unconfirmed.push_back(idx);
+        }
+    }
+    const auto to_program = written.select(unconfirmed);
+
+    auto complete = true;
+
+    {
+        TraceSpan program_span("program", "phase", to_program.count);
+
+        if (to_program.count < written.count) {
+            log_info(
+                "Skipping %u pages programmed before",
+                (std::uint32_t)(written.count - to_program.count));
+        }
+        log_info(
+            "Writing %d bytes starting at offset %d from '%s' to the flash",
+            to_program.bytes(to_program.count),
+            offset,
+            path.c_str());
+
+        progress.begin("program", to_program.bytes(to_program.count));
+        const auto pages =
+            program_written(dev, to_program, queue_depth, journal.get());
+        if (journal) {
+            journal->flush();
+        }
+        if (pages != to_program.count) {
+            complete = false;
+            log_error(
+                "Writing stopped at page offset %#x",
+                to_program.addr(pages));
+        }
+
+        progress.end();
+        log_info("Wrote %u bytes", to_program.bytes(pages));
+    }
+
+    complete &= verify_written(
+        dev,
+        params,
+        path,
+        written,
+        offset,
+        size,
+        image_digest);
+
+    if (journal && complete) {
+        journal->remove();
+    } else if (journal) {
+        log_error(
+            "Run again with --resume to go on from where the write stopped");
+    }
+
+    if (cache && complete) {
+        for (const auto& [sector_idx, digest] : known_sectors) {
+            cache->update(sector_idx, digest);
+        }
+        cache->flush();
+    }
+
+    const auto run = run_board(dev);
+    log_info("Run: %#02x", run);
+
+    return complete;
+}
+
+// Writes the compressed image to the board as it gets decompressed: every
+// sector is erased and programmed once the decompressing thread hands it
+// over, while the next ones are being decompressed. The blank pages are
+// neither kept nor programmed. Returns whether all the pages were written
+// and verified.
+bool Session::write_board_stream(
+    const std::shared_ptr<Transport>& dev,
+    const ProgrammerOptions& params,
+    std::span<const std::uint8_t> contents,
+    Compression compression) {
+    TraceSpan span("write_board", "board");
+
+    const std::uint32_t offset = params.offset.value_or(0);
+    const auto& path = params.path;
+    const auto queue_depth = params.queue_depth.value_or(DEFAULT_QUEUE_DEPTH);
+    if (offset > MAX_FLASH_SIZE_BYTES) {
+        throw std::runtime_error("The offset is too large");
+    }
+    if (offset % PAGE_SIZE_BYTES) {
+        throw std::runtime_error(
+            "The offset must be page-aligned when writing a compressed image");
+    }
+    if (params.diff || !params.cache_path.empty()) {
+        throw std::runtime_error(
+            "Writing differences or using the cache needs an uncompressed image");
+    }
+
+    const auto board_version = get_board_version(dev);
+    log_info("Board version: %d", board_version);
+
+    const auto flash_id = reset_board(dev);
+    log_info("Reset, flash ID: %#06x", flash_id);
+
+    // The extent of the image is not known up front, so the chip is erased
+    // only when asked to, and the sectors are erased one by one otherwise
+    if (params.chip_erase) {
+        ErasePlan plan;
+        plan.chip = true;
+        plan.estimate_msec = ERASE_CHIP_ESTIMATE_MSEC;
+        erase_board(dev, plan);
+    }
+    if (params.blank_check) {
+        log_info("Not checking the sectors of a compressed image for being erased");
+    }
+
+    SectorStream stream(
+        compression,
+        contents.data(),
+        contents.size(),
+        offset,
+        MAX_FLASH_SIZE_BYTES - offset,
+        params.size.value_or(MAX_FLASH_SIZE_BYTES));
+
+    log_info(
+        "Writing %s image '%s' starting at offset %d to the flash",
+        compression_name(compression),
+        path.c_str(),
+        offset);
+
+    const auto sector_written = [offset](const ImageSector& sector) {
+        WrittenPages written;
+        written.count = sector.pages.size();
+        written.frame = [&sector, offset](
+                            IceFunCommands cmd,
+                            std::size_t idx,
+                            std::uint8_t* frame) {
+            fill_frame_header(
+                frame,
+                cmd,
+                offset + sector.pages[idx] * PAGE_SIZE_BYTES);
+            return sector.data.data() + idx * PAGE_SIZE_BYTES;
+        };
+        written.addr = [&sector, offset](std::size_t idx) {
+            return offset + sector.pages[idx] * PAGE_SIZE_BYTES;
+        };
+        written.image_bytes = [&sector](std::size_t idx) {
+            return std::min(
+                PAGE_SIZE_BYTES,
+                sector.image_size - sector.pages[idx] * PAGE_SIZE_BYTES);
+        };
+        return written;
+    };
+
+    // Kept for verifying, blank pages are not there
+    std::vector<ImageSector> sectors;
+    std::uint32_t written_bytes = 0;
+    std::uint32_t blank_pages = 0;
+    auto complete = true;
+
+    {
+        TraceSpan program_span("program", "phase");
+        progress.begin("program");
+
+        ImageSector sector;
+        while (complete && stream.next(sector)) {
+            if (!params.chip_erase) {
+                TraceSpan erase_span("erase", "phase", 1);
+                const std::uint8_t erase[] = {
+                    IceFunCommands::ERASE_64k,
+                    (std::uint8_t)sector.sector_idx};
+                std::uint8_t status = 0;
+                if (!transact_with_retries(
+                        dev,
+                        erase,
+                        sizeof(erase),
+                        &status,
+                        1)) {
+                    throw std::runtime_error(
+                        "Error when getting status for the erased sector");
+                }
+            }
+
+            const auto written = sector_written(sector);
+            const auto pages = program_written(dev, written, queue_depth);
+            written_bytes += written.bytes(pages);
+            blank_pages += sector.blank_pages;
+            if (pages != written.count) {
+                complete = false;
+                log_error(
+                    "Writing stopped at page offset %#x",
+                    written.addr(pages));
+            }
+            sectors.push_back(std::move(sector));
+        }
+
+        progress.end();
+        log_info(
+            "Wrote %u bytes, %u sectors erased, skipped %u blank pages",
+            written_bytes,
+            params.chip_erase ? 0 : (std::uint32_t)sectors.size(),
+            blank_pages);
+    }
+
+    if (complete) {
+        const auto size = stream.size();
+
+        std::vector<std::uint32_t> pages;
+        std::vector<const std::uint8_t*> payloads;
+        for (const auto& sector : sectors) {
+            for (std::size_t idx = 0; idx < sector.pages.size(); ++idx) {
+                pages.push_back(sector.pages[idx]);
+                payloads.push_back(sector.data.data() + idx * PAGE_SIZE_BYTES);
+            }
+        }
+
+        WrittenPages written;
+        written.count = pages.size();
+        written.frame = [&](IceFunCommands cmd, std::size_t idx, std::uint8_t* frame) {
+            fill_frame_header(frame, cmd, offset + pages[idx] * PAGE_SIZE_BYTES);
+            return payloads[idx];
+        };
+        written.addr = [&](std::size_t idx) {
+            return offset + pages[idx] * PAGE_SIZE_BYTES;
+        };
+        written.image_bytes = [&](std::size_t idx) {
+            return std::min(PAGE_SIZE_BYTES, size - pages[idx] * PAGE_SIZE_BYTES);
+        };
+
+        complete = verify_written(
+            dev,
+            params,
+            path,
+            written,
+            offset,
+            size,
+            stream.digest());
+    }
+
+    const auto run = run_board(dev);
+    log_info("Run: %#02x", run);
+
+    return complete;
+}
+
+// A piece of the image to write, at its offset in the flash
+struct Segment {
+    std::string path;
+    std::uint32_t offset {};
+    const std::uint8_t* data {};
+    std::uint32_t size {};
+};
+
+// The pieces of the image to write, with the files and buffers holding them
+struct SegmentedImage {
+    std::vector<Segment> segments;
+    std::vector<std::unique_ptr<MappedFile>> files;
+    std::deque<std::vector<std::uint8_t>> buffers;
+    std::deque<SparseImage> sparse;
+};
+
+// Adds the file to the image at the offset: a raw image, maybe compressed,
+// goes there whole, trimmed when it is a bitstream; the extents of a sparse
+// image are placed relative to the offset. `contents` are those of the file
+// when they are at hand already.
+void Session::add_image_file(
+    SegmentedImage& image,
+    const ProgrammerOptions& params,
+    const std::string& path,
+    std::uint32_t offset,
+    std::span<const std::uint8_t> contents) {
+    if (!contents.data()) {
+        const auto& file = image.files.emplace_back(
+            std::make_unique<MappedFile>(path, false));
+        contents = {file->data(), file->size()};
+    }
+
+    const auto max_size = MAX_FLASH_SIZE_BYTES - offset;
+    const std::uint8_t* data = contents.data();
+    std::size_t size = contents.size();
+
+    const auto compression = detect_compression(data, size);
+    if (compression != Compression::NONE) {
+        image.buffers.push_back(decompress(compression, data, size, max_size));
+        data = image.buffers.back().data();
+        size = image.buffers.back().size();
+    }
+
+    const auto format = detect_image_format(data, size);
+    if (format == ImageFormat::RAW) {
+        if (size > max_size) {
+            throw std::runtime_error("Cannot fit '" + path + "' into the flash");
+        }
+        image.segments.push_back(
+            {path,
+             offset,
+             data,
+             trim_bitstream(params, path, offset, data, size)});
+        return;
+    }
+
+    const auto& sparse =
+        image.sparse.emplace_back(SparseImage::parse(format, data, size));
+    std::uint32_t extent_bytes = 0;
+    for (const auto& extent : sparse.extents) {
+        if (extent.addr + extent.size > max_size) {
+            throw std::runtime_error(
+                "An extent of '" + path + "' lies past the end of the flash");
+        }
+        image.segments.push_back(
+            {path,
+             offset + (std::uint32_t)extent.addr,
+             extent.data,
+             extent.size});
+        extent_bytes += extent.size;
+    }
+    log_info(
+        "'%s': %s image, %u bytes in %u extents",
+        path.c_str(),
+        image_format_name(format),
+        extent_bytes,
+        (std::uint32_t)sparse.extents.size());
+}
+
+// Writes the segments in one session with the board: the sectors of all of
+// them are erased at once, and the pages they touch are programmed in one go
+// before the board is released to run. The flash between the segments is
+// neither read nor written, beyond erasing the sectors they share with the
+// segments. Returns whether all the pages were written and verified.
+bool Session::write_segments(
+    const std::shared_ptr<Transport>& dev,
+    const ProgrammerOptions& params,
+    std::vector<Segment> segments) {
+    const auto start = std::chrono::steady_clock::now();
+    const auto queue_depth = params.queue_depth.value_or(DEFAULT_QUEUE_DEPTH);
+
+    std::sort(segments.begin(), segments.end(), [](const auto& a, const auto& b) {
+        return a.offset < b.offset;
+    });
+    segments.erase(
+        std::remove_if(
+            segments.begin(),
+            segments.end(),
+            [](const auto& segment) { return segment.size == 0; }),
+        segments.end());
+    if (segments.empty()) {
+        throw std::runtime_error("Nothing to write");
+    }
+    for (std::size_t idx = 1; idx < segments.size(); ++idx) {
+        const auto& prev = segments[idx - 1];
+        if (prev.offset + prev.size > segments[idx].offset) {
+            throw std::runtime_error(
+                "'" + prev.path + "' overlaps '" + segments[idx].path + "'");
+        }
+    }
+
+    // The adjacent segments of a file, like the pages of a fill, are listed
+    // as one
+    for (std::size_t first = 0; first < segments.size();) {
+        auto last = first;
+        while (last + 1 < segments.size()
+               && segments[last + 1].path == segments[first].path
+               && segments[last + 1].offset
+                   == segments[last].offset + segments[last].size) {
+            ++last;
+        }
+        log_info(
+            "0x%06x-0x%06x %s",
+            segments[first].offset,
+            segments[last].offset + segments[last].size,
+            segments[first].path.c_str());
+        first = last + 1;
+    }
+
+    const auto board_version = get_board_version(dev);
+    log_info("Board version: %d", board_version);
+
+    const auto flash_id = reset_board(dev);
+    log_info("Reset, flash ID: %#06x", flash_id);
+
+    // The sectors and the pages touched by the segments. A page may take
+    // bytes of several segments, and is 0xff elsewhere. The blank pages
+    // read as such once erased.
+
+    struct Page {
+        std::uint32_t addr;
+        // The first segment in the page
+        std::uint32_t segment;
+        // The bytes of the segments in the page
+        std::uint32_t bytes;
+    };
+
+    std::vector<std::uint32_t> erase_sectors;
+    std::vector<Page> pages;
+    std::uint32_t blank_pages = 0;
+
+    const auto for_each_piece = [&](const Page& page, const auto& fn) {
+        for (auto seg_idx = page.segment; seg_idx < segments.size()
+             && segments[seg_idx].offset < page.addr + PAGE_SIZE_BYTES;
+             ++seg_idx) {
+            const auto& segment = segments[seg_idx];
+            const auto from = std::max(segment.offset, page.addr);
+            const auto to = std::min(
+                segment.offset + segment.size,
+                page.addr + PAGE_SIZE_BYTES);
+            if (from < to) {
+                fn(from - page.addr, segment.data + (from - segment.offset), to - from);
+            }
+        }
+    };
+
+    for (std::uint32_t seg_idx = 0; seg_idx < segments.size(); ++seg_idx) {
+        const auto& segment = segments[seg_idx];
+
+        const auto first_sector = segment.offset >> SECTOR_SHIFT;
+        const auto last_sector = (segment.offset + segment.size - 1) >> SECTOR_SHIFT;
+        for (auto sector_idx = first_sector; sector_idx <= last_sector; ++sector_idx) {
+            if (erase_sectors.empty() || erase_sectors.back() < sector_idx) {
+                erase_sectors.push_back(sector_idx);
+            }
+        }
+
+        auto addr = segment.offset & ~(PAGE_SIZE_BYTES - 1);
+        if (!pages.empty() && pages.back().addr == addr) {
+            // Shared with the previous segment
+            addr += PAGE_SIZE_BYTES;
+        }
+        for (; addr < segment.offset + segment.size; addr += PAGE_SIZE_BYTES) {
+            Page page {addr, seg_idx, 0};
+            auto blank = true;
+            for_each_piece(page, [&](std::uint32_t, const std::uint8_t* data, std::uint32_t size) {
+                page.bytes += size;
+                blank &= page_blank(data, size);
+            });
+            if (blank) {
+                ++blank_pages;
+            } else {
+                pages.push_back(page);
+            }
+        }
+    }
+
+    log_blank_pages(params, blank_pages);
+
+    erase_board(
+        dev,
+        plan_erase(
+            dev,
+            erase_sectors,
+            params.chip_erase,
+            params.blank_check,
+            queue_depth));
+
+    // The pages lying within a segment are sent from there, the others
+    // are composed in the frame
+    WrittenPages written;
+    written.count = pages.size();
+    written.frame = [&](IceFunCommands cmd, std::size_t idx, std::uint8_t* frame)
+        -> const std::uint8_t* {
+        const auto& page = pages[idx];
+        const auto& segment = segments[page.segment];
+        fill_frame_header(frame, cmd, page.addr);
+        if (page.addr >= segment.offset
+            && page.addr + PAGE_SIZE_BYTES <= segment.offset + segment.size) {
+            return segment.data + (page.addr - segment.offset);
+        }
+
+        auto* payload = frame + COMMAND_HEADER_SIZE_BYTES;
+        memset(payload, 0xff, PAGE_SIZE_BYTES);
+        for_each_piece(page, [&](std::uint32_t pos, const std::uint8_t* data, std::uint32_t size) {
+            memcpy(payload + pos, data, size);
+        });
+        return nullptr;
+    };
+    written.addr = [&](std::size_t idx) {
+        return pages[idx].addr;
+    };
+    written.image_bytes = [&](std::size_t idx) {
+        return pages[idx].bytes;
+    };
+
+    auto complete = true;
+
+    {
+        TraceSpan program_span("program", "phase", pages.size());
+
+        log_info(
+            "Writing %u bytes of %u segments to the flash",
+            written.bytes(written.count),
+            (std::uint32_t)segments.size());
+
+        progress.begin("program", written.bytes(written.count));
+        const auto programmed = program_written(dev, written, queue_depth);
+        if (programmed != written.count) {
+            complete = false;
+            log_error(
+                "Writing stopped at page offset %#x",
+                written.addr(programmed));
+        }
+
+        progress.end();
+        log_info("Wrote %u bytes", written.bytes(programmed));
+    }
+
+    if (params.verify == VerifyMode::HASH) {
+        // The segments are hashed one by one, the flash between them is
+        // not of the image
+        for (const auto& segment : segments) {
+            complete &= verify_written(
+                dev,
+                params,
+                segment.path,
+                WrittenPages {},
+                segment.offset,
+                segment.size,
+                Sha256::hash(segment.data, segment.size));
+        }
+    } else {
+        complete &=
+            verify_written(dev, params, params.path, written, 0, 0, {});
+    }
+
+    const auto run = run_board(dev);
+    log_info("Run: %#02x", run);
+
+    log_info(
+        "Wrote %u segments in %u ms",
+        (std::uint32_t)segments.size(),
+        (std::uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count());
+
+    return complete;
+}
+
+// Writes the images listed in the manifest in one session with the board,
+// see write_segments()
+bool Session::write_manifest(
+    const std::shared_ptr<Transport>& dev,
+    const ProgrammerOptions& params,
+    std::span<const std::uint8_t> contents) {
+    TraceSpan span("write_manifest", "board");
+
+    if (params.offset || params.size) {
+        throw std::runtime_error("-o and -s do not go with a manifest");
+    }
+    if (params.diff || !params.cache_path.empty()) {
+        throw std::runtime_error(
+            "Writing differences or using the cache does not go with a manifest");
+    }
+
+    const auto manifest = Manifest::parse(
+        reinterpret_cast<const char*>(contents.data()),
+        contents.size(),
+        params.path);
+
+    SegmentedImage image;
+    if (manifest.warmboot) {
+        const auto& header =
+            image.buffers.emplace_back(manifest.warmboot_header());
+        image.segments.push_back(
+            {"warmboot header", 0, header.data(), (std::uint32_t)header.size()});
+    }
+    for (const auto& entry : manifest.images) {
+        if (entry.offset % PAGE_SIZE_BYTES) {
+            throw std::runtime_error(
+                "The offset of '" + entry.path + "' is not page-aligned");
+        }
+        add_image_file(image, params, entry.path, entry.offset);
+    }
+
+    return write_segments(dev, params, image.segments);
+}
+
+// Writes the Intel HEX, ELF or Android sparse image, only its populated
+// extents, see write_segments()
+bool Session::write_sparse(
+    const std::shared_ptr<Transport>& dev,
+    const ProgrammerOptions& params,
+    std::span<const std::uint8_t> contents) {
+    TraceSpan span("write_sparse", "board");
+
+    if (params.offset || params.size) {
+        throw std::runtime_error(
+            "-o and -s do not go with the sparse images, they have the addresses");
+    }
+    if (params.diff || !params.cache_path.empty()) {
+        throw std::runtime_error(
+            "Writing differences or using the cache needs a raw image");
+    }
+
+    SegmentedImage image;
+    add_image_file(image, params, params.path, 0, contents);
+
+    return write_segments(dev, params, image.segments);
+}
+
+// Whether the compressed image decompresses into an iCE40 bitstream, going
+// by its first page
+bool compressed_bitstream(
+    Compression compression,
+    std::span<const std::uint8_t> contents) {
+    std::uint8_t head[PAGE_SIZE_BYTES];
+    Decompressor decompressor(compression, contents.data(), contents.size());
+    const auto size = decompressor.read(head, sizeof(head));
+    return Bitstream::is_bitstream(head, size);
+}
+
+// Writes the contents of the file: decompressing them on the fly when they
+// are compressed, only the extents of the sparse images, or the images
+// listed in the manifest
+bool Session::write_image(
+    const std::shared_ptr<Transport>& dev,
+    const ProgrammerOptions& params,
+    std::span<const std::uint8_t> contents) {
+    const auto compression = params.manifest
+        ? Compression::NONE
+        : detect_compression(contents.data(), contents.size());
+    const auto sparse = !params.manifest && compression == Compression::NONE
+        && !params.raw
+        && detect_image_format(contents.data(), contents.size())
+            != ImageFormat::RAW;
+
+    // Only the writes of plain images keep a journal
+    if (params.resume
+        && (params.manifest || compression != Compression::NONE || sparse)) {
+        throw std::runtime_error("Only the writes of plain images can be resumed");
+    }
+
+    if (params.manifest) {
+        return write_manifest(dev, params, contents);
+    }
+    if (sparse) {
+        return write_sparse(dev, params, contents);
+    }
+    if (compression == Compression::NONE) {
+        return write_board(dev, params, contents);
+    }
+    // The bitstreams are small, decompressed whole they get checked and
+    // trimmed before anything is erased like the plain ones. Their writes
+    // cannot be resumed, so they keep no journal.
+    if (!params.raw && compressed_bitstream(compression, contents)) {
+        const auto image = decompress(
+            compression,
+            contents.data(),
+            contents.size(),
+            MAX_FLASH_SIZE_BYTES);
+        auto bitstream_params = params;
+        bitstream_params.journal = false;
+        return write_board(dev, bitstream_params, image);
+    }
+    return write_board_stream(dev, params, contents, compression);
+}
+
+bool Session::read_board(
+    const std::shared_ptr<Transport>& dev,
+    const ProgrammerOptions& params) {
+    TraceSpan span("read_board", "board");
+
+    const std::uint32_t offset = params.offset.value_or(0);
+    const auto& path = params.path;
+
+    if (offset > MAX_FLASH_SIZE_BYTES) {
+        throw std::runtime_error("The offset is too large");
+    }
+
+    const std::uint32_t size =
+        params.size.value_or(MAX_FLASH_SIZE_BYTES - offset);
+    if (size > MAX_FLASH_SIZE_BYTES) {
+        throw std::runtime_error("The size is too large");
+    }
+
+    // With a store, the contents go there and the file gets the manifest
+    std::unique_ptr<SnapshotStore> store;
+    if (!params.store_path.empty()) {
+        if (params.resume) {
+            throw std::runtime_error("--resume does not go with --store");
+        }
+        store = std::make_unique<SnapshotStore>(params.store_path);
+    }
+
+    const auto board_version = get_board_version(dev);
+    log_info("Board version: %d", board_version);
+
+    const auto flash_id = reset_board(dev);
+    log_info("Reset, flash ID: %#06x", flash_id);
+
+    std::unique_ptr<FlashCache> cache;
+    if (!params.cache_path.empty()) {
+        cache = std::make_unique<FlashCache>(
+            params.cache_path,
+            dev->serial(),
+            flash_id);
+    }
+
+    // Resuming goes on writing the file read in part before, as recorded in
+    // the journal. Otherwise the file starts over.
+    std::ofstream f;
+    std::unique_ptr<Journal> journal;
+    if (!store) {
+        journal = open_journal(
+            dev,
+            params,
+            Journal::Operation::READ,
+            flash_id,
+            offset,
+            size,
+            {});
+        if (journal && journal->resumed()) {
+            f.open(path, std::ios::in | std::ios::out | std::ios::binary);
+        }
+        if (!f.is_open()) {
+            f.open(path, std::ios::out | std::ios::trunc | std::ios::binary);
+        }
+        if (!f) {
+            throw std::runtime_error("Cannot open the file");
+        }
+    }
+
+    std::unique_ptr<SnapshotWriter> snapshot;
+    if (store) {
+        snapshot = std::make_unique<SnapshotWriter>(
+            *store,
+            dev->serial(),
+            flash_id,
+            offset,
+            size);
+    }
+
+    log_info(
+        "Reading %d bytes starting at offset %d to '%s'",
+        size,
+        offset,
+        path.c_str());
+
+    // Digest of the sector being read, recorded in the cache once the whole
+    // sector has been read
+    Sha256 sector_sha;
+    auto sector_from_start = false;
+
+    // The pages confirmed in the journal and saved to the file before are
+    // not read again
+    const auto page_count = (size + PAGE_SIZE_BYTES - 1) / PAGE_SIZE_BYTES;
+    const auto first_journal_page = offset / PAGE_SIZE_BYTES;
+    std::uint32_t first_page = 0;
+    if (journal && journal->resumed()) {
+        f.seekp(0, std::ios::end);
+        const auto saved_pages = (std::uint32_t)(f.tellp() / PAGE_SIZE_BYTES);
+        while (first_page < std::min(page_count, saved_pages)
+               && journal->page_confirmed(first_journal_page + first_page)) {
+            ++first_page;
+        }
+        log_info(
+            "Skipping %u bytes read before",
+            first_page * PAGE_SIZE_BYTES);
+        f.seekp(first_page * PAGE_SIZE_BYTES);
+    }
+
+    // The pages saved to the file are confirmed in the journal a sector at
+    // a time, once the file has them
+    auto unconfirmed_page = first_page;
+    const auto confirm_saved = [&](std::uint32_t end_page) {
+        f.flush();
+        if (!f) {
+            return;
+        }
+        for (; unconfirmed_page < end_page; ++unconfirmed_page) {
+            journal->confirm_page(first_journal_page + unconfirmed_page);
+        }
+    };
+
+    // The replies are streamed to the file as they arrive
+    progress.begin(
+        "read",
+        (page_count - first_page) * PAGE_SIZE_BYTES);
+    const auto pages = first_page + pipeline_with_retries(
+        dev,
+        page_count - first_page,
+        COMMAND_HEADER_SIZE_BYTES,
+        0,
+        PAGE_SIZE_BYTES,
+        [&](std::size_t idx, std::uint8_t* frame) -> const std::uint8_t* {
+            fill_read_frame(
+                frame,
+                offset + (first_page + idx) * PAGE_SIZE_BYTES);
+            return nullptr;
+        },
+        [&](std::size_t idx, const std::uint8_t* page) {
+            const auto page_idx = first_page + idx;
+            const std::uint32_t page_addr = offset + page_idx * PAGE_SIZE_BYTES;
+
+            if (snapshot) {
+                TraceSpan store_span("store_write", "io", PAGE_SIZE_BYTES);
+                try {
+                    snapshot->add(
+                        page,
+                        std::min(PAGE_SIZE_BYTES, offset + size - page_addr));
+                } catch (const std::exception& e) {
+                    // Rejecting the page stops the reading and drains the
+                    // exchanges still in flight
+                    log_error("%s", e.what());
+                    return false;
+                }
+            } else {
+                TraceSpan file_span("file_write", "io", PAGE_SIZE_BYTES);
+                f.write(reinterpret_cast<const char*>(page), PAGE_SIZE_BYTES);
+            }
+
+            if (cache) {
+                if (page_addr % SECTOR_SIZE_BYTES == 0) {
+                    sector_sha.reset();
+                    sector_from_start = true;
+                }
+                sector_sha.update(page, PAGE_SIZE_BYTES);
+                if ((page_addr + PAGE_SIZE_BYTES) % SECTOR_SIZE_BYTES == 0
+                    && sector_from_start) {
+                    cache->update(page_addr >> SECTOR_SHIFT, sector_sha.finish());
+                }
+            }
+
+            if (journal
+                && (page_idx + 1) % (SECTOR_SIZE_BYTES / PAGE_SIZE_BYTES) == 0) {
+                confirm_saved(page_idx + 1);
+            }
+
+            progress.advance(PAGE_SIZE_BYTES);
+            return snapshot || bool(f);
+        },
+        params.queue_depth.value_or(DEFAULT_QUEUE_DEPTH));
+    const std::uint32_t read = pages * PAGE_SIZE_BYTES;
+
+    progress.end();
+    if (journal) {
+        confirm_saved(pages);
+        journal->flush();
+    }
+
+    if (snapshot && pages == page_count) {
+        snapshot->finish().save(path);
+        log_info(
+            "Saved the snapshot of %d bytes to '%s': %u chunks stored, %u already in '%s', %u blank",
+            size,
+            path.c_str(),
+            snapshot->stored_chunks(),
+            snapshot->known_chunks(),
+            params.store_path.c_str(),
+            snapshot->blank_chunks());
+    } else if (snapshot) {
+        log_error("Reading stopped, no snapshot saved");
+    } else {
+        if (pages != page_count) {
+            log_error(
+                "Reading stopped at page offset %#x",
+                read + offset);
+        }
+        log_info("Saved %d bytes to '%s'", read, path.c_str());
+    }
+
+    const auto complete = pages == page_count && (snapshot || bool(f));
+    if (journal && complete) {
+        journal->remove();
+    } else if (journal) {
+        log_error(
+            "Run again with --resume to go on from where the read stopped");
+    }
+
+    const auto run = run_board(dev);
+    log_info("Run: %#02x", run);
+
+    return complete;
+}
+
+// Gets the version of the board and holds the FPGA in reset, so that the
+// flash can be worked on
+void Session::hold_board(const std::shared_ptr<Transport>& dev) {
+    const auto board_version = get_board_version(dev);
+    log_info("Board version: %d", board_version);
+
+    const auto flash_id = reset_board(dev);
+    log_info("Reset, flash ID: %#06x", flash_id);
+}
+
+// What the messages call the images and the flash contents in memory
+constexpr const char* BUFFER_NAME = "(buffer)";
+
+}  // namespace
+
+IceFunProgrammer::IceFunProgrammer(
+    std::shared_ptr<Transport> dev,
+    ProgrammerOptions options,
+    ProgrammerCallbacks callbacks) :
+    _dev(std::move(dev)),
+    _options(std::move(options)),
+    _callbacks(std::move(callbacks)) {
+}
+
+// Runs the operation on a session reporting to the callbacks, and collects
+// its result
+template <typename Operation>
+OperationResult IceFunProgrammer::run(const Operation& operation) {
+    OperationResult result;
+
+    Session session(_callbacks, result);
+    result.ok = operation(session);
+    session.progress.finish(result.ok);
+
+    result.retries = session.progress.retries();
+    result.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        session.progress.elapsed());
+    result.phases = session.progress.phases();
+    return result;
+}
+
+OperationResult IceFunProgrammer::cycle() {
+    return run([&](Session& session) {
+        session.cycle_board(_dev);
+        return true;
+    });
+}
+
+OperationResult
+IceFunProgrammer::read(std::uint32_t offset, std::span<std::uint8_t> data) {
+    return run([&](Session& session) {
+        TraceSpan span("read_board", "board");
+
+        if (offset > MAX_FLASH_SIZE_BYTES
+            || data.size() > MAX_FLASH_SIZE_BYTES - offset) {
+            throw std::runtime_error("Cannot read past the end of the flash");
+        }
+
+        session.hold_board(_dev);
+
+        // The last page is read aside when the data ends within it
+        const auto size = (std::uint32_t)data.size();
+        const auto full_pages = size / PAGE_SIZE_BYTES;
+        const auto page_count = (size + PAGE_SIZE_BYTES - 1) / PAGE_SIZE_BYTES;
+
+        session.log_info(
+            "Reading %u bytes starting at offset %u to %s",
+            size,
+            offset,
+            BUFFER_NAME);
+
+        session.progress.begin("read", page_count * PAGE_SIZE_BYTES);
+        auto pages = session.read_pages(
+            _dev,
+            offset,
+            full_pages,
+            data.data(),
+            _options.queue_depth.value_or(DEFAULT_QUEUE_DEPTH));
+        if (pages == full_pages && page_count > full_pages) {
+            std::uint8_t page[PAGE_SIZE_BYTES];
+            if (session.read_pages(
+                    _dev,
+                    offset + size - size % PAGE_SIZE_BYTES,
+                    1,
+                    page,
+                    1)
+                == 1) {
+                memcpy(
+                    data.data() + full_pages * PAGE_SIZE_BYTES,
+                    page,
+                    size % PAGE_SIZE_BYTES);
+                ++pages;
+            }
+        }
+        session.progress.end();
+
+        if (pages != page_count) {
+            session.log_error(
+                "Reading stopped at page offset %#x",
+                offset + (std::uint32_t)pages * PAGE_SIZE_BYTES);
+        }
+        session.log_info(
+            "Read %u bytes",
+            std::min(size, (std::uint32_t)pages * PAGE_SIZE_BYTES));
+
+        const auto run = run_board(_dev);
+        session.log_info("Run: %#02x", run);
+
+        return pages == page_count;
+    });
+}
+
+OperationResult IceFunProgrammer::write(
+    std::uint32_t offset,
+    std::span<const std::uint8_t> image) {
+    return run([&](Session& session) {
+        if (image.size() > MAX_FLASH_SIZE_BYTES) {
+            throw std::runtime_error("Cannot fit the data into the flash");
+        }
+
+        auto options = _options;
+        options.path = BUFFER_NAME;
+        options.manifest = false;
+        options.raw = true;
+        options.offset = offset;
+        options.size = image.size();
+        options.journal = false;
+        options.resume = false;
+        return session.write_board(_dev, options, image);
+    });
+}
+
+OperationResult IceFunProgrammer::verify(
+    std::uint32_t offset,
+    std::span<const std::uint8_t> image,
+    VerifyMode mode) {
+    return run([&](Session& session) {
+        if (offset > MAX_FLASH_SIZE_BYTES
+            || image.size() > MAX_FLASH_SIZE_BYTES - offset) {
+            throw std::runtime_error("Cannot verify past the end of the flash");
+        }
+
+        session.hold_board(_dev);
+
+        auto options = _options;
+        options.verify = mode;
+
+        const auto size = (std::uint32_t)image.size();
+        WrittenPages written;
+        written.count = (size + PAGE_SIZE_BYTES - 1) / PAGE_SIZE_BYTES;
+        written.frame = [&](IceFunCommands cmd, std::size_t idx, std::uint8_t* frame) {
+            return fill_page_frame(
+                frame,
+                cmd,
+                offset + idx * PAGE_SIZE_BYTES,
+                image.data(),
+                size,
+                idx);
+        };
+        written.addr = [&](std::size_t idx) {
+            return offset + (std::uint32_t)idx * PAGE_SIZE_BYTES;
+        };
+        written.image_bytes = [&](std::size_t idx) {
+            return std::min(
+                PAGE_SIZE_BYTES,
+                size - (std::uint32_t)idx * PAGE_SIZE_BYTES);
+        };
+
+        const auto complete = session.verify_written(
+            _dev,
+            options,
+            BUFFER_NAME,
+            written,
+            offset,
+            size,
+            mode == VerifyMode::HASH ? Sha256::hash(image.data(), size)
+                                     : Sha256::Digest {});
+
+        const auto run = run_board(_dev);
+        session.log_info("Run: %#02x", run);
+
+        return complete;
+    });
+}
+
+OperationResult
+IceFunProgrammer::erase(std::uint32_t offset, std::uint32_t size) {
+    return run([&](Session& session) {
+        if (offset > MAX_FLASH_SIZE_BYTES
+            || size > MAX_FLASH_SIZE_BYTES - offset) {
+            throw std::runtime_error("Cannot erase past the end of the flash");
+        }
+
+        session.hold_board(_dev);
+
+        std::vector<std::uint32_t> sectors;
+        if (size) {
+            for (auto sector_idx = offset >> SECTOR_SHIFT;
+                 sector_idx <= (offset + size - 1) >> SECTOR_SHIFT;
+                 ++sector_idx) {
+                sectors.push_back(sector_idx);
+            }
+        }
+        session.erase_board(
+            _dev,
+            session.plan_erase(
+                _dev,
+                sectors,
+                _options.chip_erase && !offset && size == MAX_FLASH_SIZE_BYTES,
+                _options.blank_check,
+                _options.queue_depth.value_or(DEFAULT_QUEUE_DEPTH)));
+
+        const auto run = run_board(_dev);
+        session.log_info("Run: %#02x", run);
+
+        return true;
+    });
+}
+
+OperationResult IceFunProgrammer::write_file(const MappedFile* file) {
+    return run([&](Session& session) {
+        if (file) {
+            return session.write_image(
+                _dev,
+                _options,
+                {file->data(), file->size()});
+        }
+
+        TraceSpan map_span("map_image", "io");
+        const MappedFile mapped(_options.path, false);
+        map_span.end();
+
+        return session.write_image(
+            _dev,
+            _options,
+            {mapped.data(), mapped.size()});
+    });
+}
+
+OperationResult IceFunProgrammer::read_file() {
+    return run([&](Session& session) {
+        return session.read_board(_dev, _options);
+    });
+}
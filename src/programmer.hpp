@@ -0,0 +1,172 @@
+#ifndef __PROGRAMMER_HPP__
+#define __PROGRAMMER_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "mappedfile.hpp"
+#include "progress.hpp"
+#include "transport.hpp"
+
+// The operations on the flash of an iceFUN board, for the command line and
+// for the programs linking the library
+
+constexpr std::uint32_t DEFAULT_QUEUE_DEPTH = 8;
+
+enum class VerifyMode {
+    DEVICE,
+    READBACK,
+    HASH,
+    NONE
+};
+
+inline const char* verify_mode_name(VerifyMode mode) {
+    switch (mode) {
+        case VerifyMode::DEVICE:
+            return "device";
+        case VerifyMode::READBACK:
+            return "readback";
+        case VerifyMode::HASH:
+            return "hash";
+        case VerifyMode::NONE:
+            return "none";
+    }
+
+    return "unknown";
+}
+
+// How the operations go, the command line fills these in
+struct ProgrammerOptions {
+    // The file written or read by write_file() and read_file(), and named in
+    // the messages
+    std::string path;
+    // Whether `path` is a manifest of the images to write
+    bool manifest {false};
+    // The snapshot store of read_file()
+    std::string store_path;
+    std::optional<std::uint32_t> offset;
+    std::optional<std::uint32_t> size;
+    std::optional<std::uint32_t> queue_depth;
+    VerifyMode verify {VerifyMode::DEVICE};
+    bool diff {false};
+    bool raw {false};
+    // Whether write_file() and read_file() keep a journal next to the file
+    // for resuming them, not when several boards are run at once
+    bool journal {false};
+    // Whether to continue the write or read recorded in the journal
+    bool resume {false};
+    bool chip_erase {false};
+    bool blank_check {false};
+    std::string cache_path;
+    std::optional<std::uint32_t> cache_sample;
+};
+
+enum class LogLevel {
+    INFO,
+    ERROR
+};
+
+// Where the operations report to. All of them are optional, and are called
+// on the thread running the operation.
+struct ProgrammerCallbacks {
+    // A line of the log, without the newline
+    std::function<void(LogLevel level, const std::string& message)> log;
+    Progress::Callback progress;
+    // Asked before a failed exchange is tried again, whether to give up
+    std::function<bool()> stop_requested;
+};
+
+// The outcome of an operation. The errors stopping it before it gets to the
+// flash are thrown instead.
+struct OperationResult {
+    // Whether all of the flash was read, written or verified
+    bool ok {};
+    std::uint8_t board_version {};
+    std::uint32_t flash_id {};
+    std::uint32_t retries {};
+    std::chrono::milliseconds elapsed {};
+    std::vector<PhaseTiming> phases;
+};
+
+// Runs the operations on the board, one at a time. Every operation gets the
+// board, holds the FPGA in reset while it works on the flash, and lets the
+// FPGA run from the flash once done.
+class IceFunProgrammer {
+  public:
+    explicit IceFunProgrammer(
+        std::shared_ptr<Transport> dev,
+        ProgrammerOptions options = {},
+        ProgrammerCallbacks callbacks = {});
+
+    const std::shared_ptr<Transport>& device() const {
+        return _dev;
+    }
+
+    ProgrammerOptions& options() {
+        return _options;
+    }
+
+    // Gets the version of the board, resets the FPGA and lets it run
+    OperationResult cycle();
+
+    // Reads the flash at `offset` into `data`
+    OperationResult read(std::uint32_t offset, std::span<std::uint8_t> data);
+
+    // Erases the sectors the image covers, programs it at `offset` and
+    // verifies it as the options say. The image is written as it is, even
+    // when it is a bitstream followed by padding.
+    OperationResult
+    write(std::uint32_t offset, std::span<const std::uint8_t> image);
+
+    // Checks that the flash at `offset` holds the image. The rest of the page
+    // the image ends within is taken to be erased.
+    OperationResult verify(
+        std::uint32_t offset,
+        std::span<const std::uint8_t> image,
+        VerifyMode mode = VerifyMode::DEVICE);
+
+    // Erases the sectors holding the `size` bytes at `offset`. The chip is
+    // erased at once only when the options allow it and the range is the
+    // whole flash.
+    OperationResult erase(std::uint32_t offset, std::uint32_t size);
+
+    // Writes the file at the path of the options the way the command line
+    // does: a plain, compressed or sparse image, or the images listed in a
+    // manifest. Maps the file unless it is given mapped already.
+    OperationResult write_file(const MappedFile* file = nullptr);
+
+    // Reads the flash into the file at the path of the options, or into
+    // the snapshot store
+    OperationResult read_file();
+
+  private:
+    template <typename Operation>
+    OperationResult run(const Operation& operation);
+
+    std::shared_ptr<Transport> _dev;
+    ProgrammerOptions _options;
+    ProgrammerCallbacks _callbacks;
+};
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef __PROGRESS_HPP__
+#define __PROGRESS_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// A report on the progress of a board operation
+struct ProgressEvent {
+    enum class Kind {
+        BEGIN,  // A phase starts
+        ADVANCE,  // More bytes of the phase are done
+        END,  // The phase ends
+        FINISH  // The whole operation ends
+    };
+
+    Kind kind {};
+    // Empty with FINISH
+    const char* phase {""};
+    // Bytes of the phase done and in all, the total is zero when not known
+    std::uint64_t done {};
+    std::uint64_t total {};
+    // Exchanges retried so far in the operation
+    std::uint32_t retries {};
+    // Whether the whole operation went through, with FINISH
+    bool ok {};
+    // Since the phase and the operation started
+    std::chrono::steady_clock::duration phase_elapsed {};
+    std::chrono::steady_clock::duration elapsed {};
+};
+
+// How long a phase of a board operation took
+struct PhaseTiming {
+    std::string phase;
+    std::uint64_t bytes {};
+    std::chrono::milliseconds elapsed {};
+};
+
+// Progress of the phases of a board operation: reported to the callback as
+// the operation goes, and kept as the timings of the phases
+class Progress {
+  public:
+    using Clock = std::chrono::steady_clock;
+    using Callback = std::function<void(const ProgressEvent&)>;
+
+    Progress() = default;
+
+    explicit Progress(Callback callback) :
+        _callback(std::move(callback)),
+        _start(Clock::now()) {
+    }
+
+    // Starts the phase of `total` bytes, zero when not known up front
+    void begin(const char* phase, std::uint64_t total = 0) {
+        _phase = phase;
+        _total = total;
+        _done = 0;
+        _phase_start = Clock::now();
+
+        report(ProgressEvent::Kind::BEGIN);
+    }
+
+    void advance(std::uint64_t bytes) {
+        _done += bytes;
+        report(ProgressEvent::Kind::ADVANCE);
+    }
+
+    // Marks the whole phase done at once, without reporting it
+    void complete() {
+        _done = std::max(_done, _total);
+    }
+
+    void end() {
+        _phases.push_back(
+            {_phase,
+             _done,
+             std::chrono::duration_cast<std::chrono::milliseconds>(
+                 Clock::now() - _phase_start)});
+        report(ProgressEvent::Kind::END);
+    }
+
+    void retry() {
+        ++_retries;
+    }
+
+    // The outcome of the whole operation
+    void finish(bool ok) {
+        _phase = "";
+        _done = 0;
+        _total = 0;
+        _phase_start = _start;
+        report(ProgressEvent::Kind::FINISH, ok);
+    }
+
+    const std::vector<PhaseTiming>& phases() const {
+        return _phases;
+    }
+
+    std::uint32_t retries() const {
+        return _retries;
+    }
+
+    Clock::duration elapsed() const {
+        return Clock::now() - _start;
+    }
+
+  private:
+    void report(ProgressEvent::Kind kind, bool ok = false) {
+        if (!_callback) {
+            return;
+        }
+
+        const auto now = Clock::now();
+        ProgressEvent event;
+        event.kind = kind;
+        event.phase = _phase;
+        event.done = _done;
+        event.total = _total;
+        event.retries = _retries;
+        event.ok = ok;
+        event.phase_elapsed = now - _phase_start;
+        event.elapsed = now - _start;
+        _callback(event);
+    }
+
+    Callback _callback;
+    Clock::time_point _start {Clock::now()};
+    std::vector<PhaseTiming> _phases;
+
+    const char* _phase {""};
+    std::uint64_t _total {};
+    std::uint64_t _done {};
+    std::uint32_t _retries {};
+    Clock::time_point _phase_start;
+};
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef __PROGRESSPRINTER_HPP__
+#define __PROGRESSPRINTER_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+#include "cmdline.hpp"
+#include "progress.hpp"
+
+// Shows the progress of the operations on a board: either a dot per page on
+// the log, or NDJSON events for the machines. The events are rate-limited and
+// written whole, a line at a time, to the events file shared by the boards
+// run side by side.
+class ProgressPrinter {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr auto EVENT_INTERVAL = std::chrono::milliseconds(250);
+
+    ProgressPrinter(
+        ProgressMode mode,
+        FILE* events,
+        FILE* dots,
+        std::string serial) :
+        _mode(mode),
+        _events(events),
+        _dots(dots),
+        _serial(json_escape(serial)) {
+    }
+
+    void operator()(const ProgressEvent& event) {
+        if (_mode == ProgressMode::DOTS) {
+            switch (event.kind) {
+                case ProgressEvent::Kind::BEGIN:
+                    _dotted = false;
+                    break;
+                case ProgressEvent::Kind::ADVANCE:
+                    fputc('.', _dots);
+                    _dotted = true;
+                    break;
+                case ProgressEvent::Kind::END:
+                    break_line();
+                    break;
+                case ProgressEvent::Kind::FINISH:
+                    break;
+            }
+            return;
+        }
+
+        const auto now = Clock::now();
+        switch (event.kind) {
+            case ProgressEvent::Kind::BEGIN:
+                _last_event = now;
+                _last_done = 0;
+                emit("begin", event, now);
+                break;
+            case ProgressEvent::Kind::ADVANCE:
+                if (now - _last_event >= EVENT_INTERVAL) {
+                    emit("progress", event, now);
+                }
+                break;
+            case ProgressEvent::Kind::END:
+                emit("end", event, now);
+                break;
+            case ProgressEvent::Kind::FINISH: {
+                std::lock_guard<std::mutex> lock(sink_lock());
+                fprintf(
+                    _events,
+                    "{\"event\":\"finish\",\"serial\":\"%s\",\"ok\":%s,"
+                    "\"retries\":%u,\"elapsed_ms\":%llu}\n",
+                    _serial.c_str(),
+                    event.ok ? "true" : "false",
+                    event.retries,
+                    (unsigned long long)msec(event.elapsed));
+                fflush(_events);
+                break;
+            }
+        }
+    }
+
+    // Ends the line of dots, before a message goes to the log
+    void break_line() {
+        if (_dotted) {
+            fputc('\n', _dots);
+            _dotted = false;
+        }
+    }
+
+  private:
+    static std::mutex& sink_lock() {
+        static std::mutex lock;
+        return lock;
+    }
+
+    static std::uint64_t msec(Clock::duration duration) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(duration)
+            .count();
+    }
+
+    static std::string json_escape(const std::string& text) {
+        std::string escaped;
+        for (const auto c : text) {
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+                escaped += c;
+            } else if ((unsigned char)c >= 0x20) {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+    void emit(const char* name, const ProgressEvent& event, Clock::time_point now) {
+        const auto seconds = [](Clock::duration duration) {
+            return std::chrono::duration<double>(duration).count();
+        };
+
+        const auto since_last = seconds(now - _last_event);
+        const auto since_start = seconds(event.phase_elapsed);
+        const auto rate =
+            since_last > 0 ? (event.done - _last_done) / since_last : 0;
+        const auto avg_rate = since_start > 0 ? event.done / since_start : 0;
+
+        char eta[32] = "null";
+        if (event.total && avg_rate > 0) {
+            snprintf(
+                eta,
+                sizeof(eta),
+                "%.1f",
+                (event.total > event.done ? event.total - event.done : 0)
+                    / avg_rate);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(sink_lock());
+            fprintf(
+                _events,
+                "{\"event\":\"%s\",\"serial\":\"%s\",\"phase\":\"%s\","
+                "\"done\":%llu,\"total\":%llu,\"rate_bps\":%.0f,"
+                "\"avg_bps\":%.0f,\"eta_sec\":%s,\"retries\":%u,"
+                "\"elapsed_ms\":%llu}\n",
+                name,
+                _serial.c_str(),
+                event.phase,
+                (unsigned long long)event.done,
+                (unsigned long long)event.total,
+                rate,
+                avg_rate,
+                eta,
+                event.retries,
+                (unsigned long long)msec(event.elapsed));
+            fflush(_events);
+        }
+
+        _last_event = now;
+        _last_done = event.done;
+    }
+
+    ProgressMode _mode {ProgressMode::DOTS};
+    FILE* _events {stdout};
+    FILE* _dots {stdout};
+    std::string _serial;
+
+    bool _dotted {};
+    Clock::time_point _last_event;
+    std::uint64_t _last_done {};
+};
+
+#endif
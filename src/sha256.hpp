@@ -0,0 +1,206 @@
+#ifndef __SHA256_HPP__
+#define __SHA256_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// SHA-256 as specified in FIPS 180-4
+
+class Sha256 {
+  public:
+    using Digest = std::array<std::uint8_t, 32>;
+
+    Sha256() {
+        reset();
+    }
+
+    void reset() {
+        _state = {
+            0x6a09e667,
+            0xbb67ae85,
+            0x3c6ef372,
+            0xa54ff53a,
+            0x510e527f,
+            0x9b05688c,
+            0x1f83d9ab,
+            0x5be0cd19};
+        _length = 0;
+        _buffered = 0;
+    }
+
+    void update(const std::uint8_t* data, std::size_t size) {
+        _length += size;
+
+        if (_buffered) {
+            const auto to_copy = std::min(size, sizeof(_buffer) - _buffered);
+            memcpy(_buffer + _buffered, data, to_copy);
+            _buffered += to_copy;
+            data += to_copy;
+            size -= to_copy;
+            if (_buffered < sizeof(_buffer)) {
+                return;
+            }
+            transform(_buffer);
+            _buffered = 0;
+        }
+
+        for (; size >= sizeof(_buffer); size -= sizeof(_buffer)) {
+            transform(data);
+            data += sizeof(_buffer);
+        }
+
+        memcpy(_buffer, data, size);
+        _buffered = size;
+    }
+
+    // Repeats the byte `size` times, handy for the erased parts of the flash
+    void update_fill(std::uint8_t value, std::size_t size) {
+        std::uint8_t fill[256];
+        memset(fill, value, sizeof(fill));
+        while (size) {
+            const auto chunk = std::min(size, sizeof(fill));
+            update(fill, chunk);
+            size -= chunk;
+        }
+    }
+
+    Digest finish() {
+        const std::uint64_t bit_length = _length * 8;
+        const std::uint8_t pad = 0x80;
+        const std::uint8_t zero = 0;
+
+        update(&pad, 1);
+        while (_buffered != sizeof(_buffer) - sizeof(bit_length)) {
+            update(&zero, 1);
+        }
+        for (auto shift = 56; shift >= 0; shift -= 8) {
+            const std::uint8_t byte = bit_length >> shift;
+            update(&byte, 1);
+        }
+
+        Digest digest;
+        for (auto idx = 0; idx < 8; ++idx) {
+            digest[idx * 4] = _state[idx] >> 24;
+            digest[idx * 4 + 1] = _state[idx] >> 16;
+            digest[idx * 4 + 2] = _state[idx] >> 8;
+            digest[idx * 4 + 3] = _state[idx];
+        }
+
+        reset();
+        return digest;
+    }
+
+    static Digest hash(const std::uint8_t* data, std::size_t size) {
+        Sha256 sha;
+        sha.update(data, size);
+        return sha.finish();
+    }
+
+    static std::string to_string(const Digest& digest) {
+        static const char hex[] = "0123456789abcdef";
+        std::string str;
+        for (const auto byte : digest) {
+            str += hex[byte >> 4];
+            str += hex[byte & 0xf];
+        }
+        return str;
+    }
+
+  private:
+    static std::uint32_t rotr(std::uint32_t x, int n) {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    void transform(const std::uint8_t* block) {
+        static const std::uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b,
+            0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01,
+            0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7,
+            0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+            0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152,
+            0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+            0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+            0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819,
+            0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08,
+            0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f,
+            0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+            0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+        std::uint32_t w[64];
+        for (auto idx = 0; idx < 16; ++idx) {
+            w[idx] = (std::uint32_t(block[idx * 4]) << 24)
+                | (std::uint32_t(block[idx * 4 + 1]) << 16)
+                | (std::uint32_t(block[idx * 4 + 2]) << 8)
+                | std::uint32_t(block[idx * 4 + 3]);
+        }
+        for (auto idx = 16; idx < 64; ++idx) {
+            const auto s0 = rotr(w[idx - 15], 7) ^ rotr(w[idx - 15], 18)
+                ^ (w[idx - 15] >> 3);
+            const auto s1 = rotr(w[idx - 2], 17) ^ rotr(w[idx - 2], 19)
+                ^ (w[idx - 2] >> 10);
+            w[idx] = w[idx - 16] + s0 + w[idx - 7] + s1;
+        }
+
+        auto a = _state[0];
+        auto b = _state[1];
+        auto c = _state[2];
+        auto d = _state[3];
+        auto e = _state[4];
+        auto f = _state[5];
+        auto g = _state[6];
+        auto h = _state[7];
+
+        for (auto idx = 0; idx < 64; ++idx) {
+            const auto s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+            const auto ch = (e & f) ^ (~e & g);
+            const auto t1 = h + s1 + ch + k[idx] + w[idx];
+            const auto s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+            const auto maj = (a & b) ^ (a & c) ^ (b & c);
+            const auto t2 = s0 + maj;
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        _state[0] += a;
+        _state[1] += b;
+        _state[2] += c;
+        _state[3] += d;
+        _state[4] += e;
+        _state[5] += f;
+        _state[6] += g;
+        _state[7] += h;
+    }
+
+    std::array<std::uint32_t, 8> _state;
+    std::uint64_t _length;
+    std::uint8_t _buffer[64];
+    std::size_t _buffered;
+};
+
+#endif
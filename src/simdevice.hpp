@@ -0,0 +1,411 @@
+#ifndef __SIM_DEVICE_HPP__
+#define __SIM_DEVICE_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "icefun.hpp"
+#include "transport.hpp"
+
+// Timings of the simulated board, in microseconds
+struct SimTimings {
+    // Bulk packets of the USB full-speed PIC
+    std::uint32_t packet_size {64};
+    std::uint32_t packet_usec {};
+    // Every reply ends with a short packet, so it takes an IN transfer of its
+    // own, and the host schedules the next one in a later frame
+    std::uint32_t transfer_usec {};
+    // Parsing a command by the PIC
+    std::uint32_t command_usec {};
+    std::uint32_t reset_usec {};
+    std::uint32_t release_usec {};
+    // Moving a page between the PIC and the flash over SPI
+    std::uint32_t spi_page_usec {};
+    std::uint32_t program_page_usec {};
+    std::uint32_t erase_64k_usec {};
+    std::uint32_t erase_chip_usec {};
+
+    // Faults: the board loses every n-th reply and stalls until the host
+    // resyncs, taking the bytes sent meanwhile only up to halfway through
+    // the next frame. Zero for never.
+    std::uint32_t stall_every {};
+
+    // Replies are ready as soon as the commands are sent
+    static SimTimings none() {
+        return {};
+    }
+
+    // Roughly what an iceFUN with the AT25SF081 flash takes
+    static SimTimings at25sf081() {
+        SimTimings timings;
+        timings.packet_usec = 50;
+        timings.transfer_usec = 1000;
+        timings.command_usec = 20;
+        timings.reset_usec = 2000;
+        timings.release_usec = 2000;
+        timings.spi_page_usec = 300;
+        timings.program_page_usec = 400;
+        timings.erase_64k_usec = 500000;
+        timings.erase_chip_usec = 6000000;
+        return timings;
+    }
+
+    static SimTimings named(const std::string& name) {
+        if (name.empty() || name == "at25sf081") {
+            return at25sf081();
+        }
+        if (name == "none") {
+            return none();
+        }
+        if (name == "flaky") {
+            auto timings = none();
+            timings.stall_every = 1000;
+            return timings;
+        }
+        throw std::runtime_error("Unknown simulator timings '" + name + "'");
+    }
+};
+
+// An iceFUN board simulated in the process: the PIC firmware commands over a
+// 1 MB flash that erases to 0xff and whose programming only clears bits.
+// The board executes the commands as soon as they are sent, in order, and
+// the replies become available when the simulated board and bus would have
+// delivered them; receiving sleeps until then. Not thread-safe, like the
+// USB device.
+class SimulatedDevice : public Transport {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr std::uint32_t FLASH_ID = 0x01851f;
+    static constexpr std::uint8_t BOARD_VERSION = 1;
+
+    explicit SimulatedDevice(
+        std::string serial,
+        SimTimings timings = SimTimings::at25sf081()) :
+        _serial(std::move(serial)),
+        _timings(timings),
+        _flash(MAX_FLASH_SIZE_BYTES, 0xff) {
+        if (!_timings.packet_size) {
+            throw std::runtime_error("The packet size must not be zero");
+        }
+    }
+
+    std::size_t send(
+        const std::uint8_t* data,
+        std::size_t size,
+        int timeout_msec = 0) override {
+        (void)timeout_msec;
+
+        const auto start = std::max(Clock::now(), _out_free);
+        _out_free = start + bus_time(size);
+        std::this_thread::sleep_until(_out_free);
+
+        const auto before = _input.size();
+        _input.insert(_input.end(), data, data + size);
+
+        std::size_t pos = 0;
+        while (!_stalled && pos < _input.size()) {
+            const auto cmd_size = command_frame_size(_input[pos]);
+            if (_input.size() - pos < cmd_size) {
+                break;
+            }
+            execute(&_input[pos], _out_free);
+            pos += cmd_size;
+        }
+        _input.erase(_input.begin(), _input.begin() + pos);
+
+        // The stalled board keeps what it took before, and takes the rest
+        // only up to halfway through the frame it is at
+        if (_stalled && !_input.empty()) {
+            const auto kept = std::min(
+                _input.size(),
+                std::max(
+                    command_frame_size(_input.front()) / 2,
+                    before > pos ? before - pos : 0));
+            const auto refused = _input.size() - kept;
+            _input.resize(kept);
+            return size - refused;
+        }
+
+        return size;
+    }
+
+    // Stops short when no more replies are due instead of waiting for the
+    // timeout: the board would not send anything anyway
+    std::size_t receive(
+        std::uint8_t* data,
+        std::size_t size,
+        int timeout_msec = 0) override {
+        (void)timeout_msec;
+
+        std::size_t total = 0;
+        while (total < size && !_replies.empty()) {
+            auto& reply = _replies.front();
+            std::this_thread::sleep_until(reply.ready);
+
+            const auto this_time =
+                std::min(size - total, reply.bytes.size() - reply.pos);
+            memcpy(data + total, reply.bytes.data() + reply.pos, this_time);
+            reply.pos += this_time;
+            total += this_time;
+            if (reply.pos == reply.bytes.size()) {
+                _replies.pop_front();
+            }
+        }
+
+        return total;
+    }
+
+    // Sends the command right away, the reply is received by poll() once the
+    // board would have sent it
+    void submit(
+        const std::uint8_t* header,
+        std::uint16_t header_size,
+        const std::uint8_t* payload,
+        std::uint16_t payload_size,
+        std::uint8_t* reply,
+        std::uint16_t reply_size,
+        Completion done,
+        int timeout_msec = 0) override {
+        if (!send_frame(header, header_size, payload, payload_size, timeout_msec)) {
+            done(false);
+            return;
+        }
+        _submitted.push_back({reply, reply_size, std::move(done)});
+    }
+
+    // Completes the exchanges whose replies are due, sleeping until the next
+    // one is when none is yet. The exchanges no reply is coming for fail.
+    void poll(int timeout_msec) override {
+        const auto deadline =
+            Clock::now() + std::chrono::milliseconds(timeout_msec);
+
+        auto completed = false;
+        while (!_submitted.empty()) {
+            if (!_replies.empty() && _replies.front().ready > Clock::now()) {
+                if (completed) {
+                    break;
+                }
+                if (_replies.front().ready > deadline) {
+                    std::this_thread::sleep_until(deadline);
+                    break;
+                }
+            }
+
+            const auto exchange = std::move(_submitted.front());
+            _submitted.pop_front();
+            exchange.done(
+                receive(exchange.reply, exchange.reply_size)
+                == exchange.reply_size);
+            completed = true;
+        }
+    }
+
+    // The replies on their way are dropped by the next resync()
+    void cancel() override {
+        auto submitted = std::move(_submitted);
+        _submitted.clear();
+        for (const auto& exchange : submitted) {
+            exchange.done(false);
+        }
+    }
+
+    // Clearing the halts gets the stalled board going again. Like the
+    // firmware, it takes the next bytes for the rest of the frame it was
+    // cut short in.
+    bool resync() override {
+        _stalled = false;
+        return Transport::resync();
+    }
+
+    const std::string& serial() const override {
+        return _serial;
+    }
+
+    std::string location() const override {
+        return "sim";
+    }
+
+    std::vector<std::uint8_t>& flash() {
+        return _flash;
+    }
+
+    bool released() const {
+        return _released;
+    }
+
+  private:
+    struct Reply {
+        std::vector<std::uint8_t> bytes;
+        std::size_t pos {};
+        Clock::time_point ready;
+    };
+
+    // An exchange started with submit() waiting for its reply
+    struct Submitted {
+        std::uint8_t* reply;
+        std::uint16_t reply_size;
+        Completion done;
+    };
+
+    Clock::duration bus_time(std::size_t size) const {
+        const auto packets = std::max<std::size_t>(
+            1,
+            (size + _timings.packet_size - 1) / _timings.packet_size);
+        return std::chrono::microseconds(packets * _timings.packet_usec);
+    }
+
+    // The flash wraps around within the page when programming, and at its
+    // end when reading, like the SPI flash does
+    std::uint8_t& flash_at(std::uint32_t page_addr, std::uint32_t idx) {
+        const auto addr = (page_addr & ~(PAGE_SIZE_BYTES - 1))
+            | ((page_addr + idx) & (PAGE_SIZE_BYTES - 1));
+        return _flash[addr % MAX_FLASH_SIZE_BYTES];
+    }
+
+    // Compares the page with the flash, the status carries the first
+    // mismatch: its offset, the expected byte and the flash byte
+    std::vector<std::uint8_t>
+    compare_page(std::uint32_t addr, const std::uint8_t* page) {
+        for (auto idx = 0u; idx < PAGE_SIZE_BYTES; ++idx) {
+            if (flash_at(addr, idx) != page[idx]) {
+                return {1, (std::uint8_t)idx, page[idx], flash_at(addr, idx)};
+            }
+        }
+        return {0, 0, 0, 0};
+    }
+
+    void execute(const std::uint8_t* frame, Clock::time_point arrival) {
+        // Only the page commands carry an address
+        const auto addr = command_frame_size(frame[0]) >= COMMAND_HEADER_SIZE_BYTES
+            ? (std::uint32_t)frame[1] << 16 | (std::uint32_t)frame[2] << 8
+                | frame[3]
+            : 0;
+
+        std::uint32_t busy_usec = _timings.command_usec;
+        std::vector<std::uint8_t> reply;
+
+        switch (frame[0]) {
+            case IceFunCommands::GET_VER:
+                reply = {38, BOARD_VERSION};
+                break;
+
+            case IceFunCommands::RESET_FPGA:
+                _released = false;
+                busy_usec += _timings.reset_usec;
+                reply = {
+                    (std::uint8_t)FLASH_ID,
+                    (std::uint8_t)(FLASH_ID >> 8),
+                    (std::uint8_t)(FLASH_ID >> 16)};
+                break;
+
+            case IceFunCommands::ERASE_CHIP:
+                std::fill(_flash.begin(), _flash.end(), 0xff);
+                busy_usec += _timings.erase_chip_usec;
+                reply = {0};
+                break;
+
+            case IceFunCommands::ERASE_64k: {
+                const auto sector_addr = ((std::uint32_t)frame[1] << SECTOR_SHIFT)
+                    % MAX_FLASH_SIZE_BYTES;
+                std::fill_n(
+                    _flash.begin() + sector_addr,
+                    SECTOR_SIZE_BYTES,
+                    0xff);
+                busy_usec += _timings.erase_64k_usec;
+                reply = {0};
+                break;
+            }
+
+            case IceFunCommands::PROG_PAGE: {
+                const auto page = frame + COMMAND_HEADER_SIZE_BYTES;
+                for (auto idx = 0u; idx < PAGE_SIZE_BYTES; ++idx) {
+                    flash_at(addr, idx) &= page[idx];
+                }
+                busy_usec +=
+                    _timings.spi_page_usec + _timings.program_page_usec;
+                reply = compare_page(addr, page);
+                break;
+            }
+
+            case IceFunCommands::READ_PAGE:
+                reply.resize(PAGE_SIZE_BYTES);
+                for (auto idx = 0u; idx < PAGE_SIZE_BYTES; ++idx) {
+                    reply[idx] = _flash[(addr + idx) % MAX_FLASH_SIZE_BYTES];
+                }
+                busy_usec += _timings.spi_page_usec;
+                break;
+
+            case IceFunCommands::VERIFY_PAGE:
+                busy_usec += _timings.spi_page_usec;
+                reply = compare_page(addr, frame + COMMAND_HEADER_SIZE_BYTES);
+                break;
+
+            case IceFunCommands::GET_CDONE:
+                reply = {(std::uint8_t)(_released ? 1 : 0)};
+                break;
+
+            case IceFunCommands::RELEASE_FPGA:
+                _released = true;
+                busy_usec += _timings.release_usec;
+                reply = {0};
+                break;
+
+            default:
+                // Ignored by the firmware
+                return;
+        }
+
+        if (_timings.stall_every
+            && ++_replies_sent % _timings.stall_every == 0) {
+            _stalled = true;
+            return;
+        }
+
+        _busy_until = std::max(arrival, _busy_until)
+            + std::chrono::microseconds(busy_usec);
+        _in_free = std::max(_busy_until, _in_free) + bus_time(reply.size())
+            + std::chrono::microseconds(_timings.transfer_usec);
+        _replies.push_back({std::move(reply), 0, _in_free});
+    }
+
+    std::string _serial;
+    SimTimings _timings;
+    std::vector<std::uint8_t> _flash;
+    bool _released {};
+    bool _stalled {};
+    std::uint64_t _replies_sent {};
+
+    // Bytes of the incomplete command sent last
+    std::vector<std::uint8_t> _input;
+    std::deque<Reply> _replies;
+    std::deque<Submitted> _submitted;
+
+    // When the OUT and IN pipes and the board get free
+    Clock::time_point _out_free;
+    Clock::time_point _in_free;
+    Clock::time_point _busy_until;
+};
+
+#endif
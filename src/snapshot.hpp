@@ -0,0 +1,327 @@
+#ifndef __SNAPSHOT_HPP__
+#define __SNAPSHOT_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "pageops.hpp"
+#include "sha256.hpp"
+
+// A directory of chunks of flash contents, each stored once in a file named
+// after its SHA-256: <dir>/<first two hex digits>/<hex digest>
+class SnapshotStore {
+  public:
+    explicit SnapshotStore(std::string dir) : _dir(std::move(dir)) {
+        make_dir(_dir);
+    }
+
+    // Stores the chunk unless it is there already, returns its digest and
+    // whether it was stored
+    std::pair<Sha256::Digest, bool>
+    put(const std::uint8_t* data, std::size_t size) {
+        const auto digest = Sha256::hash(data, size);
+        const auto path = chunk_path(digest);
+
+        struct stat st {};
+        if (stat(path.c_str(), &st) == 0 && (std::size_t)st.st_size == size) {
+            return {digest, false};
+        }
+
+        make_dir(path.substr(0, path.find_last_of('/')));
+
+        // Written aside under a name of its own and renamed once on the disk,
+        // so that a chunk is either whole or missing, also with several
+        // readers storing into the directory at once
+        auto tmp_path = path + ".XXXXXX";
+        const auto fd = mkstemp(tmp_path.data());
+        if (fd < 0) {
+            throw std::runtime_error(
+                "Cannot create '" + tmp_path + "': " + strerror(errno));
+        }
+
+        std::size_t written = 0;
+        while (written < size) {
+            const auto ret = ::write(fd, data + written, size - written);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                break;
+            }
+            written += ret;
+        }
+        const auto saved =
+            written == size && fchmod(fd, 0644) == 0 && fsync(fd) == 0;
+        const auto err = errno;
+        close(fd);
+        if (!saved) {
+            unlink(tmp_path.c_str());
+            throw std::runtime_error(
+                "Cannot write '" + tmp_path + "': " + strerror(err));
+        }
+
+        if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+            const auto err = errno;
+            unlink(tmp_path.c_str());
+            throw std::runtime_error(
+                "Cannot rename '" + tmp_path + "': " + strerror(err));
+        }
+
+        return {digest, true};
+    }
+
+    // Reads the chunk back, checking its digest
+    std::vector<std::uint8_t> get(const Sha256::Digest& digest) const {
+        const auto path = chunk_path(digest);
+        std::ifstream f(path, std::ios::in | std::ios::binary);
+        if (!f) {
+            throw std::runtime_error("Chunk '" + path + "' is missing");
+        }
+
+        std::vector<std::uint8_t> data(
+            (std::istreambuf_iterator<char>(f)),
+            std::istreambuf_iterator<char>());
+        if (Sha256::hash(data.data(), data.size()) != digest) {
+            throw std::runtime_error("Chunk '" + path + "' is corrupted");
+        }
+        return data;
+    }
+
+  private:
+    std::string chunk_path(const Sha256::Digest& digest) const {
+        const auto hex = Sha256::to_string(digest);
+        return _dir + "/" + hex.substr(0, 2) + "/" + hex;
+    }
+
+    static void make_dir(const std::string& path) {
+        if (mkdir(path.c_str(), 0755) < 0 && errno != EEXIST) {
+            throw std::runtime_error(
+                "Cannot create '" + path + "': " + strerror(errno));
+        }
+    }
+
+    std::string _dir;
+};
+
+// What a board's flash held when read: a text manifest listing the digests
+// of its chunks in the store, with the blank chunks, holding only 0xff,
+// listed as such and not stored.
+struct Snapshot {
+    static constexpr std::uint32_t CHUNK_SIZE = 4096;
+
+    std::string serial;
+    std::uint32_t flash_id {};
+    std::uint32_t offset {};
+    std::uint32_t size {};
+    std::uint32_t chunk_size {CHUNK_SIZE};
+    // Empty for the blank chunks
+    std::vector<std::optional<Sha256::Digest>> chunks;
+
+    std::uint32_t chunk_bytes(std::size_t chunk_idx) const {
+        return std::min<std::uint32_t>(
+            chunk_size,
+            size - chunk_idx * chunk_size);
+    }
+
+    void save(const std::string& path) const {
+        FILE* f = fopen(path.c_str(), "w");
+        if (!f) {
+            throw std::runtime_error(
+                "Cannot open '" + path + "': " + strerror(errno));
+        }
+
+        fprintf(f, "%s %u\n", MAGIC, FORMAT_VERSION);
+        fprintf(f, "serial %s\n", serial.c_str());
+        fprintf(f, "flash_id %#x\n", flash_id);
+        fprintf(f, "offset %#x\n", offset);
+        fprintf(f, "size %#x\n", size);
+        fprintf(f, "chunk_size %#x\n", chunk_size);
+        for (const auto& chunk : chunks) {
+            fprintf(f, "%s\n", chunk ? Sha256::to_string(*chunk).c_str() : BLANK);
+        }
+
+        const auto ok = !ferror(f);
+        if (fclose(f) != 0 || !ok) {
+            throw std::runtime_error("Cannot write '" + path + "'");
+        }
+    }
+
+    static Snapshot load(const std::string& path) {
+        std::ifstream f(path);
+        if (!f) {
+            throw std::runtime_error("Cannot open '" + path + "'");
+        }
+
+        const auto error = [&](const char* what) {
+            return std::runtime_error("'" + path + "': " + what);
+        };
+
+        Snapshot snapshot;
+        std::string magic;
+        std::uint32_t version = 0;
+        if (!(f >> magic >> version) || magic != MAGIC
+            || version != FORMAT_VERSION) {
+            throw error("Not a snapshot manifest");
+        }
+
+        std::string key;
+        std::string value;
+        for (const auto field : {"serial", "flash_id", "offset", "size", "chunk_size"}) {
+            if (!(f >> key) || key != field) {
+                throw error("Malformed header");
+            }
+            if (key == "serial") {
+                // The rest of the line, it may have spaces
+                std::getline(f, value);
+                snapshot.serial = value.empty() ? value : value.substr(1);
+            } else {
+                f >> value;
+                const auto number = strtoul(value.c_str(), nullptr, 0);
+                (key == "flash_id"     ? snapshot.flash_id
+                 : key == "offset"     ? snapshot.offset
+                 : key == "size"       ? snapshot.size
+                                       : snapshot.chunk_size) = number;
+            }
+        }
+        if (!snapshot.chunk_size) {
+            throw error("Malformed header");
+        }
+
+        std::string line;
+        while (f >> line) {
+            if (line == BLANK) {
+                snapshot.chunks.emplace_back();
+                continue;
+            }
+
+            Sha256::Digest digest {};
+            if (line.size() != digest.size() * 2) {
+                throw error("Malformed chunk digest");
+            }
+            for (std::size_t idx = 0; idx < digest.size(); ++idx) {
+                char* end_ptr = nullptr;
+                const auto byte = line.substr(idx * 2, 2);
+                digest[idx] = strtoul(byte.c_str(), &end_ptr, 16);
+                if (*end_ptr != '\0') {
+                    throw error("Malformed chunk digest");
+                }
+            }
+            snapshot.chunks.emplace_back(digest);
+        }
+
+        const auto chunk_count =
+            (snapshot.size + snapshot.chunk_size - 1) / snapshot.chunk_size;
+        if (snapshot.chunks.size() != chunk_count) {
+            throw error("Chunks are missing");
+        }
+
+        return snapshot;
+    }
+
+  private:
+    static constexpr const char* MAGIC = "iceFUNprog2-snapshot";
+    static constexpr std::uint32_t FORMAT_VERSION = 1;
+    static constexpr const char* BLANK = "blank";
+};
+
+// Splits what is read from the flash into chunks as it arrives, and puts the
+// non-blank ones into the store
+class SnapshotWriter {
+  public:
+    SnapshotWriter(
+        SnapshotStore& store,
+        std::string serial,
+        std::uint32_t flash_id,
+        std::uint32_t offset,
+        std::uint32_t size) :
+        _store(store) {
+        _snapshot.serial = std::move(serial);
+        _snapshot.flash_id = flash_id;
+        _snapshot.offset = offset;
+        _snapshot.size = size;
+        _chunk.reserve(_snapshot.chunk_size);
+    }
+
+    void add(const std::uint8_t* data, std::size_t size) {
+        while (size) {
+            const auto this_time =
+                std::min<std::size_t>(size, _snapshot.chunk_size - _chunk.size());
+            _chunk.insert(_chunk.end(), data, data + this_time);
+            data += this_time;
+            size -= this_time;
+            if (_chunk.size() == _snapshot.chunk_size) {
+                flush();
+            }
+        }
+    }
+
+    // Takes the last, partial, chunk
+    const Snapshot& finish() {
+        if (!_chunk.empty()) {
+            flush();
+        }
+        return _snapshot;
+    }
+
+    std::uint32_t stored_chunks() const {
+        return _stored;
+    }
+
+    std::uint32_t known_chunks() const {
+        return _known;
+    }
+
+    std::uint32_t blank_chunks() const {
+        return _blank;
+    }
+
+  private:
+    void flush() {
+        if (page_blank(_chunk.data(), _chunk.size())) {
+            _snapshot.chunks.emplace_back();
+            ++_blank;
+        } else {
+            const auto [digest, stored] = _store.put(_chunk.data(), _chunk.size());
+            _snapshot.chunks.emplace_back(digest);
+            ++(stored ? _stored : _known);
+        }
+        _chunk.clear();
+    }
+
+    SnapshotStore& _store;
+    Snapshot _snapshot;
+    std::vector<std::uint8_t> _chunk;
+    std::uint32_t _stored {};
+    std::uint32_t _known {};
+    std::uint32_t _blank {};
+};
+
+#endif
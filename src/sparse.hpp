@@ -0,0 +1,356 @@
+#ifndef __SPARSE_HPP__
+#define __SPARSE_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "icefun.hpp"
+
+// A populated piece of a sparse image, at its address in the flash
+struct ImageExtent {
+    std::uint64_t addr {};
+    const std::uint8_t* data {};
+    std::uint32_t size {};
+};
+
+enum class ImageFormat {
+    RAW,
+    IHEX,
+    ELF,
+    ANDROID_SPARSE,
+};
+
+inline const char* image_format_name(ImageFormat format) {
+    switch (format) {
+        case ImageFormat::RAW:
+            return "raw";
+        case ImageFormat::IHEX:
+            return "Intel HEX";
+        case ImageFormat::ELF:
+            return "ELF";
+        case ImageFormat::ANDROID_SPARSE:
+            return "Android sparse";
+    }
+    return "unknown";
+}
+
+// Tells the sparse images by their magic numbers. The Intel HEX files start
+// with a record.
+inline ImageFormat
+detect_image_format(const std::uint8_t* data, std::size_t size) {
+    if (size >= 4 && !memcmp(data, "\x7f" "ELF", 4)) {
+        return ImageFormat::ELF;
+    }
+    if (size >= 4 && data[0] == 0x3a && data[1] == 0xff && data[2] == 0x26
+        && data[3] == 0xed) {
+        return ImageFormat::ANDROID_SPARSE;
+    }
+    if (size >= 11 && data[0] == ':' && isxdigit(data[1]) && isxdigit(data[2])) {
+        return ImageFormat::IHEX;
+    }
+    return ImageFormat::RAW;
+}
+
+// The populated extents of a sparse image, in the order of the file. They
+// point into the file data where it holds them as they are, and into
+// `buffers` otherwise. The holes are not looked at.
+struct SparseImage {
+    std::vector<ImageExtent> extents;
+    std::deque<std::vector<std::uint8_t>> buffers;
+
+    static SparseImage
+    parse(ImageFormat format, const std::uint8_t* data, std::size_t size) {
+        switch (format) {
+            case ImageFormat::IHEX:
+                return parse_ihex(data, size);
+            case ImageFormat::ELF:
+                return parse_elf(data, size);
+            case ImageFormat::ANDROID_SPARSE:
+                return parse_android_sparse(data, size);
+            case ImageFormat::RAW:
+                break;
+        }
+        throw std::logic_error("Not a sparse image");
+    }
+
+    // The data records go into buffers, the adjacent ones into the same
+    static SparseImage parse_ihex(const std::uint8_t* data, std::size_t size) {
+        SparseImage image;
+
+        std::uint64_t base = 0;
+        std::uint64_t end = 0;
+        std::size_t line_no = 1;
+        std::size_t pos = 0;
+
+        const auto error = [&](const char* what) {
+            return std::runtime_error(
+                "Line " + std::to_string(line_no) + " of the Intel HEX file: "
+                + what);
+        };
+
+        while (pos < size) {
+            while (pos < size && isspace(data[pos])) {
+                line_no += data[pos] == '\n';
+                ++pos;
+            }
+            if (pos == size) {
+                break;
+            }
+            if (data[pos] != ':') {
+                throw error("Expected a record");
+            }
+            ++pos;
+
+            std::uint8_t record[255 + 5];
+            std::size_t record_size = 0;
+            std::uint8_t checksum = 0;
+            while (pos + 1 < size && isxdigit(data[pos]) && isxdigit(data[pos + 1])) {
+                if (record_size == sizeof(record)) {
+                    throw error("The record is too long");
+                }
+                record[record_size] = hex_digit(data[pos]) << 4 | hex_digit(data[pos + 1]);
+                checksum += record[record_size++];
+                pos += 2;
+            }
+            if (record_size < 5 || record_size != record[0] + 5u) {
+                throw error("Malformed record");
+            }
+            if (checksum) {
+                throw error("Checksum mismatch");
+            }
+
+            const auto count = record[0];
+            const std::uint32_t addr = record[1] << 8 | record[2];
+            const auto* payload = record + 4;
+            switch (record[3]) {
+                case 0x00: {
+                    const auto data_addr = base + addr;
+                    if (image.extents.empty() || data_addr != end) {
+                        image.buffers.emplace_back();
+                        image.extents.push_back({data_addr, nullptr, 0});
+                    }
+                    auto& buffer = image.buffers.back();
+                    buffer.insert(buffer.end(), payload, payload + count);
+                    image.extents.back().size = buffer.size();
+                    end = data_addr + count;
+                    break;
+                }
+                case 0x01:
+                    pos = size;
+                    break;
+                case 0x02:
+                    if (count != 2) {
+                        throw error("Malformed extended segment address");
+                    }
+                    base = (payload[0] << 8 | payload[1]) << 4;
+                    break;
+                case 0x04:
+                    if (count != 2) {
+                        throw error("Malformed extended linear address");
+                    }
+                    base = std::uint64_t(payload[0] << 8 | payload[1]) << 16;
+                    break;
+                case 0x03:
+                case 0x05:
+                    // Start addresses
+                    break;
+                default:
+                    throw error("Unknown record type");
+            }
+        }
+
+        // The buffers do not move once filled
+        for (std::size_t idx = 0; idx < image.extents.size(); ++idx) {
+            image.extents[idx].data = image.buffers[idx].data();
+        }
+
+        return image;
+    }
+
+    // The loadable segments at their physical addresses, pointing into the
+    // file. The segments taking no space in the file are left out.
+    static SparseImage parse_elf(const std::uint8_t* data, std::size_t size) {
+        constexpr std::uint32_t PT_LOAD = 1;
+
+        if (size < 0x34 || data[6] != 1) {
+            throw std::runtime_error("Malformed ELF header");
+        }
+        const auto is_64 = data[4] == 2;
+        const auto is_le = data[5] == 1;
+        if ((data[4] != 1 && !is_64) || (data[5] != 1 && data[5] != 2)
+            || (is_64 && size < 0x40)) {
+            throw std::runtime_error("Malformed ELF header");
+        }
+
+        const auto read = [&](std::size_t pos, std::size_t bytes) {
+            if (pos + bytes > size) {
+                throw std::runtime_error("The ELF file is truncated");
+            }
+            std::uint64_t value = 0;
+            for (std::size_t idx = 0; idx < bytes; ++idx) {
+                const auto byte = data[pos + (is_le ? bytes - 1 - idx : idx)];
+                value = value << 8 | byte;
+            }
+            return value;
+        };
+        const auto word = is_64 ? 8 : 4;
+
+        const auto phoff = read(is_64 ? 0x20 : 0x1c, word);
+        const auto phentsize = read(is_64 ? 0x36 : 0x2a, 2);
+        const auto phnum = read(is_64 ? 0x38 : 0x2c, 2);
+
+        SparseImage image;
+        for (std::uint64_t idx = 0; idx < phnum; ++idx) {
+            const auto ph = phoff + idx * phentsize;
+            if (read(ph, 4) != PT_LOAD) {
+                continue;
+            }
+
+            const auto offset = read(ph + (is_64 ? 0x08 : 0x04), word);
+            const auto paddr = read(ph + (is_64 ? 0x18 : 0x0c), word);
+            const auto filesz = read(ph + (is_64 ? 0x20 : 0x10), word);
+            if (!filesz) {
+                continue;
+            }
+            if (offset > size || filesz > size - offset || filesz > UINT32_MAX) {
+                throw std::runtime_error("An ELF segment lies past the end of the file");
+            }
+
+            image.extents.push_back({paddr, data + offset, (std::uint32_t)filesz});
+        }
+
+        return image;
+    }
+
+    // The raw chunks point into the file, the fills get a page of their
+    // pattern each, and the fills of 0xff are holes. The checksum chunks are
+    // skipped, as the pages are verified anyway.
+    static SparseImage
+    parse_android_sparse(const std::uint8_t* data, std::size_t size) {
+        constexpr std::uint16_t CHUNK_RAW = 0xcac1;
+        constexpr std::uint16_t CHUNK_FILL = 0xcac2;
+        constexpr std::uint16_t CHUNK_DONT_CARE = 0xcac3;
+        constexpr std::uint16_t CHUNK_CRC32 = 0xcac4;
+
+        const auto read = [&](std::size_t pos, std::size_t bytes) {
+            if (pos + bytes > size) {
+                throw std::runtime_error("The sparse image is truncated");
+            }
+            std::uint32_t value = 0;
+            for (std::size_t idx = 0; idx < bytes; ++idx) {
+                value |= std::uint32_t(data[pos + idx]) << (8 * idx);
+            }
+            return value;
+        };
+
+        if (read(4, 2) != 1) {
+            throw std::runtime_error("Unsupported sparse image version");
+        }
+        const auto header_size = read(8, 2);
+        const auto chunk_header_size = read(10, 2);
+        const auto block_size = read(12, 4);
+        const auto chunk_count = read(20, 4);
+        if (chunk_header_size < 12 || block_size == 0 || block_size % 4) {
+            throw std::runtime_error("Malformed sparse image header");
+        }
+
+        SparseImage image;
+        std::uint64_t addr = 0;
+        std::size_t pos = header_size;
+        for (std::uint32_t chunk = 0; chunk < chunk_count; ++chunk) {
+            const auto type = read(pos, 2);
+            const auto chunk_size = std::uint64_t(read(pos + 4, 4)) * block_size;
+            const auto total_size = read(pos + 8, 4);
+            const auto body = pos + chunk_header_size;
+            if (total_size < chunk_header_size || total_size > size - pos) {
+                throw std::runtime_error("Malformed sparse image chunk");
+            }
+
+            switch (type) {
+                case CHUNK_RAW:
+                    if (total_size - chunk_header_size != chunk_size
+                        || chunk_size > UINT32_MAX) {
+                        throw std::runtime_error("Malformed sparse image chunk");
+                    }
+                    image.extents.push_back(
+                        {addr, data + body, (std::uint32_t)chunk_size});
+                    break;
+
+                case CHUNK_FILL: {
+                    if (chunk_size > UINT32_MAX) {
+                        throw std::runtime_error("Malformed sparse image chunk");
+                    }
+                    std::uint8_t pattern[4];
+                    for (auto idx = 0; idx < 4; ++idx) {
+                        pattern[idx] = read(body + idx, 1);
+                    }
+
+                    // The erased flash reads as 0xff already
+                    if (pattern[0] == 0xff && pattern[1] == 0xff
+                        && pattern[2] == 0xff && pattern[3] == 0xff) {
+                        break;
+                    }
+
+                    // A page of the pattern backs all the pages of the fill
+                    auto& buffer = image.buffers.emplace_back(
+                        std::min<std::uint64_t>(chunk_size, PAGE_SIZE_BYTES));
+                    for (std::size_t idx = 0; idx < buffer.size(); ++idx) {
+                        buffer[idx] = pattern[idx % 4];
+                    }
+                    for (std::uint64_t piece = 0; piece < chunk_size;
+                         piece += buffer.size()) {
+                        image.extents.push_back(
+                            {addr + piece,
+                             buffer.data(),
+                             (std::uint32_t)std::min<std::uint64_t>(
+                                 chunk_size - piece,
+                                 buffer.size())});
+                    }
+                    break;
+                }
+
+                case CHUNK_DONT_CARE:
+                case CHUNK_CRC32:
+                    break;
+
+                default:
+                    throw std::runtime_error("Unknown sparse image chunk");
+            }
+
+            if (type != CHUNK_CRC32) {
+                addr += chunk_size;
+            }
+            pos += total_size;
+        }
+
+        return image;
+    }
+
+  private:
+    static std::uint8_t hex_digit(std::uint8_t c) {
+        return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+    }
+};
+
+#endif
@@ -0,0 +1,482 @@
+#ifndef __TRACE_HPP__
+#define __TRACE_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "icefun.hpp"
+#include "transport.hpp"
+
+// Tracing of the hot paths. The spans go to a preallocated ring buffer,
+// keeping the latest ones when it wraps, and the command latencies go to
+// log-linear histograms. Both are dumped at exit: the spans as a
+// Chrome/Perfetto trace, the histograms as a table. Until Trace::enable() is
+// called, a span costs a test of a flag.
+class Trace {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr std::size_t DEFAULT_CAPACITY = 1 << 20;
+
+    static void enable(std::size_t capacity = DEFAULT_CAPACITY) {
+        _instance.reset(new Trace(capacity));
+        _enabled = true;
+    }
+
+    static bool enabled() {
+        return _enabled;
+    }
+
+    static Trace& get() {
+        return *_instance;
+    }
+
+    static std::uint64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   Clock::now().time_since_epoch())
+            .count();
+    }
+
+    // `name` and `category` must be string literals, only the pointers are
+    // kept
+    void span(
+        const char* name,
+        const char* category,
+        std::uint64_t start_ns,
+        std::uint64_t end_ns,
+        std::uint64_t arg = 0) {
+        auto& event = _events[_next++ % _events.size()];
+        event.name = name;
+        event.category = category;
+        event.start_ns = start_ns;
+        event.duration_ns = end_ns - start_ns;
+        event.arg = arg;
+        event.tid = thread_id();
+    }
+
+    // Latency of an exchange of the command, from sending the command to
+    // receiving its reply
+    void latency(std::uint8_t cmd, std::uint64_t duration_ns) {
+        const auto cmd_idx = std::uint8_t(cmd - IceFunCommands::DONE);
+        auto& histogram = _histograms[cmd_idx < COMMAND_COUNT ? cmd_idx : 0];
+        ++histogram[bucket(duration_ns / 1000)];
+    }
+
+    void write_chrome_trace(const std::string& path) const {
+        const auto f = fopen(path.c_str(), "w");
+        if (!f) {
+            throw std::runtime_error("Cannot open '" + path + "'");
+        }
+
+        const std::size_t count =
+            std::min<std::size_t>(_next, _events.size());
+        const std::size_t first = _next - count;
+
+        fprintf(f, "{\"traceEvents\": [");
+        for (std::size_t idx = 0; idx < count; ++idx) {
+            const auto& event = _events[(first + idx) % _events.size()];
+            fprintf(
+                f,
+                "%s\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+                "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %u, "
+                "\"args\": {\"value\": %llu}}",
+                idx ? "," : "",
+                event.name,
+                event.category,
+                (event.start_ns - _start_ns) / 1e3,
+                event.duration_ns / 1e3,
+                event.tid,
+                (unsigned long long)event.arg);
+        }
+        fprintf(f, "\n], \"displayTimeUnit\": \"ms\"}\n");
+        fclose(f);
+    }
+
+    // Count and percentiles of the latency of every command seen, the values
+    // are within 1/8 of the measured ones
+    void print_histograms(FILE* f) const {
+        static const char* names[COMMAND_COUNT] = {
+            "DONE",
+            "GET_VER",
+            "RESET_FPGA",
+            "ERASE_CHIP",
+            "ERASE_64k",
+            "PROG_PAGE",
+            "READ_PAGE",
+            "VERIFY_PAGE",
+            "GET_CDONE",
+            "RELEASE_FPGA"};
+
+        fprintf(
+            f,
+            "%-14s %9s %10s %10s %10s %10s %10s (usec)\n",
+            "Command",
+            "count",
+            "p50",
+            "p90",
+            "p99",
+            "p99.9",
+            "max");
+        for (auto cmd_idx = 0u; cmd_idx < COMMAND_COUNT; ++cmd_idx) {
+            const auto& histogram = _histograms[cmd_idx];
+
+            std::uint64_t count = 0;
+            for (const auto& bucket_count : histogram) {
+                count += bucket_count;
+            }
+            if (!count) {
+                continue;
+            }
+
+            fprintf(
+                f,
+                "%-14s %9llu %10llu %10llu %10llu %10llu %10llu\n",
+                names[cmd_idx],
+                (unsigned long long)count,
+                (unsigned long long)percentile(histogram, count, 500),
+                (unsigned long long)percentile(histogram, count, 900),
+                (unsigned long long)percentile(histogram, count, 990),
+                (unsigned long long)percentile(histogram, count, 999),
+                (unsigned long long)percentile(histogram, count, 1000));
+        }
+    }
+
+  private:
+    static constexpr std::size_t COMMAND_COUNT = 10;
+
+    // Eight linear sub-buckets per power of two
+    static constexpr unsigned SUB_BITS = 3;
+    static constexpr std::size_t BUCKET_COUNT =
+        (64 - SUB_BITS + 1) << SUB_BITS;
+
+    struct Event {
+        const char* name;
+        const char* category;
+        std::uint64_t start_ns;
+        std::uint64_t duration_ns;
+        std::uint64_t arg;
+        std::uint32_t tid;
+    };
+
+    using Histogram = std::vector<std::atomic<std::uint64_t>>;
+
+    explicit Trace(std::size_t capacity) :
+        _events(capacity),
+        _start_ns(now_ns()) {
+        for (auto& histogram : _histograms) {
+            histogram = Histogram(BUCKET_COUNT);
+        }
+    }
+
+    static std::uint32_t thread_id() {
+        static std::atomic<std::uint32_t> next {1};
+        thread_local const std::uint32_t tid = next++;
+        return tid;
+    }
+
+    static std::size_t bucket(std::uint64_t value) {
+        if (value < (1u << SUB_BITS)) {
+            return value;
+        }
+        const unsigned msb = 63 - __builtin_clzll(value);
+        const auto shift = msb - SUB_BITS;
+        return ((shift + 1) << SUB_BITS)
+            + ((value >> shift) & ((1u << SUB_BITS) - 1));
+    }
+
+    // The highest value that falls into the bucket
+    static std::uint64_t bucket_value(std::size_t bucket_idx) {
+        if (bucket_idx < (1u << SUB_BITS)) {
+            return bucket_idx;
+        }
+        const auto shift = (bucket_idx >> SUB_BITS) - 1;
+        const auto sub = bucket_idx & ((1u << SUB_BITS) - 1);
+        return (((1ull << SUB_BITS) + sub + 1) << shift) - 1;
+    }
+
+    // `per_mille` of the samples are at or below the result
+    static std::uint64_t percentile(
+        const Histogram& histogram,
+        std::uint64_t count,
+        unsigned per_mille) {
+        const auto rank =
+            std::max<std::uint64_t>(1, (count * per_mille + 999) / 1000);
+
+        std::uint64_t seen = 0;
+        for (std::size_t bucket_idx = 0; bucket_idx < histogram.size();
+             ++bucket_idx) {
+            seen += histogram[bucket_idx];
+            if (seen >= rank) {
+                return bucket_value(bucket_idx);
+            }
+        }
+        return 0;
+    }
+
+    std::vector<Event> _events;
+    std::atomic<std::uint64_t> _next {};
+    std::uint64_t _start_ns;
+    Histogram _histograms[COMMAND_COUNT];
+
+    static inline std::unique_ptr<Trace> _instance;
+    static inline bool _enabled {};
+};
+
+// Records the scope as a span when tracing is enabled
+class TraceSpan {
+  public:
+    TraceSpan(const char* name, const char* category, std::uint64_t arg = 0) :
+        _name(name),
+        _category(category),
+        _arg(arg),
+        _start_ns(Trace::enabled() ? Trace::now_ns() : 0) {
+    }
+
+    ~TraceSpan() {
+        end();
+    }
+
+    // Ends the span before the end of the scope
+    void end() {
+        if (Trace::enabled() && _name) {
+            Trace::get()
+                .span(_name, _category, _start_ns, Trace::now_ns(), _arg);
+            _name = nullptr;
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+  private:
+    const char* _name;
+    const char* _category;
+    std::uint64_t _arg;
+    std::uint64_t _start_ns;
+};
+
+// Wraps the transport of a board to trace its traffic: a span for every
+// send and receive, and the latency of every command. Only put in place
+// when tracing is enabled, so that the untraced runs do not pay for it.
+class TracingTransport : public Transport {
+  public:
+    explicit TracingTransport(std::shared_ptr<Transport> inner) :
+        _inner(std::move(inner)) {
+    }
+
+    std::size_t send(
+        const std::uint8_t* data,
+        std::size_t size,
+        int timeout_msec = 0) override {
+        const auto start_ns = Trace::now_ns();
+        const auto sent = _inner->send(data, size, timeout_msec);
+        Trace::get().span("usb_out", "usb", start_ns, Trace::now_ns(), sent);
+
+        // The reply received next belongs to this command
+        if (size) {
+            _cmd = data[0];
+            _cmd_start_ns = start_ns;
+        }
+        return sent;
+    }
+
+    std::size_t receive(
+        std::uint8_t* data,
+        std::size_t size,
+        int timeout_msec = 0) override {
+        const auto start_ns = Trace::now_ns();
+        const auto received = _inner->receive(data, size, timeout_msec);
+        const auto end_ns = Trace::now_ns();
+        Trace::get().span("usb_in", "usb", start_ns, end_ns, received);
+
+        if (_cmd_start_ns) {
+            Trace::get().latency(_cmd, end_ns - _cmd_start_ns);
+            _cmd_start_ns = 0;
+        }
+        return received;
+    }
+
+    const std::string& serial() const override {
+        return _inner->serial();
+    }
+
+    std::string location() const override {
+        return _inner->location();
+    }
+
+    // A batch counts as one exchange of its first command
+    std::size_t transact(
+        const std::uint8_t* frames,
+        std::size_t frames_size,
+        std::uint8_t* replies,
+        std::size_t replies_size,
+        int timeout_msec = 0) override {
+        const auto start_ns = Trace::now_ns();
+        const auto received = _inner->transact(
+            frames,
+            frames_size,
+            replies,
+            replies_size,
+            timeout_msec);
+        const auto end_ns = Trace::now_ns();
+
+        Trace::get().span("transact", "usb", start_ns, end_ns, frames_size);
+        if (frames_size) {
+            Trace::get().latency(frames[0], end_ns - start_ns);
+        }
+        return received;
+    }
+
+    // Every exchange is timed from composing its command to checking its
+    // reply, which includes the time spent queued behind the others
+    std::size_t pipeline(
+        std::size_t count,
+        std::uint16_t header_size,
+        std::uint16_t payload_size,
+        std::uint16_t reply_size,
+        const FillFrame& fill,
+        const CheckReply& check,
+        std::size_t depth) override {
+        struct Pending {
+            std::uint8_t cmd;
+            std::uint64_t start_ns;
+        };
+        std::vector<Pending> pending(std::max<std::size_t>(depth, 1));
+
+        const auto start_ns = Trace::now_ns();
+        const auto completed = _inner->pipeline(
+            count,
+            header_size,
+            payload_size,
+            reply_size,
+            [&](std::size_t idx, std::uint8_t* frame) {
+                const auto payload = fill(idx, frame);
+                pending[idx % pending.size()] = {frame[0], Trace::now_ns()};
+                return payload;
+            },
+            [&](std::size_t idx, const std::uint8_t* reply) {
+                const auto& exchange = pending[idx % pending.size()];
+                const auto end_ns = Trace::now_ns();
+                Trace::get().span(
+                    "exchange",
+                    "command",
+                    exchange.start_ns,
+                    end_ns,
+                    exchange.cmd);
+                Trace::get().latency(exchange.cmd, end_ns - exchange.start_ns);
+                return check(idx, reply);
+            },
+            depth);
+        Trace::get().span("pipeline", "usb", start_ns, Trace::now_ns(), count);
+
+        return completed;
+    }
+
+    // Timed from the submission to the completion, like in pipeline()
+    void submit(
+        const std::uint8_t* header,
+        std::uint16_t header_size,
+        const std::uint8_t* payload,
+        std::uint16_t payload_size,
+        std::uint8_t* reply,
+        std::uint16_t reply_size,
+        Completion done,
+        int timeout_msec = 0) override {
+        const auto cmd = header_size ? header[0] : std::uint8_t(0);
+        const auto start_ns = Trace::now_ns();
+        _inner->submit(
+            header,
+            header_size,
+            payload,
+            payload_size,
+            reply,
+            reply_size,
+            [cmd, start_ns, done = std::move(done)](bool ok) {
+                const auto end_ns = Trace::now_ns();
+                Trace::get().span("exchange", "command", start_ns, end_ns, cmd);
+                Trace::get().latency(cmd, end_ns - start_ns);
+                done(ok);
+            },
+            timeout_msec);
+    }
+
+    void poll(int timeout_msec) override {
+        _inner->poll(timeout_msec);
+    }
+
+    void cancel() override {
+        _inner->cancel();
+    }
+
+    bool resync() override {
+        const auto start_ns = Trace::now_ns();
+        const auto ok = _inner->resync();
+        Trace::get().span("resync", "usb", start_ns, Trace::now_ns(), ok);
+        return ok;
+    }
+
+  private:
+    std::shared_ptr<Transport> _inner;
+    std::uint8_t _cmd {};
+    std::uint64_t _cmd_start_ns {};
+};
+
+// The transport to use for the board: wrapped for tracing when enabled
+inline std::shared_ptr<Transport> traced(std::shared_ptr<Transport> dev) {
+    if (Trace::enabled()) {
+        return std::make_shared<TracingTransport>(std::move(dev));
+    }
+    return dev;
+}
+
+// Writes the trace to the file and prints the histograms when going out of
+// scope, if tracing is enabled
+class TraceDump {
+  public:
+    TraceDump(std::string path, FILE* histograms) :
+        _path(std::move(path)),
+        _histograms(histograms) {
+    }
+
+    ~TraceDump() {
+        if (!Trace::enabled()) {
+            return;
+        }
+
+        try {
+            Trace::get().write_chrome_trace(_path);
+        } catch (const std::exception& e) {
+            fprintf(_histograms, "Error: %s\n", e.what());
+        }
+        Trace::get().print_histograms(_histograms);
+    }
+
+    TraceDump(const TraceDump&) = delete;
+    TraceDump& operator=(const TraceDump&) = delete;
+
+  private:
+    std::string _path;
+    FILE* _histograms;
+};
+
+#endif
@@ -0,0 +1,244 @@
+#ifndef __TRANSPORT_HPP__
+#define __TRANSPORT_HPP__
+
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "icefun.hpp"
+
+// A byte pipe to a board: the USB device or a simulated one. The batched and
+// pipelined exchanges have straightforward implementations here in terms of
+// send() and receive(), the USB device replaces them with asynchronous ones.
+class Transport {
+  public:
+    // Composes the command frame of the given exchange, see pipeline()
+    using FillFrame =
+        std::function<const std::uint8_t*(std::size_t idx, std::uint8_t* frame)>;
+    // Inspects the reply of the given exchange, see pipeline()
+    using CheckReply =
+        std::function<bool(std::size_t idx, const std::uint8_t* reply)>;
+    // Told whether the exchange started with submit() went through
+    using Completion = std::function<void(bool ok)>;
+
+    virtual ~Transport() = default;
+
+    // Sends the buffer, returns the number of bytes sent. A zero timeout
+    // stands for the default one.
+    virtual std::size_t
+    send(const std::uint8_t* data, std::size_t size, int timeout_msec = 0) = 0;
+
+    // Receives into the buffer, returns the number of bytes received. A zero
+    // timeout stands for the default one.
+    virtual std::size_t
+    receive(std::uint8_t* data, std::size_t size, int timeout_msec = 0) = 0;
+
+    virtual const std::string& serial() const = 0;
+
+    virtual std::string location() const = 0;
+
+    std::uint16_t write(const std::uint8_t* data, std::uint16_t size) {
+        return send(data, size);
+    }
+
+    std::uint16_t
+    read(std::uint8_t* data, std::uint16_t size, int timeout_msec = 0) {
+        return receive(data, size, timeout_msec);
+    }
+
+    // Sends a batch of concatenated command frames and collects the
+    // concatenated replies. Returns the number of reply bytes received,
+    // `replies_size` when the whole batch went through.
+    virtual std::size_t transact(
+        const std::uint8_t* frames,
+        std::size_t frames_size,
+        std::uint8_t* replies,
+        std::size_t replies_size,
+        int timeout_msec = 0) {
+        const auto sent = send(frames, frames_size, timeout_msec);
+        if (sent != frames_size) {
+            keep_unsent(frames, frames_size, sent);
+            return 0;
+        }
+        return receive(replies, replies_size, timeout_msec);
+    }
+
+    // Runs `count` command/reply exchanges keeping up to `depth` of them in
+    // flight. A command frame is a header followed by an optional payload.
+    // `fill` composes the header of the given exchange and returns a pointer
+    // to its payload, which is sent straight from there and must stay valid
+    // until the exchange completes. When `fill` returns nullptr, it has
+    // composed the payload right after the header instead.
+    // `check` inspects the reply; replies are matched to commands in order.
+    // Stops at the first exchange that fails or is rejected by `check`, and
+    // returns the number of exchanges completed before it. The replies to
+    // the commands sent after a rejected one are received and dropped.
+    virtual std::size_t pipeline(
+        std::size_t count,
+        std::uint16_t header_size,
+        std::uint16_t payload_size,
+        std::uint16_t reply_size,
+        const FillFrame& fill,
+        const CheckReply& check,
+        std::size_t depth) {
+        std::vector<std::uint8_t> frame(header_size + payload_size);
+        std::vector<std::uint8_t> reply(reply_size);
+
+        depth = std::max(depth, std::size_t(1));
+
+        std::size_t submitted = 0;
+        std::size_t completed = 0;
+        while (completed < count) {
+            while (submitted < count && submitted - completed < depth) {
+                const auto payload = fill(submitted, frame.data());
+                if (payload
+                        ? !send_frame(
+                            frame.data(),
+                            header_size,
+                            payload,
+                            payload_size)
+                        : !send_frame(frame.data(), frame.size())) {
+                    return completed;
+                }
+                ++submitted;
+            }
+
+            if (receive(reply.data(), reply.size()) != reply.size()) {
+                break;
+            }
+            if (!check(completed, reply.data())) {
+                for (auto idx = completed + 1; idx < submitted; ++idx) {
+                    if (receive(reply.data(), reply.size()) != reply.size()) {
+                        break;
+                    }
+                }
+                break;
+            }
+            ++completed;
+        }
+
+        return completed;
+    }
+
+    // Starts an exchange: sends the header and the payload, when there is
+    // one, and receives `reply_size` bytes into `reply`. The buffers must
+    // stay valid until `done` is called, which may happen from submit() or
+    // from a later poll(). The exchanges complete in the order submitted.
+    // This one runs the exchange to the end before returning.
+    virtual void submit(
+        const std::uint8_t* header,
+        std::uint16_t header_size,
+        const std::uint8_t* payload,
+        std::uint16_t payload_size,
+        std::uint8_t* reply,
+        std::uint16_t reply_size,
+        Completion done,
+        int timeout_msec = 0) {
+        const auto ok =
+            send_frame(header, header_size, payload, payload_size, timeout_msec)
+            && receive(reply, reply_size, timeout_msec) == reply_size;
+        done(ok);
+    }
+
+    // Completes the submitted exchanges whose replies are in, waiting up to
+    // the timeout for one when none is
+    virtual void poll(int timeout_msec) {
+        (void)timeout_msec;
+    }
+
+    // Gives up on the submitted exchanges still in flight. They complete as
+    // failed, from cancel() or from a later poll().
+    virtual void cancel() {
+    }
+
+    // Gets back in step with the board after a failed exchange: completes
+    // the frame cut short, drops the replies still on their way and checks
+    // that the board answers GET_VER. Returns whether it does.
+    virtual bool resync() {
+        for (auto attempt = 0; attempt < RESYNC_ATTEMPTS; ++attempt) {
+            // The board takes the next bytes for the rest of the frame
+            if (!_unsent.empty()) {
+                const auto sent = send(_unsent.data(), _unsent.size());
+                _unsent.erase(_unsent.begin(), _unsent.begin() + sent);
+                if (!_unsent.empty()) {
+                    continue;
+                }
+            }
+
+            std::uint8_t stale[COMMAND_HEADER_SIZE_BYTES + PAGE_SIZE_BYTES];
+            while (receive(stale, sizeof(stale), RESYNC_QUIET_MSEC) != 0) {
+            }
+
+            const std::uint8_t cmd = IceFunCommands::GET_VER;
+            std::uint8_t reply[2] = {};
+            if (send(&cmd, 1) == 1 && receive(reply, 2) == 2 && reply[0] == 38) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+  protected:
+    // The board is taken to have sent all the stale replies once it has been
+    // quiet for longer than erasing a sector takes
+    static constexpr int RESYNC_QUIET_MSEC = 1000;
+    static constexpr int RESYNC_ATTEMPTS = 3;
+
+    // Sends the frame of a command, its header and payload. Returns whether
+    // the board took all of it, see keep_unsent() when it did not.
+    bool send_frame(
+        const std::uint8_t* header,
+        std::size_t header_size,
+        const std::uint8_t* payload = nullptr,
+        std::size_t payload_size = 0,
+        int timeout_msec = 0) {
+        const auto header_sent = send(header, header_size, timeout_msec);
+        const auto payload_sent = header_sent == header_size && payload_size
+            ? send(payload, payload_size, timeout_msec)
+            : 0;
+        if (header_sent == header_size && payload_sent == payload_size) {
+            return true;
+        }
+
+        std::vector<std::uint8_t> frame(header, header + header_size);
+        frame.insert(frame.end(), payload, payload + payload_size);
+        keep_unsent(frame.data(), frame.size(), header_sent + payload_sent);
+        return false;
+    }
+
+    // Keeps the rest of the frame the board took only `sent` bytes of the
+    // batch in, for resync() to send: the board takes whatever comes next
+    // for the rest of the frame, the probe of resync() included.
+    void keep_unsent(
+        const std::uint8_t* frames,
+        std::size_t frames_size,
+        std::size_t sent) {
+        std::size_t frame_end = 0;
+        while (frame_end < sent) {
+            frame_end += command_frame_size(frames[frame_end]);
+        }
+        _unsent.assign(frames + sent, frames + std::min(frame_end, frames_size));
+    }
+
+  private:
+    std::vector<std::uint8_t> _unsent;
+};
+
+#endif
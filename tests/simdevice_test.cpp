@@ -0,0 +1,198 @@
+/*
+    Copyright (C) 2022 kromych <kromych@users.noreply.github.com>
+
+    Permission to use, copy, modify, and/or distribute this software for any purpose with or
+    without fee is hereby granted, provided that the above copyright notice and
+    this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+    THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+    AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+    CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+// Checks that the simulated board behaves like the flash and the firmware
+// the programmer is written against, and that the transport recovers from
+// the rejected replies and the lost ones. Exits with a failure when any
+// check does not hold.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#include "icefun.hpp"
+#include "simdevice.hpp"
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);     \
+            ++failures;                                                     \
+        }                                                                   \
+    } while (0)
+
+using Frame = std::vector<std::uint8_t>;
+
+Frame page_frame(IceFunCommands cmd, std::uint32_t addr, std::uint8_t fill) {
+    Frame frame(COMMAND_HEADER_SIZE_BYTES + PAGE_SIZE_BYTES, fill);
+    frame[0] = cmd;
+    frame[1] = addr >> 16;
+    frame[2] = addr >> 8;
+    frame[3] = addr;
+    if (cmd == IceFunCommands::READ_PAGE) {
+        frame.resize(COMMAND_HEADER_SIZE_BYTES);
+    }
+    return frame;
+}
+
+// Sends the frame and returns the reply, empty when it did not come whole
+Frame exchange(Transport& dev, const Frame& frame, std::size_t reply_size) {
+    Frame reply(reply_size);
+    if (dev.transact(frame.data(), frame.size(), reply.data(), reply.size())
+        != reply.size()) {
+        return {};
+    }
+    return reply;
+}
+
+Frame program(Transport& dev, std::uint32_t addr, std::uint8_t fill) {
+    return exchange(
+        dev,
+        page_frame(IceFunCommands::PROG_PAGE, addr, fill),
+        STATUS_SIZE_BYTES);
+}
+
+Frame verify(Transport& dev, std::uint32_t addr, std::uint8_t fill) {
+    return exchange(
+        dev,
+        page_frame(IceFunCommands::VERIFY_PAGE, addr, fill),
+        STATUS_SIZE_BYTES);
+}
+
+Frame read_page(Transport& dev, std::uint32_t addr) {
+    return exchange(
+        dev,
+        page_frame(IceFunCommands::READ_PAGE, addr, 0),
+        PAGE_SIZE_BYTES);
+}
+
+const Frame PASSED {0, 0, 0, 0};
+
+bool answers(Transport& dev) {
+    return exchange(dev, {IceFunCommands::GET_VER}, 2) == Frame {38, 1};
+}
+
+bool flash_filled(
+    SimulatedDevice& dev,
+    std::uint32_t addr,
+    std::uint32_t size,
+    std::uint8_t byte) {
+    const auto begin = dev.flash().begin() + addr;
+    return std::all_of(begin, begin + size, [byte](std::uint8_t b) {
+        return b == byte;
+    });
+}
+
+void test_program_clears_bits() {
+    SimulatedDevice dev("SIM", SimTimings::none());
+    const std::uint32_t addr = 0x10100;
+
+    CHECK(program(dev, addr, 0x5a) == PASSED);
+    CHECK(flash_filled(dev, addr, PAGE_SIZE_BYTES, 0x5a));
+    CHECK(flash_filled(dev, addr + PAGE_SIZE_BYTES, PAGE_SIZE_BYTES, 0xff));
+
+    // Setting bits takes an erase: the status tells the first byte that did
+    // not come out as programmed, what was asked for and what is there
+    CHECK(program(dev, addr, 0x0f) == Frame({1, 0, 0x0f, 0x0a}));
+    CHECK(flash_filled(dev, addr, PAGE_SIZE_BYTES, 0x0a));
+
+    CHECK(verify(dev, addr, 0x0a) == PASSED);
+    CHECK(read_page(dev, addr) == Frame(PAGE_SIZE_BYTES, 0x0a));
+}
+
+void test_erase() {
+    SimulatedDevice dev("SIM", SimTimings::none());
+    for (const auto addr : {0x10000u, 0x20000u}) {
+        CHECK(program(dev, addr, 0) == PASSED);
+    }
+
+    CHECK(exchange(dev, {IceFunCommands::ERASE_64k, 1}, 1) == Frame {0});
+    CHECK(flash_filled(dev, 0x10000, SECTOR_SIZE_BYTES, 0xff));
+    CHECK(flash_filled(dev, 0x20000, PAGE_SIZE_BYTES, 0x00));
+
+    CHECK(exchange(dev, {IceFunCommands::ERASE_CHIP}, 1) == Frame {0});
+    CHECK(flash_filled(dev, 0, MAX_FLASH_SIZE_BYTES, 0xff));
+}
+
+// The replies to the commands sent after the rejected one are dropped, so
+// that the next exchange gets its own reply
+void test_pipeline_drains() {
+    SimulatedDevice dev("SIM", SimTimings::none());
+    constexpr std::size_t COUNT = 8;
+    constexpr std::size_t REJECTED = 2;
+
+    std::size_t sent = 0;
+    const auto completed = dev.pipeline(
+        COUNT,
+        COMMAND_HEADER_SIZE_BYTES,
+        0,
+        PAGE_SIZE_BYTES,
+        [&](std::size_t idx, std::uint8_t* frame) {
+            const auto header = page_frame(
+                IceFunCommands::READ_PAGE,
+                idx * PAGE_SIZE_BYTES,
+                0);
+            std::copy(header.begin(), header.end(), frame);
+            ++sent;
+            return nullptr;
+        },
+        [](std::size_t idx, const std::uint8_t*) { return idx != REJECTED; },
+        4);
+
+    CHECK(completed == REJECTED);
+    CHECK(sent > REJECTED + 1);
+    CHECK(sent < COUNT);
+    CHECK(answers(dev));
+}
+
+// The board losing a reply stalls and takes only half of the next frame,
+// resync() sends the rest of it and gets the board answering again
+void test_resync_after_partial_frame() {
+    const auto timings = SimTimings::named("flaky");
+    SimulatedDevice dev("SIM", timings);
+    const std::uint32_t addr = 0x30000;
+
+    for (auto idx = 1u; idx < timings.stall_every; ++idx) {
+        CHECK(answers(dev));
+    }
+    CHECK(!answers(dev));
+
+    CHECK(program(dev, addr, 0x33).empty());
+    CHECK(flash_filled(dev, addr, PAGE_SIZE_BYTES, 0xff));
+
+    CHECK(dev.resync());
+    CHECK(flash_filled(dev, addr, PAGE_SIZE_BYTES, 0x33));
+    CHECK(answers(dev));
+    CHECK(read_page(dev, addr) == Frame(PAGE_SIZE_BYTES, 0x33));
+}
+
+}  // namespace
+
+int main() {
+    test_program_clears_bits();
+    test_erase();
+    test_pipeline_drains();
+    test_resync_after_partial_frame();
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}